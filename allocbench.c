@@ -0,0 +1,135 @@
+/*
+ * file:        allocbench.c
+ * description: block allocator microbenchmark - compares balloc with
+ *              the original bit-at-a-time first-fit scan on a bitmap
+ *              that is 10%, 90% and 99% full.
+ *
+ *  usage: ./allocbench [-n nblocks] [-o ops]
+ *     each op allocates one block and frees a random allocated one,
+ *     so the fill level stays constant.
+ */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "balloc.h"
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* the allocator fs.c used to have */
+static unsigned char *lin_map;
+static int lin_nblks;
+
+static int lin_alloc(void)
+{
+    int i;
+
+    for (i = 0; i < lin_nblks; i++)
+        if ((lin_map[i/8] & (1 << (i%8))) == 0) {
+            lin_map[i/8] |= 1 << (i%8);
+            return i;
+        }
+    return -1;
+}
+
+static void lin_free(int i)
+{
+    lin_map[i/8] &= ~(1 << (i%8));
+}
+
+static struct balloc ba;
+
+static int ba_alloc(void)
+{
+    return balloc_alloc(&ba);
+}
+
+static void ba_free(int i)
+{
+    balloc_free(&ba, i);
+}
+
+/* fill 'map' to 'pct' percent at random; returns the used blocks */
+static int fill(unsigned char *map, int nblks, int pct, int *used)
+{
+    int i, n = 0;
+
+    memset(map, 0, (nblks + 63) / 64 * 8);
+    for (i = 0; i < nblks; i++)
+        if (rand() % 100 < pct) {
+            map[i/8] |= 1 << (i%8);
+            used[n++] = i;
+        }
+    return n;
+}
+
+static double run(int (*alloc)(void), void (*release)(int), int *used,
+                  int nused, int ops)
+{
+    double t0 = now();
+    int i, j, b;
+
+    for (i = 0; i < ops; i++) {
+        if ((b = alloc()) < 0)
+            break;
+        j = rand() % nused;
+        release(used[j]);
+        used[j] = b;
+    }
+    return (now() - t0) * 1e9 / ops;
+}
+
+int main(int argc, char **argv)
+{
+    int nblks = 1 << 20, ops = 20000;
+    int pcts[] = {10, 90, 99};
+    int c, i, n, *used;
+    unsigned char *map;
+
+    while ((c = getopt(argc, argv, "n:o:")) != -1)
+        switch (c) {
+        case 'n': nblks = atoi(optarg); break;
+        case 'o': ops = atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-n nblocks] [-o ops]\n", argv[0]);
+            exit(1);
+        }
+    if (nblks < 64 || ops < 1) {
+        fprintf(stderr, "usage: %s [-n nblocks (>= 64)] [-o ops]\n", argv[0]);
+        exit(1);
+    }
+
+    map = aligned_alloc(8, (nblks + 63) / 64 * 8);
+    used = malloc(nblks * sizeof(int));
+    lin_map = map;
+    lin_nblks = nblks;
+
+    printf("%d alloc/free pairs over %d blocks\n", ops, nblks);
+    for (i = 0; i < 3; i++) {
+        srand(5600);
+        n = fill(map, nblks, pcts[i], used);
+        printf("%3d%% full  first-fit %10.1f ns/op", pcts[i],
+               run(lin_alloc, lin_free, used, n, ops));
+
+        srand(5600);
+        n = fill(map, nblks, pcts[i], used);
+        balloc_init(&ba, map, nblks, -1, NULL);
+        printf("   balloc %8.1f ns/op\n",
+               run(ba_alloc, ba_free, used, n, ops));
+    }
+
+    balloc_destroy(&ba);
+    free(map);
+    free(used);
+    return 0;
+}
@@ -0,0 +1,333 @@
+/*
+ * file:        balloc.c
+ * description: bitmap allocator, used for both blocks and (with a
+ *              packed inode table) inodes. The bitmap is scanned a
+ *              64-bit word at a time with count-trailing-zeros, and a
+ *              second level summary - one bit per bitmap word, set if
+ *              that word has a free bit - lets a search skip 4096 full
+ *              entries per summary word. Allocation is next-fit: each
+ *              search starts at a rotor left where the previous one
+ *              succeeded, so the cost doesn't grow with how full the
+ *              volume is. A running count of free entries is kept
+ *              alongside, so statfs doesn't have to scan anything, and
+ *              a dirty flag per bitmap block so only the changed ones
+ *              get written.
+ *
+ *              Bitmap blocks can be read in lazily, the first time a
+ *              search or a free reaches them. Until then the summary
+ *              claims their words have free bits, so a search stops
+ *              there and loads the block to find out.
+ */
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "balloc.h"
+
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "the bitmap is scanned as native 64-bit words"
+#endif
+
+/* ba->mstate, per BALLOC_MAP_BITS bitmap block */
+#define MAP_LOADED 1
+#define MAP_DIRTY  2
+#define MAP_BAD    4            /* couldn't be read - treated as full */
+
+#define MAP_WORDS (BALLOC_MAP_BITS / 64)
+
+/* free bits in word 'w' */
+static uint64_t free_bits(struct balloc *ba, int w)
+{
+    uint64_t f = ~ba->words[w];
+
+    if (w == ba->nwords - 1)
+        f &= ~ba->tail_used;
+    return f;
+}
+
+static void sum_update(struct balloc *ba, int w)
+{
+    if (free_bits(ba, w))
+        ba->summary[w / 64] |= 1ULL << (w % 64);
+    else
+        ba->summary[w / 64] &= ~(1ULL << (w % 64));
+}
+
+/* make sure the bitmap block holding word 'w' is in memory */
+static void map_load(struct balloc *ba, int w)
+{
+    int i = w / MAP_WORDS, end;
+    uint64_t *p = ba->words + (size_t) i * MAP_WORDS;
+
+    if (ba->mstate[i] & MAP_LOADED)
+        return;
+    if (ba->load(p, i) < 0) {
+        memset(p, 0xff, MAP_WORDS * sizeof(uint64_t));
+        ba->mstate[i] |= MAP_BAD;
+    }
+    ba->mstate[i] |= MAP_LOADED;
+    end = (i + 1) * MAP_WORDS < ba->nwords ? (i + 1) * MAP_WORDS : ba->nwords;
+    for (w = i * MAP_WORDS; w < end; w++)
+        sum_update(ba, w);
+}
+
+static void map_dirty(struct balloc *ba, int b)
+{
+    if (!(ba->mstate[b / BALLOC_MAP_BITS] & MAP_BAD))
+        ba->mstate[b / BALLOC_MAP_BITS] |= MAP_DIRTY;
+}
+
+int balloc_init(struct balloc *ba, unsigned char *map, int nblks,
+                int free_hint, int (*load)(void *buf, int idx))
+{
+    int w, i;
+
+    balloc_destroy(ba);
+    pthread_mutex_init(&ba->lock, NULL);
+    ba->words = (uint64_t *) map;
+    ba->nblocks = nblks;
+    ba->nwords = (nblks + 63) / 64;
+    ba->nsum = (ba->nwords + 63) / 64;
+    ba->tail_used = (nblks % 64) ? ~0ULL << (nblks % 64) : 0;
+    ba->rotor = 0;
+    ba->load = load;
+    ba->nmap = (nblks + BALLOC_MAP_BITS - 1) / BALLOC_MAP_BITS;
+    ba->summary = calloc(ba->nsum ? ba->nsum : 1, sizeof(uint64_t));
+    ba->mstate = calloc(ba->nmap ? ba->nmap : 1, 1);
+    if (ba->summary == NULL || ba->mstate == NULL) {
+        balloc_destroy(ba);
+        return -ENOMEM;
+    }
+    if (load == NULL) {
+        for (i = 0; i < ba->nmap; i++)
+            ba->mstate[i] = MAP_LOADED;
+        for (w = 0; w < ba->nwords; w++)
+            sum_update(ba, w);
+    } else
+        for (w = 0; w < ba->nwords; w++)        // unknown yet
+            ba->summary[w / 64] |= 1ULL << (w % 64);
+
+    if (free_hint >= 0 && free_hint <= nblks)
+        ba->nfree = free_hint;
+    else
+        for (w = 0, ba->nfree = 0; w < ba->nwords; w++) {
+            map_load(ba, w);
+            ba->nfree += __builtin_popcountll(free_bits(ba, w));
+        }
+    return 0;
+}
+
+void balloc_destroy(struct balloc *ba)
+{
+    free(ba->summary);
+    free(ba->mstate);
+    ba->summary = NULL;
+    ba->mstate = NULL;
+    ba->nblocks = ba->nwords = ba->nsum = ba->nmap = ba->nfree = 0;
+}
+
+/* first word at or after 'w' with a free bit, or -1 */
+static int find_word(struct balloc *ba, int w)
+{
+    int s = w / 64;
+    uint64_t m;
+
+    for (;;) {
+        if (w >= ba->nwords)
+            return -1;
+        m = ba->summary[s] & (~0ULL << (w % 64));
+        while (m == 0) {
+            if (++s >= ba->nsum)
+                return -1;
+            m = ba->summary[s];
+        }
+        w = s * 64 + __builtin_ctzll(m);
+        if (ba->mstate[w / MAP_WORDS] & MAP_LOADED)
+            return w;
+        map_load(ba, w);        // updates the summary, look again
+    }
+}
+
+/* first free block at or after 'b', or -1 */
+static int next_free(struct balloc *ba, int b)
+{
+    uint64_t f;
+    int w;
+
+    if (b >= ba->nblocks)
+        return -1;
+    map_load(ba, b / 64);
+    f = free_bits(ba, b / 64) & (~0ULL << (b % 64));
+    if (f)
+        return (b / 64) * 64 + __builtin_ctzll(f);
+    if ((w = find_word(ba, b / 64 + 1)) < 0)
+        return -1;
+    return w * 64 + __builtin_ctzll(free_bits(ba, w));
+}
+
+/* number of free blocks starting at 'b', up to 'max' */
+static int run_len(struct balloc *ba, int b, int max)
+{
+    int n = 0, k;
+    uint64_t f;
+
+    while (n < max && b < ba->nblocks) {
+        map_load(ba, b / 64);
+        f = free_bits(ba, b / 64) >> (b % 64); // shifts in "used" bits
+        k = (~f == 0) ? 64 : __builtin_ctzll(~f);
+        if (k == 0)
+            break;
+        n += k;
+        b += k;
+        if (b % 64 != 0)
+            break;
+    }
+    return n < max ? n : max;
+}
+
+static void mark_used(struct balloc *ba, int b, int n)
+{
+    int i;
+
+    for (i = b; i < b + n; i++) {
+        ba->words[i / 64] |= 1ULL << (i % 64);
+        if (i % 64 == 63 || i == b + n - 1)
+            sum_update(ba, i / 64);
+        map_dirty(ba, i);
+    }
+}
+
+/* how far past the goal to look for a run of the full length before
+ * settling for whatever is free closest to it
+ */
+#define RUN_SEARCH (64 * 64)
+
+int balloc_alloc_run(struct balloc *ba, int goal, int want, int *got)
+{
+    int b, n, first = -1, first_len = 0;
+    int pass;
+
+    if (want < 1)
+        want = 1;
+
+    pthread_mutex_lock(&ba->lock);
+    if (goal < 0 || goal >= ba->nblocks)
+        goal = 0;
+    for (pass = 0; pass < 2 && first < 0; pass++) {
+        b = pass ? 0 : goal;
+        while ((b = next_free(ba, b)) >= 0) {
+            n = run_len(ba, b, want);
+            if (first < 0) {
+                first = b;
+                first_len = n;
+            }
+            if (n == want) {
+                first = b;
+                first_len = n;
+                break;
+            }
+            if (b - first >= RUN_SEARCH)
+                break;
+            b += n;
+        }
+    }
+    if (first >= 0) {
+        mark_used(ba, first, first_len);
+        ba->nfree -= first_len;
+    }
+    pthread_mutex_unlock(&ba->lock);
+
+    *got = first_len;
+    return first >= 0 ? first : -ENOSPC;
+}
+
+int balloc_alloc(struct balloc *ba)
+{
+    int w, bit;
+
+    pthread_mutex_lock(&ba->lock);
+    if ((w = find_word(ba, ba->rotor)) < 0 && (w = find_word(ba, 0)) < 0) {
+        pthread_mutex_unlock(&ba->lock);
+        return -ENOSPC;
+    }
+    bit = __builtin_ctzll(free_bits(ba, w));
+    ba->words[w] |= 1ULL << bit;
+    sum_update(ba, w);
+    ba->rotor = w;
+    ba->nfree--;
+    map_dirty(ba, w * 64);
+    pthread_mutex_unlock(&ba->lock);
+    return w * 64 + bit;
+}
+
+void balloc_free_run(struct balloc *ba, int blk, int n)
+{
+    uint64_t m;
+    int k;
+
+    pthread_mutex_lock(&ba->lock);
+    if (blk < 0 || blk >= ba->nblocks)
+        n = 0;
+    else if (n > ba->nblocks - blk)
+        n = ba->nblocks - blk;
+    for (; n > 0; blk += k, n -= k) {
+        k = 64 - blk % 64 < n ? 64 - blk % 64 : n;
+        m = (k == 64 ? ~0ULL : (1ULL << k) - 1) << (blk % 64);
+        map_load(ba, blk / 64);
+        if (ba->mstate[blk / BALLOC_MAP_BITS] & MAP_BAD)
+            continue;
+        ba->nfree += __builtin_popcountll(ba->words[blk / 64] & m);
+        ba->words[blk / 64] &= ~m;
+        sum_update(ba, blk / 64);
+        map_dirty(ba, blk);
+    }
+    pthread_mutex_unlock(&ba->lock);
+}
+
+void balloc_free(struct balloc *ba, int blk)
+{
+    balloc_free_run(ba, blk, 1);
+}
+
+int balloc_test(struct balloc *ba, int blk)
+{
+    int rv = 1;
+
+    pthread_mutex_lock(&ba->lock);
+    if (blk >= 0 && blk < ba->nblocks) {
+        map_load(ba, blk / 64);
+        rv = (ba->words[blk / 64] >> (blk % 64)) & 1;
+    }
+    pthread_mutex_unlock(&ba->lock);
+    return rv;
+}
+
+int balloc_nfree(struct balloc *ba)
+{
+    int n;
+
+    pthread_mutex_lock(&ba->lock);
+    n = ba->nfree;
+    pthread_mutex_unlock(&ba->lock);
+    return n;
+}
+
+int balloc_sync(struct balloc *ba, int (*write)(void *buf, int idx))
+{
+    int i, rv = 0;
+
+    pthread_mutex_lock(&ba->lock);
+    for (i = 0; i < ba->nmap; i++)
+        if (ba->mstate[i] & MAP_DIRTY) {
+            if (write(ba->words + (size_t) i * MAP_WORDS, i) < 0)
+                rv = -EIO;
+            else
+                ba->mstate[i] &= ~MAP_DIRTY;
+        }
+    pthread_mutex_unlock(&ba->lock);
+    return rv;
+}
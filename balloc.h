@@ -0,0 +1,75 @@
+/*
+ * file:        balloc.h
+ * description: bitmap allocator - free blocks, or free inodes in a
+ *              packed inode table
+ */
+#ifndef __BALLOC_H__
+#define __BALLOC_H__
+
+#include <stdint.h>
+#include <pthread.h>
+
+/* bits in one block of the on-disk bitmap */
+#define BALLOC_MAP_BITS (4096 * 8)
+
+/* one bitmap. The fields are private to balloc.c; a zeroed struct is
+ * ready for balloc_init.
+ */
+struct balloc {
+    pthread_mutex_t lock;
+    uint64_t *words;            /* the bitmap itself */
+    uint64_t *summary;          /* bit w set = words[w] has a free bit */
+    int nwords, nsum, nblocks;
+    uint64_t tail_used;         /* bits past the end of the last word */
+    int rotor;                  /* word where the next search starts */
+    int nfree;
+    unsigned char *mstate;      /* per bitmap block: loaded, dirty, bad */
+    int nmap;
+    int (*load)(void *buf, int idx);
+};
+
+/* Take over 'map', the in-memory copy of the bitmap (bit i set = block
+ * i in use, bit i%8 of byte i/8), covering 'nblks' blocks. The map is
+ * updated in place, and written back with balloc_sync; it must be
+ * 8-byte aligned and padded to a whole number of bitmap blocks.
+ * 'free_hint' is the number of free blocks if known, or -1 to count
+ * them. If 'load' is NULL the map must already be filled in; otherwise
+ * it is called as load(buf, idx) to read bitmap block 'idx' into 'buf'
+ * the first time it's needed, and returns 0 or -EIO. Not thread-safe
+ * against other calls on the same 'ba'.
+ */
+int balloc_init(struct balloc *ba, unsigned char *map, int nblks,
+                int free_hint, int (*load)(void *buf, int idx));
+
+/* release the allocator's own memory (not the map) */
+void balloc_destroy(struct balloc *ba);
+
+/* allocate one block and mark it in use. Returns the block number or
+ * -ENOSPC.
+ */
+int balloc_alloc(struct balloc *ba);
+
+/* allocate up to 'want' contiguous blocks as close after 'goal' as
+ * possible: the first free run of the full length within a short
+ * distance, otherwise the free blocks nearest the goal. Returns the
+ * first block and sets *got to the run length, or returns -ENOSPC.
+ */
+int balloc_alloc_run(struct balloc *ba, int goal, int want, int *got);
+
+void balloc_free(struct balloc *ba, int blk);
+
+/* free 'n' blocks from 'blk' on, a bitmap word at a time */
+void balloc_free_run(struct balloc *ba, int blk, int n);
+int balloc_test(struct balloc *ba, int blk);
+
+/* number of free blocks, kept up to date by alloc/free */
+int balloc_nfree(struct balloc *ba);
+
+/* call write(buf, idx) for each bitmap block changed since it was last
+ * written - block 'idx' of the map, at 'buf'. The map can't change
+ * while this runs. Returns 0, or -EIO if any write failed; those
+ * blocks stay dirty.
+ */
+int balloc_sync(struct balloc *ba, int (*write)(void *buf, int idx));
+
+#endif
@@ -0,0 +1,849 @@
+/*
+ * file:        bcache.c
+ * description: sharded LRU block cache, keyed by LBA. Each shard has
+ *              its own lock, hash table and LRU list; consecutive
+ *              LBAs land in different shards.
+ *
+ *              In write-back mode writes only mark the cached block
+ *              dirty. Dirty blocks are never evicted; bcache_flush
+ *              writes them out in LBA order, either when asked (fsync,
+ *              unmount), from a timer thread, or when too much of the
+ *              cache is dirty. Blocks written with bcache_write_first
+ *              go out in a batch of their own, completed before the
+ *              rest are started.
+ *
+ *              Readahead requests are queued to a prefetch thread that
+ *              reads them in the background.
+ */
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "fs5600.h"
+#include "blkdev.h"
+#include "bcache.h"
+
+#define BC_SHARDS 16            /* power of 2 */
+#define RUN_MAX 256             /* most blocks moved by one request */
+
+struct bc_entry {
+    int lba;
+    int dirty;
+    int first;                          /* dirty, and flushed first */
+    unsigned long version;              /* bumped on every cached write */
+    struct bc_entry *hnext;             /* hash chain */
+    struct bc_entry *prev, *next;       /* LRU list, most recent first */
+    char data[FS_BLOCK_SIZE];
+};
+
+struct bc_shard {
+    pthread_mutex_t lock;
+    struct bc_entry **hash;
+    unsigned nbuckets;                  /* power of 2 */
+    struct bc_entry *head, *tail;
+    int count, max;
+    unsigned long hits, misses, evictions;
+};
+
+static struct bc_shard shards[BC_SHARDS];
+static int bc_enabled;
+
+/* write-back state. Only bcache_flush writes dirty blocks, and
+ * flush_lock serializes flushes, so the disk only ever moves forward.
+ * Flushes are numbered as they start; bc_flushed is the last one that
+ * completed without errors.
+ */
+static int bc_writeback;
+static long bc_ndirty, bc_dirty_max;
+static pthread_mutex_t flush_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long bc_flush_started, bc_flushed;
+
+static pthread_t wb_thread;
+static pthread_mutex_t wb_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wb_cond = PTHREAD_COND_INITIALIZER;
+static int wb_running, wb_stop, wb_kick, wb_secs;
+
+/* prefetch queue. Readahead is only a hint, so when the queue is full
+ * new requests are dropped.
+ */
+#define PF_QUEUE 16
+
+struct pf_job {
+    int n;
+    int lbas[BLK_BATCH_MAX];
+};
+
+static struct pf_job pf_queue[PF_QUEUE];
+static int pf_head, pf_count, pf_busy, pf_running, pf_stop;
+static unsigned long pf_blocks;
+static pthread_t pf_thread;
+static pthread_mutex_t pf_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pf_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pf_idle = PTHREAD_COND_INITIALIZER;
+
+static void wb_wakeup(void)
+{
+    pthread_mutex_lock(&wb_lock);
+    wb_kick = 1;
+    pthread_cond_signal(&wb_cond);
+    pthread_mutex_unlock(&wb_lock);
+}
+
+/* Write sequence numbers, one per slot, blocks hashed to slots by
+ * LBA. A write bumps its blocks' slots before and after. A reader that
+ * saw the same sum over its blocks' slots before and after its disk
+ * read knows no write to those blocks overlapped it (they only go up),
+ * so the data it read may be cached; otherwise it skips the insert.
+ * Writes to other blocks don't get in the way, short of a collision.
+ */
+#define WSEQ_SLOTS 4096         /* power of 2 */
+
+static unsigned long bc_wseq[WSEQ_SLOTS];
+
+static struct bc_shard *shard_of(int lba)
+{
+    return &shards[lba & (BC_SHARDS - 1)];
+}
+
+static struct bc_entry **bucket(struct bc_shard *s, int lba)
+{
+    return &s->hash[((unsigned) lba / BC_SHARDS) & (s->nbuckets - 1)];
+}
+
+static struct bc_entry *lookup(struct bc_shard *s, int lba)
+{
+    struct bc_entry *e;
+
+    for (e = *bucket(s, lba); e != NULL; e = e->hnext)
+        if (e->lba == lba)
+            return e;
+    return NULL;
+}
+
+static void unhash(struct bc_shard *s, struct bc_entry *e)
+{
+    struct bc_entry **pp;
+
+    for (pp = bucket(s, e->lba); *pp != e; pp = &(*pp)->hnext)
+        ;
+    *pp = e->hnext;
+}
+
+static void lru_remove(struct bc_shard *s, struct bc_entry *e)
+{
+    if (e->prev)
+        e->prev->next = e->next;
+    else
+        s->head = e->next;
+    if (e->next)
+        e->next->prev = e->prev;
+    else
+        s->tail = e->prev;
+}
+
+static void lru_push(struct bc_shard *s, struct bc_entry *e)
+{
+    e->prev = NULL;
+    e->next = s->head;
+    if (s->head)
+        s->head->prev = e;
+    s->head = e;
+    if (s->tail == NULL)
+        s->tail = e;
+}
+
+/* get an unused entry, evicting the least recently used clean block
+ * if the shard is at its budget. If every block is dirty the shard
+ * goes over budget until the flusher catches up. Called with the
+ * shard locked.
+ */
+static struct bc_entry *get_entry(struct bc_shard *s)
+{
+    struct bc_entry *e;
+
+    if (s->count < s->max) {
+        if ((e = malloc(sizeof(*e))) != NULL) {
+            s->count++;
+            return e;
+        }
+    }
+    for (e = s->tail; e != NULL && e->dirty; e = e->prev)
+        ;
+    if (e == NULL) {
+        if ((e = malloc(sizeof(*e))) != NULL)
+            s->count++;
+        wb_wakeup();
+        return e;
+    }
+    lru_remove(s, e);
+    unhash(s, e);
+    s->evictions++;
+    return e;
+}
+
+/* how insert treats the data it is given */
+enum { INS_FILL, INS_UPDATE, INS_DIRTY, INS_FIRST };
+
+/* copy a block into the cache. INS_FILL (the block was just read)
+ * leaves an existing copy alone, since it can only be newer than what
+ * the caller read. INS_UPDATE (written through to disk) overwrites it,
+ * and INS_DIRTY (write-back) overwrites it and marks it dirty.
+ * INS_FIRST is INS_DIRTY for a block that is flushed first.
+ * Returns -ENOMEM if a dirty block could not be cached.
+ */
+static int insert(int lba, const void *data, int how)
+{
+    struct bc_shard *s = shard_of(lba);
+    struct bc_entry *e;
+
+    pthread_mutex_lock(&s->lock);
+    if ((e = lookup(s, lba)) != NULL) {
+        lru_remove(s, e);
+    } else if ((e = get_entry(s)) != NULL) {
+        e->lba = lba;
+        e->dirty = e->first = 0;
+        e->version = 0;
+        e->hnext = *bucket(s, lba);
+        *bucket(s, lba) = e;
+        how = (how == INS_FILL) ? INS_UPDATE : how;
+    } else {
+        pthread_mutex_unlock(&s->lock);
+        return how >= INS_DIRTY ? -ENOMEM : 0;
+    }
+    if (how != INS_FILL) {
+        memcpy(e->data, data, FS_BLOCK_SIZE);
+        e->version++;
+    }
+    if (how == INS_FIRST)
+        e->first = 1;
+    if (how >= INS_DIRTY && !e->dirty) {
+        e->dirty = 1;
+        __atomic_add_fetch(&bc_ndirty, 1, __ATOMIC_RELAXED);
+    }
+    lru_push(s, e);
+    pthread_mutex_unlock(&s->lock);
+    return 0;
+}
+
+static int contains(int lba)
+{
+    struct bc_shard *s = shard_of(lba);
+    int found;
+
+    pthread_mutex_lock(&s->lock);
+    found = lookup(s, lba) != NULL;
+    pthread_mutex_unlock(&s->lock);
+    return found;
+}
+
+/* copy a cached block out. Returns 1 on a hit, 0 on a miss.
+ */
+static int fetch(int lba, void *buf)
+{
+    struct bc_shard *s = shard_of(lba);
+    struct bc_entry *e;
+
+    pthread_mutex_lock(&s->lock);
+    if ((e = lookup(s, lba)) != NULL) {
+        memcpy(buf, e->data, FS_BLOCK_SIZE);
+        lru_remove(s, e);
+        lru_push(s, e);
+        s->hits++;
+    } else
+        s->misses++;
+    pthread_mutex_unlock(&s->lock);
+    return e != NULL;
+}
+
+static unsigned long wseq_get(int lba)
+{
+    return __atomic_load_n(&bc_wseq[lba & (WSEQ_SLOTS - 1)], __ATOMIC_ACQUIRE);
+}
+
+/* sum over [lba, lba+nblks) - each slot once, past WSEQ_SLOTS blocks */
+static unsigned long wseq_run(int lba, int nblks)
+{
+    unsigned long sum = 0;
+    int i;
+
+    for (i = 0; i < nblks && i < WSEQ_SLOTS; i++)
+        sum += wseq_get(lba + i);
+    return sum;
+}
+
+/* sum over lbas[i] for every i where want[i] is set (or all) */
+static unsigned long wseq_list(const int *lbas, const char *want, int n)
+{
+    unsigned long sum = 0;
+    int i;
+
+    for (i = 0; i < n; i++)
+        if (want == NULL || want[i])
+            sum += wseq_get(lbas[i]);
+    return sum;
+}
+
+static void wseq_bump(int lba, int nblks)
+{
+    int i;
+
+    for (i = 0; i < nblks && i < WSEQ_SLOTS; i++)
+        __atomic_add_fetch(&bc_wseq[(lba + i) & (WSEQ_SLOTS - 1)], 1,
+                           __ATOMIC_ACQ_REL);
+}
+
+/* read [lba, lba+nblks) from disk into buf, and cache it unless a
+ * write raced with the read.
+ */
+static int fill(char *buf, int lba, int nblks)
+{
+    unsigned long seq = wseq_run(lba, nblks);
+    int i, rv;
+
+    if ((rv = block_read(buf, lba, nblks)) < 0)
+        return rv;
+    if (wseq_run(lba, nblks) == seq)
+        for (i = 0; i < nblks; i++)
+            insert(lba + i, buf + i * FS_BLOCK_SIZE, INS_FILL);
+    return 0;
+}
+
+int bcache_read(void *buf, int lba, int nblks)
+{
+    char *p = buf;
+    int i, miss = -1, rv = 0;
+
+    if (!bc_enabled)
+        return block_read(buf, lba, nblks);
+
+    /* misses are read from disk in contiguous runs */
+    for (i = 0; i < nblks; i++) {
+        if (fetch(lba + i, p + i * FS_BLOCK_SIZE)) {
+            if (miss >= 0)
+                rv |= fill(p + miss * FS_BLOCK_SIZE, lba + miss, i - miss);
+            miss = -1;
+        } else if (miss < 0)
+            miss = i;
+    }
+    if (miss >= 0)
+        rv |= fill(p + miss * FS_BLOCK_SIZE, lba + miss, nblks - miss);
+    return rv;
+}
+
+/* read lbas[i] into bufs[i] for every i where want[i] is set (all of
+ * them if 'want' is NULL). Physically contiguous runs become a single
+ * vectored request, and all the runs go to the backend as one batch.
+ */
+static int read_runs(const int *lbas, void **bufs, const char *want, int n)
+{
+    struct blk_batch batch;
+    struct iovec *iov;
+    int i, j, rv = 0;
+
+    if (n == 0)
+        return 0;
+    if ((iov = malloc(n * sizeof(*iov))) == NULL)
+        return -EIO;
+    block_batch_init(&batch);
+    for (i = 0; i < n; i = j) {
+        if (want != NULL && !want[i]) {
+            j = i + 1;
+            continue;
+        }
+        for (j = i; j < n && j - i < RUN_MAX && (want == NULL || want[j]) &&
+                 lbas[j] == lbas[i] + (j - i); j++) {
+            iov[j].iov_base = bufs[j];
+            iov[j].iov_len = FS_BLOCK_SIZE;
+        }
+        if (j - i == 1)
+            rv |= block_batch_read(&batch, bufs[i], lbas[i], 1);
+        else
+            rv |= block_batch_readv(&batch, &iov[i], j - i, lbas[i], j - i);
+    }
+    rv |= block_batch_submit(&batch);
+    free(iov);
+    return rv;
+}
+
+int bcache_read_list(const int *lbas, void **bufs, int n)
+{
+    unsigned long seq;
+    int i, rv;
+    char *missed;
+
+    if (!bc_enabled)
+        return read_runs(lbas, bufs, NULL, n);
+
+    /* no memory to batch with: one block at a time still works */
+    if ((missed = calloc(n, 1)) == NULL) {
+        for (i = rv = 0; i < n; i++)
+            rv |= bcache_read(bufs[i], lbas[i], 1);
+        return rv;
+    }
+    for (i = 0; i < n; i++)
+        missed[i] = !fetch(lbas[i], bufs[i]);
+    seq = wseq_list(lbas, missed, n);
+    rv = read_runs(lbas, bufs, missed, n);
+    if (rv == 0 && wseq_list(lbas, missed, n) == seq)
+        for (i = 0; i < n; i++)
+            if (missed[i])
+                insert(lbas[i], bufs[i], INS_FILL);
+    free(missed);
+    return rv;
+}
+
+static int write_blocks(void *buf, int lba, int nblks, int how)
+{
+    char *p = buf;
+    int i, rv;
+
+    if (!bc_enabled)
+        return block_write(buf, lba, nblks);
+
+    wseq_bump(lba, nblks);
+    if (bc_writeback) {
+        rv = 0;
+        for (i = 0; i < nblks; i++)
+            if ((rv = insert(lba + i, p + i * FS_BLOCK_SIZE, how)) < 0)
+                break;
+        if (rv < 0)             /* out of memory - write through */
+            rv = block_write(p + i * FS_BLOCK_SIZE, lba + i, nblks - i);
+        if (__atomic_load_n(&bc_ndirty, __ATOMIC_RELAXED) > bc_dirty_max)
+            wb_wakeup();
+    } else {
+        rv = block_write(buf, lba, nblks);
+        if (rv == 0)
+            for (i = 0; i < nblks; i++)
+                insert(lba + i, p + i * FS_BLOCK_SIZE, INS_UPDATE);
+        else
+            bcache_invalidate(lba, nblks);
+    }
+    wseq_bump(lba, nblks);
+    return rv;
+}
+
+int bcache_write(void *buf, int lba, int nblks)
+{
+    return write_blocks(buf, lba, nblks, INS_DIRTY);
+}
+
+int bcache_write_first(void *buf, int lba, int nblks)
+{
+    return write_blocks(buf, lba, nblks, INS_FIRST);
+}
+
+unsigned long bcache_flush_seq(void)
+{
+    if (!__atomic_load_n(&bc_writeback, __ATOMIC_SEQ_CST))
+        return bcache_flushed();
+    return __atomic_load_n(&bc_flush_started, __ATOMIC_SEQ_CST) + 1;
+}
+
+unsigned long bcache_flushed(void)
+{
+    return __atomic_load_n(&bc_flushed, __ATOMIC_SEQ_CST);
+}
+
+/* prefetch thread: pulls jobs off the queue and reads whatever isn't
+ * cached yet in one batch, coalescing contiguous runs
+ */
+static void *prefetcher(void *arg)
+{
+    char *bufs = malloc(BLK_BATCH_MAX * FS_BLOCK_SIZE);
+    void *bp[BLK_BATCH_MAX];
+    int lbas[BLK_BATCH_MAX];
+    struct pf_job *job;
+    unsigned long seq;
+    int i, n, rv;
+
+    (void) arg;
+    for (i = 0; i < BLK_BATCH_MAX; i++)
+        bp[i] = bufs + i * FS_BLOCK_SIZE;
+    pthread_mutex_lock(&pf_lock);
+    while (!pf_stop) {
+        if (pf_count == 0) {
+            pthread_cond_wait(&pf_cond, &pf_lock);
+            continue;
+        }
+        job = &pf_queue[pf_head];
+        for (i = n = 0; i < job->n; i++)
+            if (!contains(job->lbas[i]))
+                lbas[n++] = job->lbas[i];
+        pf_head = (pf_head + 1) % PF_QUEUE;
+        pf_count--;
+        pf_busy = 1;
+        pthread_mutex_unlock(&pf_lock);
+
+        seq = wseq_list(lbas, NULL, n);
+        rv = read_runs(lbas, bp, NULL, n);
+        if (rv == 0 && wseq_list(lbas, NULL, n) == seq)
+            for (i = 0; i < n; i++)
+                insert(lbas[i], bp[i], INS_FILL);
+
+        pthread_mutex_lock(&pf_lock);
+        if (rv == 0)
+            pf_blocks += n;
+        pf_busy = 0;
+        pthread_cond_broadcast(&pf_idle);
+    }
+    pthread_mutex_unlock(&pf_lock);
+    free(bufs);
+    return NULL;
+}
+
+void bcache_prefetch(const int *lbas, int n)
+{
+    struct pf_job *job;
+    int k;
+
+    /* nothing to gain if the backend can hand out pointers */
+    if (!bc_enabled || n <= 0 || block_map(lbas[0], 1) != NULL)
+        return;
+
+    pthread_mutex_lock(&pf_lock);
+    if (!pf_running) {
+        pf_stop = 0;
+        if (pthread_create(&pf_thread, NULL, prefetcher, NULL) != 0) {
+            pthread_mutex_unlock(&pf_lock);
+            return;
+        }
+        pf_running = 1;
+    }
+    while (n > 0 && pf_count < PF_QUEUE) {
+        job = &pf_queue[(pf_head + pf_count) % PF_QUEUE];
+        k = (n < BLK_BATCH_MAX) ? n : BLK_BATCH_MAX;
+        memcpy(job->lbas, lbas, k * sizeof(int));
+        job->n = k;
+        pf_count++;
+        lbas += k;
+        n -= k;
+    }
+    pthread_cond_signal(&pf_cond);
+    pthread_mutex_unlock(&pf_lock);
+}
+
+void bcache_prefetch_wait(void)
+{
+    pthread_mutex_lock(&pf_lock);
+    while (pf_running && (pf_count > 0 || pf_busy))
+        pthread_cond_wait(&pf_idle, &pf_lock);
+    pthread_mutex_unlock(&pf_lock);
+}
+
+static void pf_stop_thread(void)
+{
+    pthread_mutex_lock(&pf_lock);
+    if (!pf_running) {
+        pthread_mutex_unlock(&pf_lock);
+        return;
+    }
+    pf_stop = 1;
+    pf_count = 0;
+    pthread_cond_signal(&pf_cond);
+    pthread_mutex_unlock(&pf_lock);
+    pthread_join(pf_thread, NULL);
+    pf_running = 0;
+}
+
+const void *bcache_map(int lba)
+{
+    struct bc_shard *s = shard_of(lba);
+    struct bc_entry *e;
+    int dirty = 0;
+
+    if (bc_writeback) {
+        pthread_mutex_lock(&s->lock);
+        dirty = (e = lookup(s, lba)) != NULL && e->dirty;
+        pthread_mutex_unlock(&s->lock);
+    }
+    return dirty ? NULL : block_map(lba, 1);
+}
+
+void bcache_invalidate(int lba, int nblks)
+{
+    struct bc_shard *s;
+    struct bc_entry *e;
+    int i;
+
+    if (!bc_enabled)
+        return;
+    for (i = lba; i < lba + nblks; i++) {
+        s = shard_of(i);
+        pthread_mutex_lock(&s->lock);
+        if ((e = lookup(s, i)) != NULL) {
+            unhash(s, e);
+            lru_remove(s, e);
+            s->count--;
+            if (e->dirty)
+                __atomic_sub_fetch(&bc_ndirty, 1, __ATOMIC_RELAXED);
+            free(e);
+        }
+        pthread_mutex_unlock(&s->lock);
+    }
+}
+
+/* a dirty block collected by bcache_flush */
+struct bc_dirty {
+    int lba;
+    int first;
+    unsigned long version;
+    char *data;
+};
+
+/* the blocks to write first, then LBA order */
+static int cmp_dirty(const void *a, const void *b)
+{
+    const struct bc_dirty *x = a, *y = b;
+
+    if (x->first != y->first)
+        return y->first - x->first;
+    return (x->lba > y->lba) - (x->lba < y->lba);
+}
+
+/* write d[0..n) as one batch, one request per contiguous run */
+static int write_runs(struct bc_dirty *d, struct iovec *iov, int n)
+{
+    struct blk_batch batch;
+    int i, j, rv = 0;
+
+    block_batch_init(&batch);
+    for (i = 0; i < n; i = j) {
+        for (j = i; j < n && j - i < RUN_MAX &&
+                 d[j].lba == d[i].lba + (j - i); j++) {
+            iov[j].iov_base = d[j].data;
+            iov[j].iov_len = FS_BLOCK_SIZE;
+        }
+        rv |= block_batch_writev(&batch, &iov[i], j - i, d[i].lba, j - i);
+    }
+    return rv | block_batch_submit(&batch);
+}
+
+/* after a flush, give back memory a shard borrowed while it was full
+ * of dirty blocks
+ */
+static void trim(struct bc_shard *s)
+{
+    struct bc_entry *e, *prev;
+
+    for (e = s->tail; e != NULL && s->count > s->max; e = prev) {
+        prev = e->prev;
+        if (e->dirty)
+            continue;
+        unhash(s, e);
+        lru_remove(s, e);
+        s->count--;
+        free(e);
+    }
+}
+
+int bcache_flush(void)
+{
+    struct bc_dirty *d = NULL;
+    struct iovec *iov = NULL;
+    struct bc_shard *s;
+    struct bc_entry *e;
+    int i, n = 0, nfirst = 0, cap = 0, rv = 0;
+    unsigned long seq;
+
+    if (!bc_enabled)
+        return 0;
+    pthread_mutex_lock(&flush_lock);
+    seq = __atomic_add_fetch(&bc_flush_started, 1, __ATOMIC_SEQ_CST);
+
+    /* snapshot every dirty block. They stay dirty (and resident) until
+     * they are on disk, so readers keep seeing the cached copy.
+     */
+    for (s = shards; s < shards + BC_SHARDS; s++) {
+        pthread_mutex_lock(&s->lock);
+        for (e = s->head; e != NULL; e = e->next) {
+            if (!e->dirty)
+                continue;
+            if (n == cap) {
+                cap = cap ? 2 * cap : 64;
+                d = realloc(d, cap * sizeof(*d));
+            }
+            d[n].lba = e->lba;
+            d[n].first = e->first;
+            d[n].version = e->version;
+            nfirst += e->first;
+            d[n].data = malloc(FS_BLOCK_SIZE);
+            memcpy(d[n].data, e->data, FS_BLOCK_SIZE);
+            n++;
+        }
+        pthread_mutex_unlock(&s->lock);
+    }
+
+    /* write them in LBA order, the first ones done before the rest
+     * are started - a batch's requests may complete in any order
+     */
+    if (n > 0) {
+        qsort(d, n, sizeof(*d), cmp_dirty);
+        iov = malloc(n * sizeof(*iov));
+        rv = write_runs(d, iov, nfirst);
+        if (rv == 0)
+            rv = write_runs(d + nfirst, iov + nfirst, n - nfirst);
+    }
+
+    /* blocks rewritten since the snapshot stay dirty for next time */
+    for (i = 0; i < n; i++) {
+        s = shard_of(d[i].lba);
+        pthread_mutex_lock(&s->lock);
+        e = lookup(s, d[i].lba);
+        if (rv == 0 && e != NULL && e->dirty && e->version == d[i].version) {
+            e->dirty = e->first = 0;
+            __atomic_sub_fetch(&bc_ndirty, 1, __ATOMIC_RELAXED);
+        }
+        pthread_mutex_unlock(&s->lock);
+        free(d[i].data);
+    }
+    for (s = shards; s < shards + BC_SHARDS; s++) {
+        pthread_mutex_lock(&s->lock);
+        trim(s);
+        pthread_mutex_unlock(&s->lock);
+    }
+
+    if (rv == 0)
+        __atomic_store_n(&bc_flushed, seq, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&flush_lock);
+    free(d);
+    free(iov);
+    return rv < 0 ? -EIO : 0;
+}
+
+/* background flusher: wakes every wb_secs seconds, or early when
+ * the dirty threshold is crossed
+ */
+static void *flusher(void *arg)
+{
+    struct timespec ts;
+
+    (void) arg;
+    pthread_mutex_lock(&wb_lock);
+    while (!wb_stop) {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += wb_secs;
+        while (!wb_stop && !wb_kick &&
+               pthread_cond_timedwait(&wb_cond, &wb_lock, &ts) == 0)
+            ;
+        wb_kick = 0;
+        pthread_mutex_unlock(&wb_lock);
+        bcache_flush();
+        pthread_mutex_lock(&wb_lock);
+    }
+    pthread_mutex_unlock(&wb_lock);
+    return NULL;
+}
+
+static void wb_stop_thread(void)
+{
+    if (!wb_running)
+        return;
+    pthread_mutex_lock(&wb_lock);
+    wb_stop = 1;
+    pthread_cond_signal(&wb_cond);
+    pthread_mutex_unlock(&wb_lock);
+    pthread_join(wb_thread, NULL);
+    wb_running = 0;
+}
+
+int bcache_set_writeback(int on, int flush_secs, int dirty_pct)
+{
+    long total = 0;
+    struct bc_shard *s;
+    int rv = 0;
+
+    wb_stop_thread();
+    if (!bc_enabled)
+        return on ? -EINVAL : 0;
+    if (!on) {
+        bc_writeback = 0;
+        return bcache_flush();
+    }
+
+    for (s = shards; s < shards + BC_SHARDS; s++)
+        total += s->max;
+    bc_dirty_max = total * dirty_pct / 100;
+    bc_writeback = 1;
+
+    if (flush_secs > 0) {
+        wb_secs = flush_secs;
+        wb_stop = wb_kick = 0;
+        if ((rv = pthread_create(&wb_thread, NULL, flusher, NULL)) == 0)
+            wb_running = 1;
+        else
+            bc_writeback = 0;   // no flusher, so no write-back
+    }
+    return -rv;
+}
+
+void bcache_get_stats(struct bcache_stats *st)
+{
+    struct bc_shard *s;
+
+    memset(st, 0, sizeof(*st));
+    for (s = shards; s < shards + BC_SHARDS; s++) {
+        pthread_mutex_lock(&s->lock);
+        st->hits += s->hits;
+        st->misses += s->misses;
+        st->evictions += s->evictions;
+        st->blocks += s->count;
+        pthread_mutex_unlock(&s->lock);
+    }
+    st->dirty = __atomic_load_n(&bc_ndirty, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&pf_lock);
+    st->prefetched = pf_blocks;
+    pthread_mutex_unlock(&pf_lock);
+}
+
+int bcache_init(size_t budget)
+{
+    size_t nblocks = budget / FS_BLOCK_SIZE;
+    struct bc_shard *s;
+
+    bcache_destroy();
+    if (nblocks == 0)
+        return 0;
+
+    for (s = shards; s < shards + BC_SHARDS; s++) {
+        memset(s, 0, sizeof(*s));
+        pthread_mutex_init(&s->lock, NULL);
+        s->max = DIV_ROUND_UP(nblocks, BC_SHARDS);
+        for (s->nbuckets = 16; s->nbuckets < (unsigned) s->max; )
+            s->nbuckets *= 2;
+        s->hash = calloc(s->nbuckets, sizeof(struct bc_entry *));
+        if (s->hash == NULL)
+            return -ENOMEM;
+    }
+    bc_enabled = 1;
+    return 0;
+}
+
+void bcache_destroy(void)
+{
+    struct bc_shard *s;
+    struct bc_entry *e, *next;
+
+    if (!bc_enabled)
+        return;
+    pf_stop_thread();
+    wb_stop_thread();
+    bcache_flush();
+    bc_enabled = 0;
+    bc_writeback = 0;
+    bc_ndirty = 0;
+    for (s = shards; s < shards + BC_SHARDS; s++) {
+        for (e = s->head; e != NULL; e = next) {
+            next = e->next;
+            free(e);
+        }
+        free(s->hash);
+        pthread_mutex_destroy(&s->lock);
+        memset(s, 0, sizeof(*s));
+    }
+}
@@ -0,0 +1,79 @@
+/*
+ * file:        bcache.h
+ * description: block buffer cache in front of the block device layer
+ */
+#ifndef __BCACHE_H__
+#define __BCACHE_H__
+
+#include <stddef.h>
+
+struct bcache_stats {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+    unsigned long blocks;       /* currently resident */
+    unsigned long dirty;        /* waiting for write-back */
+    unsigned long prefetched;   /* read in by bcache_prefetch */
+};
+
+/* set up the cache with a memory budget in bytes. A budget of 0
+ * disables caching - every call goes straight to the block layer.
+ */
+int bcache_init(size_t budget);
+
+/* flushes any dirty blocks first */
+void bcache_destroy(void);
+
+/* Switch between write-through (the default) and write-back. In
+ * write-back mode dirty blocks are written every 'flush_secs' seconds
+ * (0 = only on bcache_flush), or as soon as more than 'dirty_pct'
+ * percent of the cache is dirty. Turning it off flushes everything.
+ */
+int bcache_set_writeback(int on, int flush_secs, int dirty_pct);
+
+/* write every dirty block to disk, sorted by LBA. Returns 0 or -EIO */
+int bcache_flush(void);
+
+/* same contract as block_read/block_write. In write-through mode
+ * writes go to disk immediately and update any cached copy.
+ */
+int bcache_read(void *buf, int lba, int nblks);
+int bcache_write(void *buf, int lba, int nblks);
+
+/* like bcache_write, but in write-back mode these blocks are written,
+ * and waited for, before the other dirty blocks of the same flush
+ */
+int bcache_write_first(void *buf, int lba, int nblks);
+
+/* Flush sequence numbers. Everything written before a call to
+ * bcache_flush_seq is on disk once bcache_flushed returns at least the
+ * number it gave. In write-through mode that's already true.
+ */
+unsigned long bcache_flush_seq(void);
+unsigned long bcache_flushed(void);
+
+/* read 'n' single blocks, lbas[i] into bufs[i]. Hits are copied out
+ * of the cache, and all the misses are fetched in one batch, with
+ * each run of consecutive LBAs merged into one vectored request.
+ */
+int bcache_read_list(const int *lbas, void **bufs, int n);
+
+/* start reading these blocks into the cache in the background. This
+ * is a hint - requests are dropped if the prefetch queue is full.
+ */
+void bcache_prefetch(const int *lbas, int n);
+
+/* wait until every queued prefetch has completed */
+void bcache_prefetch_wait(void);
+
+/* block_map for one block, unless the cache holds a newer (dirty)
+ * copy - then NULL, and the caller has to use bcache_read.
+ */
+const void *bcache_map(int lba);
+
+/* drop any cached copy of these blocks */
+void bcache_invalidate(int lba, int nblks);
+
+void bcache_get_stats(struct bcache_stats *st);
+
+#endif
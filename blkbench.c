@@ -0,0 +1,131 @@
+/*
+ * file:        blkbench.c
+ * description: block layer microbenchmark - compares the synchronous
+ *              backend against io_uring, one request at a time and in
+ *              batches, and against the mmap backend.
+ *
+ *  usage: ./blkbench [-n nblocks] [-r reads] [-b batch] bench.img
+ *     creates (or reuses) an image of 'nblocks' blocks, then times
+ *     'reads' random 4KB block reads with each backend and mode.
+ */
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include "fs5600.h"
+#include "blkdev.h"
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void make_image(char *file, int nblks)
+{
+    char buf[FS_BLOCK_SIZE];
+    int i, fd;
+
+    if ((fd = open(file, O_RDWR | O_CREAT, 0666)) < 0) {
+        perror(file);
+        exit(1);
+    }
+    if (lseek(fd, 0, SEEK_END) >= (off_t) nblks * FS_BLOCK_SIZE) {
+        close(fd);
+        return;
+    }
+    for (i = 0; i < nblks; i++) {
+        memset(buf, i, sizeof(buf));
+        if (write(fd, buf, sizeof(buf)) != sizeof(buf)) {
+            perror(file);
+            exit(1);
+        }
+    }
+    close(fd);
+}
+
+static void run(char *file, char *backend, int *lbas, int nreads,
+                int batch, char *bufs)
+{
+    struct blk_batch b;
+    double t0, t;
+    int i, rv = 0;
+
+    if (block_init_backend(file, backend) < 0) {
+        printf("%-8s not available\n", backend);
+        return;
+    }
+    t0 = now();
+    if (batch <= 1) {
+        for (i = 0; i < nreads; i++)
+            rv |= block_read(bufs, lbas[i], 1);
+    } else {
+        block_batch_init(&b);
+        for (i = 0; i < nreads; i++) {
+            rv |= block_batch_read(&b, bufs + (i % batch) * FS_BLOCK_SIZE,
+                                   lbas[i], 1);
+            if ((i + 1) % batch == 0)
+                rv |= block_batch_submit(&b);
+        }
+        rv |= block_batch_submit(&b);
+    }
+    t = now() - t0;
+    block_close();
+
+    printf("%-8s batch %3d: %8.0f reads/s  %6.2f us/read  %7.1f MB/s%s\n",
+           backend, batch, nreads / t, t * 1e6 / nreads,
+           (double) nreads * FS_BLOCK_SIZE / t / (1 << 20),
+           rv ? "  (I/O errors)" : "");
+}
+
+int main(int argc, char **argv)
+{
+    int nblks = 8192, nreads = 100000, batch = 32;
+    int i, c, *lbas;
+    char *bufs, *file;
+
+    while ((c = getopt(argc, argv, "n:r:b:")) != -1)
+        switch (c) {
+        case 'n': nblks = atoi(optarg); break;
+        case 'r': nreads = atoi(optarg); break;
+        case 'b': batch = atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-n nblocks] [-r reads] "
+                    "[-b batch] bench.img\n", argv[0]);
+            exit(1);
+        }
+    if (optind != argc - 1 || nblks < 2 || batch < 1 ||
+        batch > BLK_BATCH_MAX) {
+        fprintf(stderr, "usage: %s [-n nblocks] [-r reads] "
+                "[-b batch (1..%d)] bench.img\n", argv[0], BLK_BATCH_MAX);
+        exit(1);
+    }
+    file = argv[optind];
+    make_image(file, nblks);
+
+    srand(5600);
+    lbas = malloc(nreads * sizeof(int));
+    for (i = 0; i < nreads; i++)
+        lbas[i] = 1 + rand() % (nblks - 1);
+    bufs = malloc((size_t) batch * FS_BLOCK_SIZE);
+
+    printf("%d random 4KB reads over %d blocks\n", nreads, nblks);
+    run(file, "pread", lbas, nreads, 1, bufs);
+    run(file, "pread", lbas, nreads, batch, bufs);
+    run(file, "uring", lbas, nreads, 1, bufs);
+    run(file, "uring", lbas, nreads, batch, bufs);
+    run(file, "mmap", lbas, nreads, 1, bufs);
+
+    free(lbas);
+    free(bufs);
+    return 0;
+}
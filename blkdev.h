@@ -0,0 +1,107 @@
+/*
+ * file:        blkdev.h
+ * description: block device layer - all disk I/O goes through here
+ */
+#ifndef __BLKDEV_H__
+#define __BLKDEV_H__
+
+#include <sys/uio.h>
+
+/* One queued request in a batch. If 'iov' is set the request is
+ * vectored and 'buf' is ignored.
+ */
+struct blk_req {
+    int write;
+    void *buf;
+    const struct iovec *iov;
+    int iovcnt;
+    int lba;
+    int nblks;
+};
+
+/* A backend implements block I/O against the image opened by
+ * block_init. All methods return 0 on success or -EIO, and must be
+ * safe to call from several threads at once. 'readv'/'writev'
+ * transfer 'nblks' physically contiguous blocks starting at 'lba'
+ * to/from an arbitrary scatter list. 'submit' is optional: it issues
+ * all 'n' requests at once and returns after every one has completed.
+ * 'map' is optional too: it returns a pointer to the blocks in memory.
+ */
+struct blk_ops {
+    const char *name;
+    int  (*open)(int fd, int nblks);
+    int  (*read)(void *buf, int lba, int nblks);
+    int  (*write)(const void *buf, int lba, int nblks);
+    int  (*readv)(const struct iovec *iov, int iovcnt, int lba, int nblks);
+    int  (*writev)(const struct iovec *iov, int iovcnt, int lba, int nblks);
+    int  (*submit)(struct blk_req *req, int n);
+    void *(*map)(int lba, int nblks);
+    int  (*flush)(void);
+    void (*close)(void);
+};
+
+extern struct blk_ops uring_ops;
+
+/* open 'file' with the default backend; exits on error */
+void block_init(char *file);
+
+/* open 'file' with the named backend (NULL = default). Returns 0,
+ * -EINVAL for an unknown backend name, or -ENODEV if the backend is
+ * not supported here (e.g. no io_uring in this kernel).
+ */
+int block_init_backend(char *file, const char *backend);
+const char *block_backend_name(void);
+
+/* read/write blocks. Return -EIO if error, 0 otherwise
+ */
+int block_read(void *buf, int lba, int nblks);
+int block_write(void *buf, int lba, int nblks);
+int block_readv(const struct iovec *iov, int iovcnt, int lba, int nblks);
+int block_writev(const struct iovec *iov, int iovcnt, int lba, int nblks);
+
+/* write the superblock. block_write refuses block 0, so that a stray
+ * zero block pointer can't overwrite it.
+ */
+int block_write_super(void *buf);
+
+/* Batched I/O: queue several requests, then submit them together and
+ * wait for all of them. A batch that fills up is submitted
+ * implicitly, so the add functions can return -EIO too. Buffers must
+ * stay valid until block_batch_submit returns.
+ */
+#define BLK_BATCH_MAX 64
+
+struct blk_batch {
+    int n;
+    struct blk_req req[BLK_BATCH_MAX];
+};
+
+void block_batch_init(struct blk_batch *b);
+int block_batch_read(struct blk_batch *b, void *buf, int lba, int nblks);
+int block_batch_write(struct blk_batch *b, void *buf, int lba, int nblks);
+int block_batch_readv(struct blk_batch *b, const struct iovec *iov,
+                      int iovcnt, int lba, int nblks);
+int block_batch_writev(struct blk_batch *b, const struct iovec *iov,
+                       int iovcnt, int lba, int nblks);
+int block_batch_submit(struct blk_batch *b);
+
+/* read-only pointer to blocks in memory, or NULL if the backend
+ * doesn't support it (only 'mmap' does)
+ */
+const void *block_map(int lba, int nblks);
+
+/* requests issued to the backend since block_init - a vectored or
+ * multi-block request counts once
+ */
+struct blk_stats {
+    unsigned long reads, writes;
+    unsigned long blocks_read, blocks_written;
+};
+
+void block_get_stats(struct blk_stats *st);
+
+/* make all completed writes durable */
+int block_flush(void);
+void block_close(void);
+
+#endif
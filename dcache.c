@@ -0,0 +1,210 @@
+/*
+ * file:        dcache.c
+ * description: directory entry cache. A hash table keyed by (parent
+ *              inode, name) with an LRU list for eviction. Entries
+ *              with inum 0 are negative - the name is known not to
+ *              exist in that directory.
+ *
+ *              Directory changes update the cache in place with
+ *              dcache_set, and bump dc_seq so a lookup that raced with
+ *              the change doesn't fill in a stale result.
+ */
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "dcache.h"
+
+#define DC_BUCKETS 4096         /* power of 2 */
+#define DC_NAME_MAX 27
+
+struct dc_entry {
+    int parent;
+    int inum;                   /* 0 = negative */
+    int len;
+    char name[DC_NAME_MAX + 1];
+    struct dc_entry *hnext;             /* hash chain */
+    struct dc_entry *prev, *next;       /* LRU list, most recent first */
+};
+
+static pthread_mutex_t dc_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct dc_entry *dc_hash[DC_BUCKETS];
+static struct dc_entry *lru_head, *lru_tail;
+static int dc_max = 4096;
+static unsigned long dc_seq;
+static struct dcache_stats dc_stats;
+
+/* FNV-1a over the parent number and the name */
+static unsigned hash(int parent, const char *name, int len)
+{
+    uint32_t h = 2166136261u ^ (uint32_t) parent;
+    int i;
+
+    h *= 16777619u;
+    for (i = 0; i < len; i++) {
+        h ^= (unsigned char) name[i];
+        h *= 16777619u;
+    }
+    return h & (DC_BUCKETS - 1);
+}
+
+static struct dc_entry *lookup(int parent, const char *name, int len)
+{
+    struct dc_entry *e;
+
+    for (e = dc_hash[hash(parent, name, len)]; e != NULL; e = e->hnext)
+        if (e->parent == parent && e->len == len &&
+            memcmp(e->name, name, len) == 0)
+            return e;
+    return NULL;
+}
+
+static void lru_remove(struct dc_entry *e)
+{
+    if (e->prev)
+        e->prev->next = e->next;
+    else
+        lru_head = e->next;
+    if (e->next)
+        e->next->prev = e->prev;
+    else
+        lru_tail = e->prev;
+}
+
+static void lru_push(struct dc_entry *e)
+{
+    e->prev = NULL;
+    e->next = lru_head;
+    if (lru_head)
+        lru_head->prev = e;
+    lru_head = e;
+    if (lru_tail == NULL)
+        lru_tail = e;
+}
+
+static void remove_entry(struct dc_entry *e)
+{
+    struct dc_entry **pp = &dc_hash[hash(e->parent, e->name, e->len)];
+
+    for (; *pp != NULL; pp = &(*pp)->hnext)
+        if (*pp == e) {
+            *pp = e->hnext;
+            break;
+        }
+    lru_remove(e);
+    free(e);
+    dc_stats.entries--;
+}
+
+/* add or update an entry; called with dc_lock held */
+static void insert(int parent, const char *name, int len, int inum)
+{
+    struct dc_entry *e;
+    unsigned h;
+
+    if (dc_max == 0 || len > DC_NAME_MAX)
+        return;
+    if ((e = lookup(parent, name, len)) != NULL) {
+        e->inum = inum;
+        lru_remove(e);
+        lru_push(e);
+        return;
+    }
+    if ((e = malloc(sizeof(*e))) == NULL)
+        return;
+    e->parent = parent;
+    e->inum = inum;
+    e->len = len;
+    memcpy(e->name, name, len);
+    e->name[len] = 0;
+    h = hash(parent, name, len);
+    e->hnext = dc_hash[h];
+    dc_hash[h] = e;
+    lru_push(e);
+    dc_stats.entries++;
+
+    while (dc_stats.entries > (unsigned long) dc_max)
+        remove_entry(lru_tail);
+}
+
+int dcache_init(int max)
+{
+    dcache_destroy();
+    pthread_mutex_lock(&dc_lock);
+    dc_max = max < 0 ? 0 : max;
+    memset(&dc_stats, 0, sizeof(dc_stats));
+    pthread_mutex_unlock(&dc_lock);
+    return 0;
+}
+
+void dcache_destroy(void)
+{
+    pthread_mutex_lock(&dc_lock);
+    while (lru_head != NULL)
+        remove_entry(lru_head);
+    dc_seq++;
+    pthread_mutex_unlock(&dc_lock);
+}
+
+int dcache_lookup(int parent, const char *name, int len, int *inum,
+                  unsigned long *seq)
+{
+    struct dc_entry *e;
+
+    pthread_mutex_lock(&dc_lock);
+    if ((e = lookup(parent, name, len)) != NULL) {
+        *inum = e->inum;
+        if (e->inum)
+            dc_stats.hits++;
+        else
+            dc_stats.neg_hits++;
+        lru_remove(e);
+        lru_push(e);
+    } else {
+        *seq = dc_seq;
+        dc_stats.misses++;
+    }
+    pthread_mutex_unlock(&dc_lock);
+    return e != NULL;
+}
+
+void dcache_fill(int parent, const char *name, int len, int inum,
+                 unsigned long seq)
+{
+    pthread_mutex_lock(&dc_lock);
+    if (seq == dc_seq)
+        insert(parent, name, len, inum);
+    pthread_mutex_unlock(&dc_lock);
+}
+
+void dcache_set(int parent, const char *name, int len, int inum)
+{
+    pthread_mutex_lock(&dc_lock);
+    dc_seq++;
+    insert(parent, name, len, inum);
+    pthread_mutex_unlock(&dc_lock);
+}
+
+void dcache_drop_dir(int parent)
+{
+    struct dc_entry *e, *next;
+
+    pthread_mutex_lock(&dc_lock);
+    dc_seq++;
+    for (e = lru_head; e != NULL; e = next) {
+        next = e->next;
+        if (e->parent == parent)
+            remove_entry(e);
+    }
+    pthread_mutex_unlock(&dc_lock);
+}
+
+void dcache_get_stats(struct dcache_stats *st)
+{
+    pthread_mutex_lock(&dc_lock);
+    *st = dc_stats;
+    pthread_mutex_unlock(&dc_lock);
+}
@@ -0,0 +1,43 @@
+/*
+ * file:        dcache.h
+ * description: directory entry cache - (parent inode, name) to child
+ *              inode number, including negative entries for names
+ *              known not to exist
+ */
+#ifndef __DCACHE_H__
+#define __DCACHE_H__
+
+struct dcache_stats {
+    unsigned long hits;
+    unsigned long neg_hits;     /* hits on a negative entry */
+    unsigned long misses;
+    unsigned long entries;      /* currently resident */
+};
+
+/* keep up to 'max' entries (0 = disabled). Empties the cache. */
+int dcache_init(int max);
+void dcache_destroy(void);
+
+/* look up 'name' (first 'len' bytes) in directory 'parent'. Returns 1
+ * and sets *inum on a hit - *inum is 0 for a negative entry - or 0 on
+ * a miss. On a miss *seq is set for the following dcache_fill.
+ */
+int dcache_lookup(int parent, const char *name, int len, int *inum,
+                  unsigned long *seq);
+
+/* cache the result of a directory scan started after dcache_lookup
+ * returned 'seq'. Dropped if the cache was changed in between, so a
+ * slow lookup can't resurrect an entry that was just created/removed.
+ */
+void dcache_fill(int parent, const char *name, int len, int inum,
+                 unsigned long seq);
+
+/* the directory changed: 'name' now maps to 'inum' (0 = removed) */
+void dcache_set(int parent, const char *name, int len, int inum);
+
+/* directory 'parent' is gone - drop every entry under it */
+void dcache_drop_dir(int parent);
+
+void dcache_get_stats(struct dcache_stats *st);
+
+#endif
@@ -0,0 +1,194 @@
+/*
+ * file:        dirscan.c
+ * description: directory block search. Each 32-byte dirent is compared
+ *              against a key - the name, its NUL, and the valid bit, in
+ *              a dirent-shaped buffer - under a mask of the bytes that
+ *              matter, so whatever follows the NUL in an old entry is
+ *              ignored. That is one AVX2 compare per entry, two with
+ *              SSE2, or four 64-bit ones without either. The valid bits
+ *              are collected into a bitmask as the scan goes, so the
+ *              first free entry comes out of the same pass.
+ */
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <stdint.h>
+
+#include "dirscan.h"
+
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "the valid bit is assumed to be bit 0 of the first byte"
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86 1
+#endif
+
+#define NWORDS (DIRSCAN_ENTRIES / 64)
+
+/* key and mask for name[0..len) */
+struct key {
+    uint8_t k[32] __attribute__((aligned(32)));
+    uint8_t m[32] __attribute__((aligned(32)));
+};
+
+static void make_key(struct key *key, const char *name, int len)
+{
+    memset(key, 0, sizeof(*key));
+    key->k[0] = key->m[0] = 1;                  // valid
+    memcpy(key->k + 4, name, len);              // name and NUL
+    memset(key->m + 4, 0xff, len + 1);
+}
+
+/* first unused entry, given a bitmask of used ones */
+static int first_free(const uint64_t *used)
+{
+    int w;
+
+    for (w = 0; w < NWORDS; w++)
+        if (~used[w])
+            return w * 64 + __builtin_ctzll(~used[w]);
+    return -1;
+}
+
+/* The scan loops are all the same shape: stop at a match unless the
+ * free entry is wanted too, in which case keep collecting valid bits.
+ */
+#define SCAN_LOOP(MATCH)                                                \
+    do {                                                                \
+        const uint8_t *p = (const uint8_t *) de;                        \
+        uint64_t used[NWORDS] = {0};                                    \
+        int i, found = -1;                                              \
+                                                                        \
+        for (i = 0; i < DIRSCAN_ENTRIES; i++, p += 32) {                \
+            used[i / 64] |= (uint64_t) (p[0] & 1) << (i % 64);          \
+            if (found < 0 && (MATCH)) {                                 \
+                found = i;                                              \
+                if (freespot == NULL)                                   \
+                    return found;                                       \
+            }                                                           \
+        }                                                               \
+        if (freespot != NULL)                                           \
+            *freespot = first_free(used);                               \
+        return found;                                                   \
+    } while (0)
+
+static int scan_scalar(const struct fs_dirent *de, const struct key *key,
+                       int *freespot)
+{
+    uint64_t k[4], m[4];
+
+    memcpy(k, key->k, 32);
+    memcpy(m, key->m, 32);
+#define WORD(j) ({ uint64_t _w; memcpy(&_w, p + 8 * (j), 8); _w; })
+    SCAN_LOOP((((WORD(0) ^ k[0]) & m[0]) | ((WORD(1) ^ k[1]) & m[1]) |
+               ((WORD(2) ^ k[2]) & m[2]) | ((WORD(3) ^ k[3]) & m[3])) == 0);
+#undef WORD
+}
+
+#ifdef HAVE_X86
+__attribute__((target("sse2")))
+static int scan_sse2(const struct fs_dirent *de, const struct key *key,
+                     int *freespot)
+{
+    __m128i k0 = _mm_load_si128((const __m128i *) key->k);
+    __m128i k1 = _mm_load_si128((const __m128i *) (key->k + 16));
+    __m128i m0 = _mm_load_si128((const __m128i *) key->m);
+    __m128i m1 = _mm_load_si128((const __m128i *) (key->m + 16));
+    __m128i zero = _mm_setzero_si128();
+
+#define DIFF(j, k, m) \
+    _mm_and_si128(_mm_xor_si128(_mm_loadu_si128((const __m128i *) (p + 16 * (j))), k), m)
+    SCAN_LOOP(_mm_movemask_epi8(_mm_cmpeq_epi8(
+                  _mm_or_si128(DIFF(0, k0, m0), DIFF(1, k1, m1)), zero)) == 0xffff);
+#undef DIFF
+}
+
+__attribute__((target("avx2")))
+static int scan_avx2(const struct fs_dirent *de, const struct key *key,
+                     int *freespot)
+{
+    __m256i k = _mm256_load_si256((const __m256i *) key->k);
+    __m256i m = _mm256_load_si256((const __m256i *) key->m);
+    __m256i d;
+
+    SCAN_LOOP((d = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *) p), k),
+               _mm256_testz_si256(d, m)));
+}
+#endif
+
+static const struct {
+    const char *name;
+    int (*scan)(const struct fs_dirent *, const struct key *, int *);
+} impls[] = {
+#ifdef HAVE_X86
+    { "avx2", scan_avx2 },
+    { "sse2", scan_sse2 },
+#endif
+    { "scalar", scan_scalar },
+};
+
+#define NIMPLS ((int) (sizeof(impls) / sizeof(impls[0])))
+
+static int supported(int i)
+{
+#ifdef HAVE_X86
+    if (impls[i].scan == scan_avx2)
+        return __builtin_cpu_supports("avx2");
+    if (impls[i].scan == scan_sse2)
+        return __builtin_cpu_supports("sse2");
+#endif
+    return 1;
+}
+
+static int impl = -1;           // index into impls[], -1 until chosen
+
+static int pick(void)
+{
+    int i;
+
+    if (impl < 0) {
+        for (i = 0; !supported(i); i++)
+            ;
+        impl = i;
+    }
+    return impl;
+}
+
+int dirscan(const struct fs_dirent *de, const char *name, int len,
+            int *freespot)
+{
+    struct key key;
+
+    make_key(&key, name, len);
+    return impls[pick()].scan(de, &key, freespot);
+}
+
+int dirscan_free(const struct fs_dirent *de)
+{
+    const uint8_t *p = (const uint8_t *) de;
+    uint64_t used[NWORDS] = {0};
+    int i;
+
+    for (i = 0; i < DIRSCAN_ENTRIES; i++, p += 32)
+        used[i / 64] |= (uint64_t) (p[0] & 1) << (i % 64);
+    return first_free(used);
+}
+
+int dirscan_use(const char *name)
+{
+    int i;
+
+    for (i = 0; i < NIMPLS; i++)
+        if (strcmp(impls[i].name, name) == 0 && supported(i)) {
+            impl = i;
+            return 0;
+        }
+    return -1;
+}
+
+const char *dirscan_impl(void)
+{
+    return impls[pick()].name;
+}
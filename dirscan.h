@@ -0,0 +1,33 @@
+/*
+ * file:        dirscan.h
+ * description: directory block search - name lookup and free entry
+ *              search over a block of dirents in one pass
+ */
+#ifndef __DIRSCAN_H__
+#define __DIRSCAN_H__
+
+#include <stdint.h>
+#include "fs5600.h"
+
+#define DIRSCAN_ENTRIES (FS_BLOCK_SIZE / sizeof(struct fs_dirent))
+
+/* Search the DIRSCAN_ENTRIES entries of 'de' for a valid one named
+ * name[0..len), len <= 27. Returns its index or -1. If 'freespot' isn't
+ * NULL it is set to the first unused entry, or -1 if there is none.
+ */
+int dirscan(const struct fs_dirent *de, const char *name, int len,
+            int *freespot);
+
+/* first unused entry of 'de', or -1 */
+int dirscan_free(const struct fs_dirent *de);
+
+/* Pick the implementation: "avx2", "sse2" or "scalar". By default the
+ * best one the CPU supports is used. Returns 0, or -1 if 'impl' isn't
+ * available here.
+ */
+int dirscan_use(const char *impl);
+
+/* the implementation in use */
+const char *dirscan_impl(void);
+
+#endif
@@ -1,6 +1,7 @@
 from ctypes import *
 
 MAGIC = 0x30303635
+STATE_CLEAN = 0x4e454c43
 
 class dirent(Structure):
     _fields_ = [("valid", c_uint, 1),
@@ -10,7 +11,31 @@ class dirent(Structure):
 class super(Structure):
     _fields_ = [("magic", c_uint),
                 ("disk_sz", c_uint),
-                ("_pad", c_char * 4088)]
+                ("state", c_uint),
+                ("free", c_uint),
+                ("bitmap_start", c_uint),   # 0,0 = one block at 1
+                ("bitmap_len", c_uint),
+                ("features", c_uint),
+                ("inode_start", c_uint),    # FEAT_ITABLE only
+                ("inode_count", c_uint),
+                ("imap_start", c_uint),
+                ("imap_len", c_uint),
+                ("free_inodes", c_uint),
+                ("_pad", c_char * 4048)]
+
+FEAT_ITABLE = 1
+FEAT_INDIRECT = 2       # last two pointers are single/double indirect
+FEAT_EXTENTS = 4        # regular files map extents
+FEAT_INLINE = 8         # files that fit have their data in ptrs
+FEAT_DIRINDEX = 16      # directories past one block are hashed
+DIR_INDEX_MAGIC = 0x58444948
+
+# FEAT_EXTENTS: a regular file's ptrs start with a header - magic,
+# count, depth and padding, 16 bits each - then (lblk, start, len)
+# extents. gen-disk only writes depth 0 trees, in the inode.
+EXTENT_MAGIC = 0xf30a
+EXTENT_HDR = 2          # in ptrs
+EXTENT_LEN = 3
 
 class inode(Structure):
     _fields_ = [("uid", c_ushort),
@@ -21,20 +46,24 @@ class inode(Structure):
                 ("size", c_int),
                 ("ptrs", c_uint * 1019)]
 
-class bitmap(Structure):
-    _fields_ = [("vals", c_uint * 1024)]
+# a bitmap spanning any number of blocks
+class blockmap(object):
+    def __init__(self, map_len, data=None):
+        self.data = bytearray(data) if data else bytearray(map_len * 4096)
     def get(self, i):
-        n = self.vals[i // 32]
-        mask = 1 << (i % 32)
-        return (n & mask) != 0
+        return (self.data[i // 8] & (1 << (i % 8))) != 0
     def set(self, i, val):
-        mask = 1 << (i % 32)
-        n = self.vals[i // 32]
         if val:
-            n = n | mask
+            self.data[i // 8] |= 1 << (i % 8)
         else:
-            n = n & (mask ^ 0xffffffff)
-        self.vals[i // 32] = n
+            self.data[i // 8] &= ~(1 << (i % 8)) & 0xff
+
+BITS_PER_BLOCK = 4096 * 8
+
+# packed inodes (FEAT_ITABLE) are the first DINODE_SIZE bytes of 'inode'
+DINODE_SIZE = 256
+DINODES_PER_BLOCK = 4096 // DINODE_SIZE
+DINODE_PTRS = (DINODE_SIZE - 20) // 4
 
 S_IFMT  = 0o0170000  # bit mask for the file type bit field
 S_IFREG = 0o0100000  # regular file
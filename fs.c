@@ -9,8 +9,17 @@
 #include <string.h>
 #include <stdio.h>
 #include <errno.h>
+#include <limits.h>
+#include <pthread.h>
 
 #include "fs5600.h"
+#include "blkdev.h"
+#include "bcache.h"
+#include "icache.h"
+#include "dcache.h"
+#include "balloc.h"
+#include "dirscan.h"
+#include "fs.h"
 
 /* if you don't understand why you can't use these system calls here, 
  * you need to read the assignment description another time
@@ -20,36 +29,565 @@
 #define read(a,b,c) error do not use read()
 #define write(a,b,c) error do not use write()
 
-#define MAX_PATH_LEN 10
 #define MAX_NAME_LEN 27
 
-/* disk access. All access is in terms of 4KB blocks; read and
- * write functions return 0 (success) or -EIO.
+struct fs_options fs_opts = {
+    .cache_size = 16 << 20,
+    .writeback = 0,
+    .flush_secs = 5,
+    .dirty_pct = 50,
+    .readahead = 32,
+    .atime = FS_ATIME_STRICT,
+    .atime_secs = 24 * 60 * 60,
+    .inode_cache = 1024,
+    .dentry_cache = 4096,
+};
+
+static struct fs_super super;
+static unsigned char *bitmap;           // map_len blocks, read lazily
+static int map_start, map_len;          // where the bitmap is on disk
+static struct balloc blocks;
+
+// with a packed inode table (FS_FEAT_ITABLE) inodes have their own
+// bitmap; otherwise an inode is just a block
+static int itable;
+static unsigned char *imap;
+static struct balloc inodes;
+static int max_blocks;                  // data blocks per file
+static int dirindex;                    // FS_FEAT_DIRINDEX
+
+/* Bitmap writeback. The allocator marks the bitmap blocks it changes,
+ * and they are written at flush points, with two exceptions that keep a
+ * crash from leaving a block in use by two files: newly allocated
+ * blocks are written out before the inode or dirent that points at
+ * them, and blocks are only freed once nothing on disk refers to them
+ * any more. Either way a crash can at worst leak blocks.
+ *
+ * In write-back mode a write only reaches the cache, and a flush
+ * writes everything at once. So bitmap blocks are written with
+ * bcache_write_first, which puts them on disk before the rest of the
+ * flush, and a free waits on a list, still marked in use, until the
+ * flush that writes whatever unlinked the blocks has completed.
  */
-extern int block_read(void *buf, int lba, int nblks);
-extern int block_write(void *buf, int lba, int nblks);
+static int read_map_block(void *buf, int idx)
+{
+    return bcache_read(buf, map_start + idx, 1);
+}
 
-/* bitmap functions
+static int write_map_block(void *buf, int idx)
+{
+    return bcache_write_first(buf, map_start + idx, 1);
+}
+
+static int read_imap_block(void *buf, int idx)
+{
+    return bcache_read(buf, super.imap_start + idx, 1);
+}
+
+static int write_imap_block(void *buf, int idx)
+{
+    return bcache_write_first(buf, super.imap_start + idx, 1);
+}
+
+/* frees waiting for a flush, oldest first */
+struct late_free {
+    struct balloc *ba;
+    int blk, n;
+    unsigned long seq;          // free once bcache_flushed() gets here
+};
+
+static struct late_free *late;
+static int nlate, late_max;
+static long late_blocks, late_inodes;   // counted as free by statfs
+static pthread_mutex_t late_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* hand the allocator every waiting free whose flush has completed */
+static void release_frees(void)
+{
+    unsigned long done = bcache_flushed();
+    int i;
+
+    pthread_mutex_lock(&late_lock);
+    for (i = 0; i < nlate && late[i].seq <= done; i++) {
+        balloc_free_run(late[i].ba, late[i].blk, late[i].n);
+        if (late[i].ba == &blocks)
+            late_blocks -= late[i].n;
+        else
+            late_inodes -= late[i].n;
+    }
+    nlate -= i;
+    memmove(late, late + i, nlate * sizeof(*late));
+    pthread_mutex_unlock(&late_lock);
+}
+
+/* free 'n' entries of 'ba' from 'blk' on, once everything written so
+ * far is on disk. Call it after the writes that unlink them.
  */
-void bit_set(unsigned char *map, int i)
+static void free_later(struct balloc *ba, int blk, int n)
 {
-    map[i/8] |= (1 << (i%8));
+    struct late_free *p;
+
+    pthread_mutex_lock(&late_lock);
+    if (nlate == late_max) {
+        p = realloc(late, (late_max ? 2 * late_max : 64) * sizeof(*p));
+        if (p == NULL) {        // leak them, as a crash would
+            pthread_mutex_unlock(&late_lock);
+            return;
+        }
+        late = p;
+        late_max = late_max ? 2 * late_max : 64;
+    }
+    late[nlate].ba = ba;
+    late[nlate].blk = blk;
+    late[nlate].n = n;
+    late[nlate].seq = bcache_flush_seq();
+    nlate++;
+    if (ba == &blocks)
+        late_blocks += n;
+    else
+        late_inodes += n;
+    pthread_mutex_unlock(&late_lock);
+    release_frees();            // right away in write-through mode
+}
+
+static int bitmap_sync(void)
+{
+    int rv;
+
+    release_frees();
+    rv = balloc_sync(&blocks, write_map_block);
+
+    if (itable)
+        rv |= balloc_sync(&inodes, write_imap_block);
+    return rv;
 }
-void bit_clear(unsigned char *map, int i)
+
+static int inode_alloc(void)
 {
-    map[i/8] &= ~(1 << (i%8));
+    return balloc_alloc(itable ? &inodes : &blocks);
 }
-int bit_test(unsigned char *map, int i)
+
+static void inode_free(int inum)
 {
-    return map[i/8] & (1 << (i%8));
+    balloc_free(itable ? &inodes : &blocks, inum);
 }
 
-// 32 * 1024 = 32k block
-#define TOTAL_BLOCKS 32768
+/* inode_free for an inode that a directory entry on disk referred to */
+static void inode_free_later(int inum)
+{
+    free_later(itable ? &inodes : &blocks, inum, 1);
+}
 
-static struct fs_super super;
-static unsigned char bitmap[TOTAL_BLOCKS];
-static struct fs_inode root_inode;
+/* the block holding inode 'inum' */
+static int inode_block(int inum)
+{
+    return itable ? super.inode_start + inum / FS_DINODES_PER_BLOCK : inum;
+}
+
+/* Block map. Logical block i of a file is ptrs[i] for the first
+ * 'ndirect' blocks. With FS_FEAT_INDIRECT the two pointers after those
+ * are a single and a double indirect block, of NINDIR block numbers
+ * each. With FS_FEAT_EXTENTS regular files hold an extent tree in
+ * ptrs[] instead (see fs5600.h). A struct bmap keeps the pointer or
+ * extent blocks it last used, and the extent it last found, so walking
+ * a file in order reads each of them once and searches once per
+ * extent rather than once per block.
+ */
+#define NINDIR (FS_BLOCK_SIZE / 4)
+
+static int indirect;                    // FS_FEAT_INDIRECT
+static int ndirect;                     // direct pointers per inode
+static int extents;                     // FS_FEAT_EXTENTS
+static int ext_root;                    // extents that fit in an inode
+static int inline_max = -1;             // FS_FEAT_INLINE: bytes in ptrs[]
+
+#define EXT_ENT(h) ((struct fs_extent *) ((struct fs_extent_header *) (h) + 1))
+
+struct bmap {
+    struct fs_inode *inode;
+    int ext;                    // extent-mapped
+    int max;                    // blocks the map can hold
+    int lba[2];                 // held: [0] a leaf, [1] the double top
+    int dirty[2];
+    int allocated;              // pointer or extent blocks allocated
+    struct fs_extent cur;       // last extent found, len 0 = none
+    uint32_t ptrs[2][NINDIR];
+};
+
+static int ext_mapped(uint32_t mode)
+{
+    return extents && S_ISREG(mode);
+}
+
+/* With FS_FEAT_INLINE a regular file of up to 'inline_max' bytes has
+ * them in ptrs[] instead of in a data block. A file is inline exactly
+ * when it is that small, so there is nothing else to record: writes
+ * move the data out to a block as the file grows past the limit, and
+ * truncation - only ever to 0 - brings it back.
+ */
+static int file_inline(uint32_t mode, int32_t size)
+{
+    return inline_max >= 0 && S_ISREG(mode) && size <= inline_max;
+}
+
+static void bmap_init(struct bmap *m, struct fs_inode *inode)
+{
+    m->inode = inode;
+    m->ext = ext_mapped(inode->mode);
+    // the size field is a signed 32-bit byte count
+    m->max = m->ext ? INT32_MAX / FS_BLOCK_SIZE : max_blocks;
+    m->lba[0] = m->lba[1] = 0;
+    m->dirty[0] = m->dirty[1] = 0;
+    m->allocated = 0;
+    m->cur.len = 0;
+}
+
+/* write back the pointer block held at level 'l', if modified. It may
+ * point at newly allocated blocks, so the bitmap is written first.
+ */
+static int bmap_put(struct bmap *m, int l)
+{
+    if (m->dirty[l] && (bitmap_sync() < 0 ||
+                        bcache_write(m->ptrs[l], m->lba[l], 1) < 0))
+        return -EIO;
+    m->dirty[l] = 0;
+    return 0;
+}
+
+/* Hold the pointer block that '*slot' refers to at level 'l' and
+ * return its contents. If there is none, allocate it near 'goal' when
+ * 'alloc' is set - '*slot' is in the inode, or in the block held at
+ * level 'parent', which is then marked dirty - otherwise return NULL
+ * with *err = 0. Errors are NULL with *err = -ENOSPC or -EIO.
+ */
+static uint32_t *bmap_step(struct bmap *m, int l, uint32_t *slot, int parent,
+                           int alloc, int goal, int *err)
+{
+    int lba = *slot, got;
+
+    *err = 0;
+    if (lba != 0 && lba == m->lba[l])
+        return m->ptrs[l];
+    if (lba == 0 && !alloc)
+        return NULL;
+    if ((*err = bmap_put(m, l)) < 0)
+        return NULL;
+    m->lba[l] = 0;
+    if (lba == 0) {
+        if ((lba = balloc_alloc_run(&blocks, goal, 1, &got)) < 0) {
+            *err = lba;
+            return NULL;
+        }
+        memset(m->ptrs[l], 0, FS_BLOCK_SIZE);
+        m->dirty[l] = 1;
+        m->allocated++;
+        *slot = lba;
+        if (parent >= 0)
+            m->dirty[parent] = 1;
+    } else if (bcache_read(m->ptrs[l], lba, 1) < 0) {
+        *err = -EIO;
+        return NULL;
+    }
+    m->lba[l] = lba;
+    return m->ptrs[l];
+}
+
+/* where logical block 'i' is recorded: in the inode or a pointer block
+ * held by 'm'. NULL if beyond the map, or see bmap_step.
+ */
+static uint32_t *bmap_slot(struct bmap *m, int i, int alloc, int goal,
+                           int *err)
+{
+    uint32_t *p, *slot;
+    int parent = -1;
+
+    *err = 0;
+    if (i < ndirect)
+        return &m->inode->ptrs[i];
+    i -= ndirect;
+    if (i < NINDIR) {
+        slot = &m->inode->ptrs[ndirect];
+    } else {
+        i -= NINDIR;
+        p = bmap_step(m, 1, &m->inode->ptrs[ndirect + 1], -1, alloc, goal,
+                      err);
+        if (p == NULL)
+            return NULL;
+        slot = &p[i / NINDIR];
+        parent = 1;
+        i %= NINDIR;
+    }
+    if ((p = bmap_step(m, 0, slot, parent, alloc, goal, err)) == NULL)
+        return NULL;
+    return &p[i];
+}
+
+/* last of the 'n' sorted entries 'e' starting at or before 'i', or -1 */
+static int ext_search(const struct fs_extent *e, int n, uint32_t i)
+{
+    int lo = 0, hi = n - 1, mid, found = -1;
+
+    while (lo <= hi) {
+        mid = (lo + hi) / 2;
+        if (e[mid].lblk <= i) {
+            found = mid;
+            lo = mid + 1;
+        } else
+            hi = mid - 1;
+    }
+    return found;
+}
+
+/* the extent node that holds logical block 'i', or would if it were
+ * mapped: the inode itself at depth 0, otherwise an extent block, held
+ * at level 0. NULL with *err = -EIO if that can't be read.
+ */
+static struct fs_extent_header *ext_node(struct bmap *m, uint32_t i,
+                                         int *err)
+{
+    struct fs_extent_header *root = (void *) m->inode->ptrs;
+    int k, lba;
+
+    *err = 0;
+    if (root->magic != FS_EXTENT_MAGIC || root->depth == 0)
+        return root;
+    if ((k = ext_search(EXT_ENT(root), root->entries, i)) < 0)
+        k = 0;
+    if ((lba = EXT_ENT(root)[k].start) == m->lba[0])
+        return (void *) m->ptrs[0];
+    if ((*err = bmap_put(m, 0)) < 0)
+        return NULL;
+    m->lba[0] = 0;
+    if (bcache_read(m->ptrs[0], lba, 1) < 0) {
+        *err = -EIO;
+        return NULL;
+    }
+    m->lba[0] = lba;
+    return (void *) m->ptrs[0];
+}
+
+/* bmap_map for an extent-mapped file */
+static int ext_map(struct bmap *m, int i, int *run)
+{
+    struct fs_extent_header *h;
+    struct fs_extent *e;
+    int k, err;
+
+    *run = 0;
+    if (m->cur.len == 0 || i < m->cur.lblk || i >= m->cur.lblk + m->cur.len) {
+        if ((h = ext_node(m, i, &err)) == NULL)
+            return err;
+        if (h->magic != FS_EXTENT_MAGIC ||
+            (k = ext_search(EXT_ENT(h), h->entries, i)) < 0)
+            return 0;
+        e = &EXT_ENT(h)[k];
+        if (i >= e->lblk + e->len)
+            return 0;
+        m->cur = *e;
+    }
+    *run = m->cur.lblk + m->cur.len - i;
+    return m->cur.start + (i - m->cur.lblk);
+}
+
+/* Block number of logical block 'i', 0 if it has none, or -EIO. Sets
+ * *run to how many blocks from 'i' on are mapped contiguously on disk -
+ * the rest of the extent, or just the one block with pointers.
+ */
+static int bmap_map(struct bmap *m, int i, int *run)
+{
+    int err;
+    uint32_t *slot;
+
+    *run = 0;
+    if (i < 0 || i >= m->max)
+        return 0;
+    if (m->ext)
+        return ext_map(m, i, run);
+    if ((slot = bmap_slot(m, i, 0, 0, &err)) == NULL)
+        return err;
+    *run = *slot != 0;
+    return *slot;
+}
+
+static int bmap_get(struct bmap *m, int i)
+{
+    int run;
+
+    return bmap_map(m, i, &run);
+}
+
+/* bmap_set for an extent-mapped file. Files have no holes, so blocks
+ * are only ever added at the end: to the last extent if they follow
+ * on from it on disk, otherwise as a new extent. When the inode fills
+ * up its extents move out to an extent block and the inode becomes an
+ * index of those; a full tree is -ENOSPC.
+ */
+static int ext_append(struct bmap *m, int i, int lba)
+{
+    struct fs_extent_header *root = (void *) m->inode->ptrs, *h;
+    struct fs_extent *e;
+    int err, blk, got;
+
+    if (root->magic != FS_EXTENT_MAGIC) {
+        memset(root, 0, sizeof(*root));
+        root->magic = FS_EXTENT_MAGIC;
+    }
+    if ((h = ext_node(m, i, &err)) == NULL)
+        return err;
+    e = EXT_ENT(h) + h->entries - 1;
+    if (h->entries > 0 && e->lblk + e->len != i)
+        return -EIO;
+    if (h->entries > 0 && e->start + e->len == lba) {
+        e->len++;
+        goto done;
+    }
+
+    if (h->entries == (h == root ? ext_root : FS_EXTENTS_PER_BLOCK)) {
+        if (root->depth > 0 && root->entries == ext_root)
+            return -ENOSPC;
+        if ((err = bmap_put(m, 0)) < 0)
+            return err;
+        if ((blk = balloc_alloc_run(&blocks, lba + 1, 1, &got)) < 0)
+            return blk;
+        m->allocated++;
+        h = (void *) m->ptrs[0];
+        if (root->depth == 0) {
+            memcpy(h, root, sizeof(*root) + root->entries * sizeof(*e));
+            root->depth = 1;
+            root->entries = 0;
+        } else {
+            memset(h, 0, sizeof(*h));
+            h->magic = FS_EXTENT_MAGIC;
+        }
+        e = EXT_ENT(root) + root->entries++;
+        e->lblk = h->entries ? EXT_ENT(h)[0].lblk : i;
+        e->start = blk;
+        e->len = 0;
+        m->lba[0] = blk;
+    }
+    e = EXT_ENT(h) + h->entries++;
+    e->lblk = i;
+    e->start = lba;
+    e->len = 1;
+done:
+    if (h != root)
+        m->dirty[0] = 1;
+    m->cur = *e;
+    return 0;
+}
+
+/* point logical block 'i' at 'lba', allocating pointer blocks near it.
+ * The caller marks the inode dirty. Returns 0, -ENOSPC or -EIO.
+ */
+static int bmap_set(struct bmap *m, int i, int lba)
+{
+    int err;
+    uint32_t *slot;
+
+    if (i < 0 || i >= m->max)
+        return -ENOSPC;
+    if (m->ext)
+        return ext_append(m, i, lba);
+    if ((slot = bmap_slot(m, i, 1, lba + 1, &err)) == NULL)
+        return err ? err : -ENOSPC;
+    *slot = lba;
+    if (i >= ndirect)
+        m->dirty[0] = 1;
+    return 0;
+}
+
+/* write back the modified pointer blocks */
+static int bmap_flush(struct bmap *m)
+{
+    return bmap_put(m, 0) | bmap_put(m, 1);
+}
+
+/* Move an inline file's data out to a block of its own, for a write
+ * that takes it past inline_max. The caller holds the inode lock.
+ * Returns 1 if a block was allocated, 0 if the file was empty, or
+ * -ENOSPC/-EIO with the file unchanged.
+ */
+static int inline_to_block(struct fs_inode *inode, int inum)
+{
+    char data[FS_BLOCK_SIZE];
+    struct bmap map;
+    int lba, got;
+
+    if (inode->size == 0) {
+        memset(inode->ptrs, 0, sizeof(inode->ptrs));
+        return 0;
+    }
+    lba = balloc_alloc_run(&blocks, inode_block(inum) + 1, 1, &got);
+    if (lba < 0)
+        return lba;
+    memset(data, 0, sizeof(data));
+    memcpy(data, inode->ptrs, inode->size);
+    if (bcache_write(data, lba, 1) < 0) {
+        balloc_free(&blocks, lba);
+        return -EIO;
+    }
+    memset(inode->ptrs, 0, sizeof(inode->ptrs));
+    bmap_init(&map, inode);
+    bmap_set(&map, 0, lba);     // in the inode, so it can't fail
+    return 1;
+}
+
+/* free the blocks listed in pointer block 'lba', 'depth' levels above
+ * the data, and the block itself
+ */
+static void free_tree(int lba, int depth)
+{
+    uint32_t ptrs[NINDIR];
+    int i;
+
+    if (lba == 0)
+        return;
+    if (depth > 0 && bcache_read(ptrs, lba, 1) == 0)
+        for (i = 0; i < NINDIR; i++)
+            free_tree(ptrs[i], depth - 1);
+    free_later(&blocks, lba, 1);
+}
+
+/* free the extents in extent node 'h', and any extent blocks below it */
+static void free_extents(const struct fs_extent_header *h)
+{
+    const struct fs_extent *e = EXT_ENT(h);
+    uint32_t buf[NINDIR];
+    int k;
+
+    if (h->magic != FS_EXTENT_MAGIC)
+        return;
+    for (k = 0; k < h->entries; k++)
+        if (h->depth == 0)
+            free_later(&blocks, e[k].start, e[k].len);
+        else {
+            if (bcache_read(buf, e[k].start, 1) == 0)
+                free_extents((void *) buf);
+            free_later(&blocks, e[k].start, 1);
+        }
+}
+
+/* free every block of a file, given its mode, size and block pointers.
+ * Only call this once nothing written refers to them.
+ */
+static void free_file_blocks(uint32_t mode, int32_t size,
+                             const uint32_t *ptrs)
+{
+    int i;
+
+    if (file_inline(mode, size))
+        return;
+    if (ext_mapped(mode)) {
+        free_extents((const void *) ptrs);
+        return;
+    }
+    for (i = 0; i < ndirect; i++)
+        free_tree(ptrs[i], 0);
+    if (indirect) {
+        free_tree(ptrs[ndirect], 1);
+        free_tree(ptrs[ndirect + 1], 2);
+    }
+}
 
 /* init - this is called once by the FUSE framework at startup. Ignore
  * the 'conn' argument.
@@ -61,12 +599,85 @@ void* fs_init(struct fuse_conn_info *conn)
 {
     /* your code here */
     (void) conn;
-    block_read(&super, 0, 1);
-    block_read(bitmap, 1, 1);
-    block_read(&root_inode, 2, 1);
+    bcache_init(fs_opts.cache_size);
+    if (fs_opts.writeback &&
+        bcache_set_writeback(1, fs_opts.flush_secs, fs_opts.dirty_pct) < 0) {
+        // parse_options made sure this works before mounting; if it
+        // fails now, writing through beats leaving a dead mount point
+        fprintf(stderr, "can't turn on write-back caching, writing through\n");
+        fs_opts.writeback = 0;
+    }
+    block_read(&super, 0, 1);          // never cached, see fs_destroy
+
+    // older images have a single bitmap block, at block 1
+    map_start = super.bitmap_len ? super.bitmap_start : 1;
+    map_len = super.bitmap_len ? super.bitmap_len : 1;
+    long nblks = (long) map_len * FS_BLOCK_SIZE * 8;
+    if (nblks > super.disk_size)
+        nblks = super.disk_size;
+
+    // the saved free count is only trusted after a clean unmount, and
+    // stops being valid as soon as we start allocating
+    free(bitmap);
+    bitmap = calloc(map_len, FS_BLOCK_SIZE);
+    nlate = late_blocks = late_inodes = 0;  // any left were leaked
+    balloc_init(&blocks, bitmap, nblks,
+                super.state == FS_STATE_CLEAN ? (int) super.free_blocks : -1,
+                read_map_block);
+
+    itable = (super.features & FS_FEAT_ITABLE) != 0;
+    indirect = (super.features & FS_FEAT_INDIRECT) != 0;
+    ndirect = itable ? FS_DINODE_PTRS : FS_BLOCK_SIZE/4 - 5;
+    max_blocks = ndirect;
+    extents = (super.features & FS_FEAT_EXTENTS) != 0;
+    ext_root = (ndirect * 4 - sizeof(struct fs_extent_header)) /
+        sizeof(struct fs_extent);
+    inline_max = (super.features & FS_FEAT_INLINE) ? ndirect * 4 : -1;
+    dirindex = (super.features & FS_FEAT_DIRINDEX) != 0;
+    if (indirect) {
+        ndirect -= 2;
+        // the size field is a signed 32-bit byte count
+        max_blocks = INT32_MAX / FS_BLOCK_SIZE;
+        if (max_blocks > ndirect + NINDIR + NINDIR * NINDIR)
+            max_blocks = ndirect + NINDIR + NINDIR * NINDIR;
+    }
+    free(imap);
+    imap = NULL;
+    if (itable) {
+        imap = calloc(super.imap_len, FS_BLOCK_SIZE);
+        balloc_init(&inodes, imap, super.inode_count,
+                    super.state == FS_STATE_CLEAN ? (int) super.free_inodes : -1,
+                    read_imap_block);
+    }
+
+    super.state = 0;
+    block_write_super(&super);
+    icache_init(fs_opts.inode_cache, itable ? super.inode_start : 0);
+    dcache_init(fs_opts.dentry_cache);
     return NULL;
 }
 
+/* destroy - called once by the FUSE framework at unmount. Writes back
+ * everything still dirty in the cache.
+ */
+void fs_destroy(void *private_data)
+{
+    (void) private_data;
+    dcache_destroy();
+    icache_destroy();
+    bcache_flush();             // so that every free can be released
+    bitmap_sync();
+    bcache_destroy();
+    // only marked clean once everything else is on disk
+    block_flush();
+    super.free_blocks = balloc_nfree(&blocks);
+    if (itable)
+        super.free_inodes = balloc_nfree(&inodes);
+    super.state = FS_STATE_CLEAN;
+    block_write_super(&super);
+    block_flush();
+}
+
 /* Note on path translation errors:
  * In addition to the method-specific errors listed below, almost
  * every method can return one of the following errors if it fails to
@@ -77,94 +688,325 @@ void* fs_init(struct fuse_conn_info *conn)
  *           /a/b/c) is not a directory
  */
 
-/* note on splitting the 'path' variable:
- * the value passed in by the FUSE framework is declared as 'const',
- * which means you can't modify it. The standard mechanisms for
- * splitting strings in C (strtok, strsep) modify the string in place,
- * so you have to copy the string and then free the copy when you're
- * done. One way of doing this:
- *
- *    char *_path = strdup(path);
- *    int inum = translate(_path);
- *    free(_path);
+/* Path resolution. Paths are walked in place - each component is a
+ * pointer into the caller's (const) path plus a length - so a walk
+ * allocates nothing and is safe to run from several threads at once.
+ * Components longer than MAX_NAME_LEN are truncated, as they are when
+ * a file is created.
  */
+struct walk {
+    int parent;         /* directory holding the last component */
+    int inum;           /* the last component itself, or -ENOENT */
+    const char *name;   /* last component (not terminated), */
+    int len;            /* or "" and 0 for the root */
+};
 
- int parse(char *path, char **argv)
- {
-    int i;
-    for (i = 0; i < MAX_PATH_LEN; i++) {
-        if ((argv[i] = strtok(path, "/")) == NULL)
-            break;
-        if (strlen(argv[i]) > MAX_NAME_LEN)
-            argv[i][MAX_NAME_LEN] = '\0';
-        path = NULL;
+/* Directories: one block of entries at ptrs[0] or, with
+ * FS_FEAT_DIRINDEX once that fills up, an index and buckets (see
+ * fs5600.h). Callers that change a directory hold its inode lock.
+ */
+#define DIRENTS_PER_BLOCK (FS_BLOCK_SIZE / sizeof(struct fs_dirent))
+
+/* FNV-1a */
+static uint32_t name_hash(const char *name, int len)
+{
+    uint32_t h = 2166136261u;
+
+    while (len-- > 0) {
+        h ^= (unsigned char) *name++;
+        h *= 16777619;
     }
-    return i;
- }
+    return h;
+}
 
-int translate(const char *c_path)
+/* slot holding name[0..len), or -1 */
+int find_entry_dirents(struct fs_dirent dirents[], const char *name, int len)
 {
-    int inum;
-    int i;
-    int j;
-    int pathc;
-    int32_t found;
-    struct fs_inode *inode;
-    struct fs_dirent dirents[128];
-    struct fs_dirent *ent;
+    return dirscan(dirents, name, len, NULL);
+}
 
-    char *path = strdup(c_path);
-    char **pathv = malloc(MAX_NAME_LEN * sizeof(char *));
+int find_freespot_dirents(struct fs_dirent dirents[])
+{
+    return dirscan_free(dirents);
+}
 
-    pathc = parse(path, pathv);
-    inum = 2;
+/* is 'blk0', the first block of 'dir', an index? */
+static int dir_indexed(struct fs_inode *dir, const void *blk0)
+{
+    const struct fs_dir_index *ix = blk0;
 
-    for (i = 0; i < pathc; i++) {
-        inode = malloc(sizeof(struct fs_inode));
-        block_read(inode, inum, 1);
-        
-        if (!S_ISDIR(inode->mode)) {
-            free(path);
-            free(pathv);
-            free(inode);
-            return -ENOTDIR;
-        }
+    return dirindex && dir->size > FS_BLOCK_SIZE &&
+        ix->magic == FS_DIR_INDEX_MAGIC;
+}
 
-        memset(dirents, 0, sizeof(dirents));
+/* Read the block of 'dir' that holds the entries with name hash 'h'
+ * into 'de': the only block of a plain directory, otherwise the bucket
+ * the index gives. The index, if any, is left in 'ix' and the slot
+ * used in *slot, else *slot is -1. Returns the block number or -EIO.
+ */
+static int dir_block(struct fs_inode *dir, uint32_t h,
+                     struct fs_dir_index *ix, int *slot,
+                     struct fs_dirent *de)
+{
+    struct bmap map;
+    int lba;
+
+    *slot = -1;
+    if (bcache_read(ix, dir->ptrs[0], 1) < 0)
+        return -EIO;
+    if (!dir_indexed(dir, ix)) {
+        memcpy(de, ix, FS_BLOCK_SIZE);
+        return dir->ptrs[0];
+    }
+    *slot = h & ((1u << ix->depth) - 1);
+    bmap_init(&map, dir);
+    if ((lba = bmap_get(&map, ix->bucket[*slot])) <= 0 ||
+        bcache_read(de, lba, 1) < 0)
+        return -EIO;
+    return lba;
+}
 
-        block_read(dirents, inode->ptrs[0], 1);
+/* the blocks of 'dir' holding entries are [*first, return value), or
+ * -EIO
+ */
+static int dir_span(struct fs_inode *dir, int *first)
+{
+    struct fs_dir_index ix;
 
-        found = 0;
-        for (j = 0; j < 128; j++) {
-            ent = &dirents[j];
-            if (ent->valid && strcmp(ent->name, pathv[i]) == 0) {
-                found = ent->inode;
-                break;
-            }
-        }
+    if (bcache_read(&ix, dir->ptrs[0], 1) < 0)
+        return -EIO;
+    *first = dir_indexed(dir, &ix) ? 1 : 0;
+    return *first ? dir->size / FS_BLOCK_SIZE : 1;
+}
 
-        free(inode);
+/* look up name[0..len) in 'dir', reading the block it is in, or would
+ * be, into 'de'. Returns that block's number and sets *found to the
+ * entry (-1 if none), or returns -EIO.
+ */
+static int dir_find(struct fs_inode *dir, const char *name, int len,
+                    struct fs_dirent *de, int *found)
+{
+    struct fs_dir_index ix;
+    int slot, lba;
 
-        if (found) {
-            inum = found;
-        } else {
-            free(path);
-            free(pathv);
-            return -ENOENT;
+    lba = dir_block(dir, name_hash(name, len), &ix, &slot, de);
+    if (lba >= 0)
+        *found = find_entry_dirents(de, name, len);
+    return lba;
+}
+
+/* Turn plain directory 'dir', whose block is full, into an index
+ * with that block as its only bucket.
+ */
+static int dir_make_index(struct fs_inode *dir)
+{
+    struct fs_dir_index ix;
+    struct bmap map;
+    int lba, got;
+
+    if (dir->size > FS_BLOCK_SIZE)      // unused blocks from an old image
+        return -ENOSPC;
+    if ((lba = balloc_alloc_run(&blocks, dir->ptrs[0] + 1, 1, &got)) < 0)
+        return lba;
+    memset(&ix, 0, sizeof(ix));
+    ix.magic = FS_DIR_INDEX_MAGIC;
+    ix.bucket[0] = 1;
+    if (bitmap_sync() < 0 || bcache_write(&ix, lba, 1) < 0) {
+        balloc_free(&blocks, lba);
+        return -EIO;
+    }
+    bmap_init(&map, dir);
+    bmap_set(&map, 1, dir->ptrs[0]);    // both in the inode
+    bmap_set(&map, 0, lba);
+    dir->size = 2 * FS_BLOCK_SIZE;
+    idirty(dir);
+    return 0;
+}
+
+/* Split the full bucket at index slot 'slot' of 'dir' - 'ix' is the
+ * index - moving the entries with the next hash bit set to a new
+ * bucket at the end of the directory. The index doubles first if the
+ * bucket is the only one for its slot.
+ */
+static int dir_split(struct fs_inode *dir, struct fs_dir_index *ix, int slot)
+{
+    struct fs_dirent old[DIRENTS_PER_BLOCK], new[DIRENTS_PER_BLOCK];
+    struct bmap map;
+    int ld = ix->ldepth[slot], nb = dir->size / FS_BLOCK_SIZE;
+    int old_lba, new_lba, got, j, n, mask;
+
+    if (ld == ix->depth) {
+        if (ix->depth == FS_DIR_INDEX_BITS)
+            return -ENOSPC;
+        n = 1 << ix->depth;
+        memcpy(ix->bucket + n, ix->bucket, n * sizeof(ix->bucket[0]));
+        memcpy(ix->ldepth + n, ix->ldepth, n);
+        ix->depth++;
+    }
+    bmap_init(&map, dir);
+    if ((old_lba = bmap_get(&map, ix->bucket[slot])) <= 0 ||
+        bcache_read(old, old_lba, 1) < 0)
+        return -EIO;
+    new_lba = balloc_alloc_run(&blocks, bmap_get(&map, nb - 1) + 1, 1, &got);
+    if (new_lba < 0)
+        return new_lba;
+    if (bmap_set(&map, nb, new_lba) < 0) {
+        balloc_free(&blocks, new_lba);
+        return -ENOSPC;
+    }
+
+    memset(new, 0, sizeof(new));
+    for (j = 0; j < DIRENTS_PER_BLOCK; j++)
+        if (old[j].valid &&
+            (name_hash(old[j].name, strlen(old[j].name)) >> ld) & 1) {
+            new[j] = old[j];
+            old[j].valid = 0;
+        }
+    mask = (1 << ld) - 1;
+    for (j = 0; j < (1 << ix->depth); j++)
+        if ((j & mask) == (slot & mask)) {
+            ix->ldepth[j] = ld + 1;
+            if ((j >> ld) & 1)
+                ix->bucket[j] = nb;
         }
+    dir->size += FS_BLOCK_SIZE;
+    idirty(dir);
+
+    // the moved entries reach the new bucket before they leave the old
+    if (bitmap_sync() < 0 || bcache_write(new, new_lba, 1) < 0 ||
+        bmap_flush(&map) < 0 || bcache_write(ix, dir->ptrs[0], 1) < 0 ||
+        bcache_write(old, old_lba, 1) < 0)
+        return -EIO;
+    return 0;
+}
+
+/* Find room for name[0..len) in 'dir': read the block it belongs in
+ * into 'de', indexing the directory or splitting buckets until that
+ * has a free entry. Returns the block number with the entry in
+ * *freespot, or -EEXIST if the name is there after all, -ENOSPC or
+ * -EIO.
+ */
+static int dir_slot(struct fs_inode *dir, const char *name, int len,
+                    struct fs_dirent *de, int *freespot)
+{
+    struct fs_dir_index ix;
+    uint32_t h = name_hash(name, len);
+    int lba, slot, rv;
+
+    for (;;) {
+        if ((lba = dir_block(dir, h, &ix, &slot, de)) < 0)
+            return lba;
+        if (dirscan(de, name, len, freespot) >= 0)
+            return -EEXIST;
+        if (*freespot >= 0)
+            return lba;
+        if (!dirindex)
+            return -ENOSPC;
+        rv = slot < 0 ? dir_make_index(dir) : dir_split(dir, &ix, slot);
+        if (rv < 0)
+            return rv;
     }
+}
 
-    free(path);
-    free(pathv);
+/* 1 if 'dir' has no entries, 0 if it has, or -EIO */
+static int dir_empty(struct fs_inode *dir)
+{
+    struct fs_dirent de[DIRENTS_PER_BLOCK];
+    struct bmap map;
+    int b, n, first, lba, i;
+
+    if ((n = dir_span(dir, &first)) < 0)
+        return n;
+    bmap_init(&map, dir);
+    for (b = first; b < n; b++) {
+        if ((lba = bmap_get(&map, b)) <= 0 || bcache_read(de, lba, 1) < 0)
+            return -EIO;
+        for (i = 0; i < DIRENTS_PER_BLOCK; i++)
+            if (de[i].valid)
+                return 0;
+    }
+    return 1;
+}
 
-    return inum;
+/* look up name[0..len) in directory 'dir', through the dentry cache.
+ * Returns the inode number, -ENOENT, -ENOTDIR if 'dir' isn't a
+ * directory, or -EIO.
+ */
+static int dir_lookup(int dir, const char *name, int len)
+{
+    struct fs_inode *inode;
+    struct fs_dirent dirents[128];
+    unsigned long seq;
+    int j, found = 0;
+
+    if (dcache_lookup(dir, name, len, &found, &seq))
+        return found ? found : -ENOENT;
+
+    if ((inode = iget(dir)) == NULL)
+        return -EIO;
+    if (!S_ISDIR(inode->mode)) {
+        iput(inode);
+        return -ENOTDIR;
+    }
+    if (dir_find(inode, name, len, dirents, &j) < 0) {
+        iput(inode);
+        return -EIO;
+    }
+    iput(inode);
+
+    if (j >= 0)
+        found = dirents[j].inode;
+    dcache_fill(dir, name, len, found, seq);
+
+    return found ? found : -ENOENT;
+}
+
+/* resolve 'path' in one pass. Returns 0 if everything up to the last
+ * component exists - the last one may not, check w->inum - or a
+ * negative error (ENOENT, ENOTDIR, EIO) for a missing parent.
+ */
+static int path_walk(const char *path, struct walk *w)
+{
+    const char *p = path;
+    int len, inum = 2;          // root
+
+    w->parent = w->inum = 2;
+    w->name = "";
+    w->len = 0;
+
+    for (;;) {
+        while (*p == '/')
+            p++;
+        for (len = 0; p[len] != '/' && p[len] != '\0'; len++)
+            ;
+        if (len == 0)
+            break;
+        if (inum < 0)           // a directory on the way is missing
+            return inum;
+        w->parent = inum;
+        w->name = p;
+        w->len = len > MAX_NAME_LEN ? MAX_NAME_LEN : len;
+        inum = dir_lookup(inum, w->name, w->len);
+        if (inum < 0 && inum != -ENOENT)
+            return inum;
+        p += len;
+    }
+    w->inum = inum;
+    return 0;
 }
 
-void inode_to_stat(int inum, struct stat *sb)
+int translate(const char *path)
 {
-    struct fs_inode *inode = malloc(sizeof(struct fs_inode));
-    block_read(inode, inum, 1);
+    struct walk w;
+    int rv = path_walk(path, &w);
+
+    return rv < 0 ? rv : w.inum;
+}
 
+static void inode_stat(const struct fs_inode *inode, int inum,
+                       struct stat *sb)
+{
+    sb->st_ino = inum;
     sb->st_mtim.tv_sec = inode->mtime;
     sb->st_atim.tv_sec = inode->mtime;
     sb->st_ctim.tv_sec = inode->ctime;
@@ -174,7 +1016,17 @@ void inode_to_stat(int inum, struct stat *sb)
     sb->st_gid = inode->gid;
     sb->st_size = inode->size;
     sb->st_blksize = FS_BLOCK_SIZE;
-    free(inode);
+}
+
+int fs_getattr_ino(int inum, struct stat *sb)
+{
+    struct fs_inode *inode = iget(inum);
+
+    if (inode == NULL)
+        return -EIO;
+    inode_stat(inode, inum, sb);
+    iput(inode);
+    return 0;
 }
 
 /* getattr - get file or directory attributes. For a description of
@@ -199,24 +1051,93 @@ int fs_getattr(const char *path, struct stat *sb)
     if (inum < 0)
         return inum;
     
-    inode_to_stat(inum, sb);
-
-    return 0;
+    return fs_getattr_ino(inum, sb);
     // return -EOPNOTSUPP;
 }
 
-const char *merge_path(const char *base_path, char *sub)
+/* the inode-number operations take NUL-terminated names, which have
+ * to fit in a dirent; the path ones truncate components instead
+ */
+static int name_len(const char *name)
 {
-    char *result = malloc(28);
-    size_t base_len = strlen(base_path);
-    
-    if (base_len > 0 && base_path[base_len - 1] == '/') {
-        snprintf(result, 28, "%s%s", base_path, sub);
-    } else {
-        snprintf(result, 28, "%s/%s", base_path, sub);
+    size_t len = strlen(name);
+
+    return len > MAX_NAME_LEN ? -ENAMETOOLONG : len;
+}
+
+int fs_lookup_ino(int dir, const char *name, struct stat *sb)
+{
+    int len, inum, rv;
+
+    if ((len = name_len(name)) < 0)
+        return len;
+    if ((inum = dir_lookup(dir, name, len)) < 0)
+        return inum;
+    if ((rv = fs_getattr_ino(inum, sb)) < 0)
+        return rv;
+    return inum;
+}
+
+static int cmp_int(const void *a, const void *b)
+{
+    int x = *(const int *) a, y = *(const int *) b;
+
+    return (x > y) - (x < y);
+}
+
+/* Attributes for a block of entries, into sb[i] for each valid de[i].
+ * Inodes already in memory are used as they are. The blocks holding the
+ * rest are read in one batch through the block cache - sorted, and
+ * without duplicates since packed inodes share blocks - and the inodes
+ * are taken from those copies. Only that many blocks are allocated: a
+ * few with a packed inode table, none if every inode was in memory.
+ */
+static int stat_entries(const struct fs_dirent *de, struct stat *sb)
+{
+    struct fs_inode *held[128];
+    int lbas[128];
+    void *bufs[128];
+    char *blocks = NULL;
+    int i, k, n = 0, rv = 0, lba;
+    const int *slot;
+
+    for (i = 0; i < 128; i++) {
+        held[i] = NULL;
+        if (de[i].valid && (held[i] = iget_cached(de[i].inode)) == NULL)
+            lbas[n++] = inode_block(de[i].inode);
+    }
+    if (n > 0) {
+        qsort(lbas, n, sizeof(int), cmp_int);
+        for (i = k = 1; i < n; i++)
+            if (lbas[i] != lbas[k - 1])
+                lbas[k++] = lbas[i];
+        n = k;
+        if ((blocks = malloc(n * FS_BLOCK_SIZE)) == NULL)
+            rv = -ENOMEM;
+        for (i = 0; i < n && rv == 0; i++)
+            bufs[i] = blocks + i * FS_BLOCK_SIZE;
+        if (rv == 0 && bcache_read_list(lbas, bufs, n) < 0)
+            rv = -EIO;
     }
 
-    return result;
+    for (i = 0; i < 128; i++) {
+        if (!de[i].valid)
+            continue;
+        memset(&sb[i], 0, sizeof(sb[i]));
+        if (held[i] != NULL) {
+            inode_stat(held[i], de[i].inode, &sb[i]);
+            iput(held[i]);
+        } else if (rv == 0) {
+            lba = inode_block(de[i].inode);
+            slot = bsearch(&lba, lbas, n, sizeof(int), cmp_int);
+            k = itable ? de[i].inode % FS_DINODES_PER_BLOCK : 0;
+            inode_stat((struct fs_inode *) ((char *) bufs[slot - lbas] +
+                                            k * FS_DINODE_SIZE),
+                       de[i].inode, &sb[i]);
+        }
+    }
+    free(blocks);
+    return rv;
 }
 
 /* readdir - get directory contents.
@@ -227,204 +1148,212 @@ const char *merge_path(const char *base_path, char *sub)
  * where <statbuf> is a pointer to a struct stat
  * success - return 0
  * errors - path resolution, ENOTDIR, ENOENT
- * 
- * hint - check the testing instructions if you don't understand how
- *        to call the filler function
+ *
+ * Entries are stat-ed by the inode number in the dirent, not by path,
+ * a block of entries at a time (see stat_entries).
  */
-int fs_readdir(const char *path, void *ptr, fuse_fill_dir_t filler,
-		       off_t offset, struct fuse_file_info *fi)
+int fs_readdir_ino(int inum, int parent, void *ptr, fs_filler_t filler)
 {
-    /* your code here */
-    int inum;
     struct fs_inode *inode;
-    int i;
-    struct stat *sb;
-    const char *sub_path;
-    int getattr_r;
-
-    inode = malloc(sizeof(struct fs_inode));
-
-    inum = translate(path);
-
-    if (inum < 0)
-        return inum;
-
-    block_read(inode, inum, 1);
-
+    int i, b, n, first, lba;
+    struct stat sb, sbs[128];
+    int rv;
+    struct bmap map;
+
+    if ((inode = iget(inum)) == NULL)
+        return -EIO;
+    if (!S_ISDIR(inode->mode)) {
+        iput(inode);
+        return -ENOTDIR;
+    }
     struct fs_dirent dirents[128];
 
-    block_read(dirents, inode->ptrs[0], 1);
-
-    sb = malloc(sizeof(struct stat));
-    fs_getattr(path, sb);
-
-    filler(ptr, ".", sb, 0);
-
-    // TODO - get parent's path.
-    // fs_getattr()
-    filler(ptr, "..", NULL, 0);
+    if ((n = dir_span(inode, &first)) < 0) {
+        rv = n;
+        goto out;
+    }
 
-    for (i = 0; i < 128; i++) {
-        if (!dirents[i].valid)
-            continue;
-        memset(sb, 0, sizeof(struct stat));
-        sub_path = merge_path(path, dirents[i].name);
-        
-        if ((getattr_r = fs_getattr(sub_path, sb)) < 0) {
-            free(sb);
-            return getattr_r;
+    memset(&sb, 0, sizeof(sb));
+    if ((rv = fs_getattr_ino(inum, &sb)) < 0)
+        goto out;
+    filler(ptr, ".", &sb, 0);
+
+    memset(&sb, 0, sizeof(sb));
+    if ((rv = fs_getattr_ino(parent, &sb)) < 0)
+        goto out;
+    filler(ptr, "..", &sb, 0);
+
+    bmap_init(&map, inode);
+    for (b = first; b < n && rv == 0; b++) {
+        if ((lba = bmap_get(&map, b)) <= 0 ||
+            bcache_read(dirents, lba, 1) < 0) {
+            rv = -EIO;
+            break;
         }
-        filler(ptr, dirents[i].name, sb, 0);
+        if ((rv = stat_entries(dirents, sbs)) < 0)
+            break;
+        for (i = 0; i < 128; i++)
+            if (dirents[i].valid)
+                filler(ptr, dirents[i].name, &sbs[i], 0);
     }
+out:
+    iput(inode);
 
-    free(inode);
-    free(sb);
+    return rv;
+}
 
-    return 0;
+int fs_readdir(const char *path, void *ptr, fuse_fill_dir_t filler,
+		       off_t offset, struct fuse_file_info *fi)
+{
+    struct walk w;
+    int rv;
+
+    if ((rv = path_walk(path, &w)) < 0)
+        return rv;
+    if (w.inum < 0)
+        return w.inum;
+    return fs_readdir_ino(w.inum, w.parent, ptr, filler);
 }
 
-int find_freeblock()
+/* undo create_inode for a node that never got a directory entry */
+static void destroy_inode(int inum)
 {
-    int i;
-    int n = super.disk_size * 8;
+    struct fs_inode *inode = iget(inum);
 
-    for (i = 0; i < n; i++) {
-        if (bit_test(bitmap, i) == 0) {
-            return i;
-        }
+    if (inode != NULL) {
+        if (S_ISDIR(inode->mode))
+            balloc_free(&blocks, inode->ptrs[0]);
+        iput(inode);
     }
-
-    return -1;
+    iforget(inum);
+    inode_free(inum);
 }
 
-int create_inode(char *name, mode_t mode)
+int create_inode(mode_t mode, uid_t uid, gid_t gid)
 {
     struct fs_inode *inode;
     time_t raw_time;
-    struct fuse_context *ctx;
-    int inum;
-    int inum_for_dirent;
+    int inum, rv = 0;
+    int inum_for_dirent = 0;
     struct fs_dirent *entries;
 
     // Find free space.
-    inum = find_freeblock();
-
-    inode = malloc(sizeof(struct fs_inode));
-    memset(inode, 0, sizeof(struct fs_inode));
+    if ((inum = inode_alloc()) < 0)
+        return inum;
+    if (S_ISDIR(mode) && (inum_for_dirent = balloc_alloc(&blocks)) < 0) {
+        inode_free(inum);
+        return inum_for_dirent;
+    }
 
-    ctx = fuse_get_context();
+    inode = iget_new(inum);
 
     raw_time = time(NULL);
     inode->ctime = (uint32_t) raw_time;
     inode->mtime = (uint32_t) raw_time;
-    inode->uid = ctx->uid;
-    inode->gid = ctx->gid;
+    inode->uid = uid;
+    inode->gid = gid;
     inode->mode = mode;
     inode->size = 0;
 
-    bit_set(bitmap, inum);
-
     if (S_ISDIR(mode)) {
-        inum_for_dirent = find_freeblock();
         inode->ptrs[0] = inum_for_dirent;
 
-        entries = malloc(sizeof(struct fs_dirent) * 128);
-        memset(entries, 0, sizeof(struct fs_dirent) * 128);
-
-        block_write(entries, inum_for_dirent, 1);
-        bit_set(bitmap, inum_for_dirent);
+        entries = calloc(128, sizeof(struct fs_dirent));
+        if (entries == NULL)
+            rv = -ENOMEM;
+        else if (bcache_write(entries, inum_for_dirent, 1) < 0)
+            rv = -EIO;
 
         free(entries);
     }
 
-    block_write(inode, inum, 1);
+    if (iput(inode) < 0 && rv == 0)
+        rv = -EIO;
 
-    block_write(bitmap, 1, 1);
-    
-    free(inode);
+    // before the dirent that makes it reachable
+    if (rv == 0 && bitmap_sync() < 0)
+        rv = -EIO;
 
+    if (rv < 0) {
+        destroy_inode(inum);
+        return rv;
+    }
     return inum;
 }
 
-int find_base_dir(int pathc, char **pathv)
+/* shared by create and mkdir: add a new inode of type 'mode' to
+ * directory 'dir' as name[0..len). Returns its number.
+ *
+ * The inode is created before the directory is locked, and undone if
+ * the name turns out to be taken: the inode cache can't be entered
+ * while holding ilock (see icache.c).
+ */
+static int make_node(int dir, const char *name, int len, mode_t mode,
+                     uid_t uid, gid_t gid)
 {
-    int inum;
     struct fs_inode *inode;
-    int found;
-    int i;
-    int j;
     struct fs_dirent dirents[128];
-    struct fs_dirent *ent;
-
-    inum = 2; //root
-    for (i = 0; i < pathc - 1; i++) {
-        inode = malloc(sizeof(struct fs_inode));
-        block_read(inode, inum, 1);
-        
-        if (!S_ISDIR(inode->mode)) {
-            free(pathv);
-            free(inode);
-            return -ENOTDIR;
-        }
+    int freespot;
+    int inum, lba;
 
-        memset(dirents, 0, sizeof(dirents));
+    if ((inum = dir_lookup(dir, name, len)) != -ENOENT)
+        return inum < 0 ? inum : -EEXIST;
+    if ((inode = iget(dir)) == NULL)
+        return -EIO;
 
-        block_read(dirents, inode->ptrs[0], 1);
+    // create inode
+    if ((inum = create_inode(mode, uid, gid)) < 0) {
+        iput(inode);
+        return inum;
+    }
 
-        found = 0;
-        for (j = 0; j < 128; j++) {
-            ent = &dirents[j];
-            if (ent->valid && strcmp(ent->name, pathv[i]) == 0) {
-                found = ent->inode;
-                break;
-            }
-        }
+    // Find a free entry, growing the directory if need be
+    ilock(inode);
+    if ((lba = dir_slot(inode, name, len, dirents, &freespot)) < 0) {
+        iunlock(inode);
+        iput(inode);
+        destroy_inode(inum);
+        return lba;
+    }
 
-        free(inode);
+    dirents[freespot].inode = inum;
+    memcpy(dirents[freespot].name, name, len);
+    dirents[freespot].name[len] = '\0';
+    dirents[freespot].valid = 1;
 
-        if (found) {
-            inum = found;
-        } else {
-            // path does not exist.
-            inum = -1;
-            break;
-        }
+    if (bcache_write(dirents, lba, 1) < 0) {
+        iunlock(inode);
+        iput(inode);
+        destroy_inode(inum);
+        return -EIO;
     }
+    dcache_set(dir, name, len, inum);
+
+    iunlock(inode);
+    iput(inode);
 
     return inum;
 }
 
-int find_entry_dirents(struct fs_dirent dirents[], char *name)
+int fs_mknod_ino(int dir, const char *name, mode_t mode, uid_t uid, gid_t gid)
 {
-    int i;
-    int count = 0;
-    for (i = 0; i < 128; i++) {
-        if (dirents[i].valid == 1) {
-            count++;
-            if (strcmp(dirents[i].name, name) == 0) {
-                return i;
-            }
-        }
-    }
+    int len = name_len(name);
 
-    if (count == 128) {
-        return count;
-    } else {
-        return -1;
-    }
+    return len < 0 ? len : make_node(dir, name, len, mode, uid, gid);
 }
 
-int find_freespot_dirents(struct fs_dirent dirents[])
+static int make_path(const char *path, mode_t mode)
 {
-    int i;
-
-    for (i = 0; i < 128; i++) {
-        if (dirents[i].valid == 0) {
-            return i;
-        }
-    }
-
-    return -1;
+    struct fuse_context *ctx = fuse_get_context();
+    struct walk w;
+    int rv;
+
+    if ((rv = path_walk(path, &w)) < 0)
+        return rv;
+    if (w.inum != -ENOENT)
+        return w.inum < 0 ? w.inum : -EEXIST;
+    rv = make_node(w.parent, w.name, w.len, mode, ctx->uid, ctx->gid);
+    return rv < 0 ? rv : 0;
 }
 
 /* create - create a new file with specified permissions
@@ -443,66 +1372,7 @@ int find_freespot_dirents(struct fs_dirent dirents[])
  */
 int fs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
 {
-    /* your code here */
-    uint32_t inum;
-    char **pathv = malloc(MAX_NAME_LEN * sizeof(char *));
-    int pathc;
-    struct fs_inode *inode;
-    int freespot;
-    struct fs_dirent dirents[128];
-    char *dup_path;
-    int base_dir;
-
-    dup_path = malloc(28);
-    strcpy(dup_path, path);
-
-    pathc = parse(dup_path, pathv);
-    base_dir = find_base_dir(pathc, pathv);
-
-    if (base_dir == -1) {
-        free(pathv);
-        // path doesn't exist
-        return -EEXIST;
-    } else {
-        inode = malloc(sizeof(struct fs_inode));
-
-        block_read(inode, base_dir, 1);
-
-        // Check if file already exist
-        memset(dirents, 0, sizeof(dirents));
-
-        block_read(dirents, inode->ptrs[0], 1);
-
-        int found = find_entry_dirents(dirents, pathv[pathc - 1]);
-
-        if (found >= 0) {
-            // already exist.
-            free(inode);
-            free(pathv);
-            return -EEXIST;
-        } else if (found == 128) {
-            free(inode);
-            free(pathv);
-            return -ENOSPC;
-        } else {
-            // Find first free entry
-            freespot = find_freespot_dirents(dirents);
-
-            // create inode
-            inum = create_inode(pathv[pathc - 1], mode);
-
-            dirents[freespot].inode = inum;
-            strcpy(dirents[freespot].name, pathv[pathc - 1]);
-            dirents[freespot].valid = 1;
-
-            block_write(dirents, inode->ptrs[0], 1);
-
-            free(pathv);
-            free(inode);
-        }
-    }
-
-    return 0;
+    return make_path(path, mode);
 }
 
 /* mkdir - create a directory with the given mode.
@@ -516,148 +1386,127 @@ int fs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
  */ 
 int fs_mkdir(const char *path, mode_t mode)
 {
-    /* your code here */
-    uint32_t inum;
-    char **pathv = malloc(MAX_NAME_LEN * sizeof(char *));
-    int pathc;
-    struct fs_inode *inode;
-    int freespot;
-    struct fs_dirent dirents[128];
-    char *dup_path;
-    int base_dir;
-
-    mode = mode | __S_IFDIR;
-
-    dup_path = malloc(28);
-    strcpy(dup_path, path);
-
-    pathc = parse(dup_path, pathv);
-    base_dir = find_base_dir(pathc, pathv);
-
-    if (base_dir == -1) {
-        free(pathv);
-        // path doesn't exist
-        return -EEXIST;
-    } else {
-        inode = malloc(sizeof(struct fs_inode));
-
-        block_read(inode, base_dir, 1);
-
-        // Check if file already exist
-        memset(dirents, 0, sizeof(dirents));
-
-        block_read(dirents, inode->ptrs[0], 1);
-
-        int found = find_entry_dirents(dirents, pathv[pathc - 1]);
-
-        if (found >= 0) {
-            // already exist.
-            free(inode);
-            free(pathv);
-            return -EEXIST;
-        } else if (found == 128) {
-            free(inode);
-            free(pathv);
-            return -ENOSPC;
-        } else {
-            // Find first free entry
-            freespot = find_freespot_dirents(dirents);
-
-            // create inode
-            inum = create_inode(pathv[pathc - 1], mode);
-
-            dirents[freespot].inode = inum;
-            strcpy(dirents[freespot].name, pathv[pathc - 1]);
-            dirents[freespot].valid = 1;
-
-            block_write(dirents, inode->ptrs[0], 1);
-
-            free(pathv);
-            free(inode);
-        }
-    }
-
-    return 0;
+    return make_path(path, mode | __S_IFDIR);
 }
 
-
-/* unlink - delete a file
- *  success - return 0
- *  errors - path resolution, ENOENT, EISDIR
+/* shared by unlink and rmdir: remove name[0..len) from directory
+ * 'parent'. It has to be a directory iff 'dir' is set.
  */
-int fs_unlink(const char *path)
+static int remove_node(int parent, const char *name, int len, int dir)
 {
-    /* your code here */
-    char **pathv = malloc(MAX_NAME_LEN * sizeof(char *));
-    int pathc;
     struct fs_inode *inode;
     struct fs_inode *file_inode;
     struct fs_dirent dirents[128];
-    char *dup_path;
-    int base_dir;
-
-    dup_path = malloc(28);
-    strcpy(dup_path, path);
-
-    pathc = parse(dup_path, pathv);
-    base_dir = find_base_dir(pathc, pathv);
-
-    if (base_dir == -1) {
-        free(pathv);
-        // path doesn't exist
-        return -ENOENT;
-    } else {
-        inode = malloc(sizeof(struct fs_inode));
+    int found, lba, victim = 0;
+    int rv = 0;
+
+    if ((inode = iget(parent)) == NULL)
+        return -EIO;
+    if (!S_ISDIR(inode->mode)) {
+        iput(inode);
+        return -ENOTDIR;
+    }
 
-        block_read(inode, base_dir, 1);
+    // Check if it exists. The entry's inode is fetched with the
+    // directory unlocked (see make_node), so look again after locking
+    // it, in case the name was removed or replaced in between.
+    for (file_inode = NULL; ; ) {
+        ilock(inode);
+        if ((lba = dir_find(inode, name, len, dirents, &found)) < 0 ||
+            found < 0) {
+            iunlock(inode);
+            if (file_inode != NULL)
+                iput(file_inode);
+            iput(inode);
+            return lba < 0 ? lba : -ENOENT;
+        }
+        if (file_inode != NULL && victim == dirents[found].inode)
+            break;
+        victim = dirents[found].inode;
+        iunlock(inode);
+        if (file_inode != NULL)
+            iput(file_inode);
+        if ((file_inode = iget(victim)) == NULL) {
+            iput(inode);
+            return -EIO;
+        }
+    }
 
-        // Check if file exist
-        memset(dirents, 0, sizeof(dirents));
+    if (!dir && S_ISDIR(file_inode->mode))
+        rv = -EISDIR;
+    else if (dir && !S_ISDIR(file_inode->mode))
+        rv = -ENOTDIR;
+    else if (dir) {
+        // check if the directory is empty.
+        if ((rv = dir_empty(file_inode)) >= 0)
+            rv = rv ? 0 : -ENOTEMPTY;
+    }
+    if (rv < 0) {
+        iunlock(inode);
+        iput(file_inode);
+        iput(inode);
+        return rv;
+    }
 
-        block_read(dirents, inode->ptrs[0], 1);
+    // nothing is freed unless the entry is gone
+    dirents[found].valid = 0;
+    if (bcache_write(dirents, lba, 1) < 0) {
+        iunlock(inode);
+        iput(file_inode);
+        iput(inode);
+        return -EIO;
+    }
+    dcache_set(parent, name, len, 0);
+    iunlock(inode);
 
-        int found = find_entry_dirents(dirents, pathv[pathc - 1]);
+    // now unreachable: free the data blocks and the inode
+    free_file_blocks(file_inode->mode, file_inode->size, file_inode->ptrs);
+    inode_free_later(victim);
+    iforget(victim);
+    if (dir)
+        dcache_drop_dir(victim);
 
-        if (found < 0 || found == 128) {
-            // File doesn't exist.
-            free(inode);
-            free(pathv);
-            return -ENOENT;
-        } else {
-            file_inode = malloc(sizeof(struct fs_inode));
-            block_read(file_inode, dirents[found].inode, 1);
-
-            // Check if its a directory.
-            if (S_ISDIR(file_inode->mode)) {
-                free(file_inode);
-                free(inode);
-                free(pathv);
-                return -EISDIR;
-            }
+    iput(inode);
+    iput(file_inode);
 
-            // clear data nodes
-            for (int i = 0; i < FS_BLOCK_SIZE/4 - 5; i++) {
-                if (file_inode->ptrs[i] != 0) {
-                    bit_clear(bitmap, file_inode->ptrs[i]);
-                }
-            }
+    return 0;
+}
 
-            // clear file inode
-            bit_clear(bitmap, dirents[found].inode);
+int fs_unlink_ino(int parent, const char *name)
+{
+    int len = name_len(name);
 
-            dirents[found].valid = 0;
+    return len < 0 ? len : remove_node(parent, name, len, 0);
+}
 
-            block_write(dirents, inode->ptrs[0], 1);
+int fs_rmdir_ino(int parent, const char *name)
+{
+    int len = name_len(name);
 
-            block_write(bitmap, 1, 1);
+    return len < 0 ? len : remove_node(parent, name, len, 1);
+}
 
-            free(pathv);
-            free(inode);
-            free(file_inode);
-        }
-    }
+static int remove_path(const char *path, int dir)
+{
+    struct walk w;
+    int rv;
+
+    if ((rv = path_walk(path, &w)) < 0)
+        return rv;
+    if (w.inum < 0)
+        return w.inum;
+    if (w.len == 0)
+        return dir ? -EBUSY : -EISDIR;      // the root
+    return remove_node(w.parent, w.name, w.len, dir);
+}
 
-    return 0;
+/* unlink - delete a file
+ *  success - return 0
+ *  errors - path resolution, ENOENT, EISDIR
+ */
+int fs_unlink(const char *path)
+{
+    return remove_path(path, 0);
 }
 
 /* rmdir - remove a directory
@@ -666,95 +1515,7 @@ int fs_unlink(const char *path)
  */
 int fs_rmdir(const char *path)
 {
-    /* your code here */
-    char **pathv = malloc(MAX_NAME_LEN * sizeof(char *));
-    int pathc;
-    struct fs_inode *inode;
-    struct fs_inode *dir_inode;
-    struct fs_dirent dirents[128];
-    struct fs_dirent target_dirents[128];
-    char *dup_path;
-    int base_dir;
-    int not_empty = 0;
-
-    dup_path = malloc(28);
-    strcpy(dup_path, path);
-
-    pathc = parse(dup_path, pathv);
-    base_dir = find_base_dir(pathc, pathv);
-
-    if (base_dir == -1) {
-        free(pathv);
-        // path doesn't exist
-        return -ENOENT;
-    } else {
-        inode = malloc(sizeof(struct fs_inode));
-
-        block_read(inode, base_dir, 1);
-
-        // Check if directory exist
-        memset(dirents, 0, sizeof(dirents));
-
-        block_read(dirents, inode->ptrs[0], 1);
-
-        int found = find_entry_dirents(dirents, pathv[pathc - 1]);
-
-        if (found < 0 || found == 128) {
-            // File doesn't exist.
-            free(inode);
-            free(pathv);
-            return -ENOENT;
-        } else {
-            dir_inode = malloc(sizeof(struct fs_inode));
-            block_read(dir_inode, dirents[found].inode, 1);
-
-            // Check if its not a directory.
-            if (!S_ISDIR(dir_inode->mode)) {
-                free(dir_inode);
-                free(inode);
-                free(pathv);
-                return -ENOTDIR;
-            }
-
-            // check if the directory is empty.
-            block_read(target_dirents, dir_inode->ptrs[0], 1);
-            for (int i = 0; i < 128; i++) {
-                if (target_dirents[i].valid) {
-                    not_empty = i + 1;
-                    break;
-                }
-            }
-
-            if (not_empty) {
-                free(dir_inode);
-                free(inode);
-                free(pathv);
-                return -ENOTEMPTY;
-            }
-
-            // clear data nodes
-            for (int i = 0; i < FS_BLOCK_SIZE/4 - 5; i++) {
-                if (dir_inode->ptrs[i] != 0) {
-                    bit_clear(bitmap, dir_inode->ptrs[i]);
-                }
-            }
-
-            // clear file inode
-            bit_clear(bitmap, dirents[found].inode);
-
-            dirents[found].valid = 0;
-
-            block_write(dirents, inode->ptrs[0], 1);
-
-            block_write(bitmap, 1, 1);
-
-            free(pathv);
-            free(inode);
-            free(dir_inode);
-        }
-    }
-
-    return 0;
+    return remove_path(path, 1);
 }
 
 /* rename - rename a file or directory
@@ -770,102 +1531,120 @@ int fs_rmdir(const char *path)
  * particular, the full version can move across directories, replace a
  * destination file, and replace an empty directory with a full one.
  */
-int fs_rename(const char *src_path, const char *dst_path)
+static int rename_node(int parent, const char *src_name, int src_len,
+                       const char *dst_name, int dst_len)
 {
-    char **src_pathv = malloc(MAX_PATH_LEN * sizeof(char *));
-    char **dst_pathv = malloc(MAX_PATH_LEN * sizeof(char *));
-    int src_pathc, dst_pathc;
-    char *src_dup_path, *dst_dup_path;
-    int src_parent_inum, dst_parent_inum;
     struct fs_inode *parent_inode;
-    struct fs_dirent dirents[128];
-    int src_found, dst_found;
-
-    src_dup_path = strdup(src_path);
-    dst_dup_path = strdup(dst_path);
-
-    src_pathc = parse(src_dup_path, src_pathv);
-    dst_pathc = parse(dst_dup_path, dst_pathv);
+    struct fs_dirent dirents[128], dst_dirents[128];
+    int src_found, dst_found, src_lba, dst_lba, inum;
+    int rv = 0;
+
+    if ((parent_inode = iget(parent)) == NULL)
+        return -EIO;
+    if (!S_ISDIR(parent_inode->mode)) {
+        iput(parent_inode);
+        return -ENOTDIR;
+    }
     
-    if (src_pathc != dst_pathc) {
-        free(src_pathv);
-        free(dst_pathv);
-        free(src_dup_path);
-        free(dst_dup_path);
-        return -EINVAL;
+    // Find source entry, and check the destination doesn't exist
+    ilock(parent_inode);
+    if ((src_lba = dir_find(parent_inode, src_name, src_len, dirents,
+                            &src_found)) < 0)
+        rv = src_lba;
+    else if (src_found < 0)
+        rv = -ENOENT;
+    else if ((dst_lba = dir_find(parent_inode, dst_name, dst_len,
+                                 dst_dirents, &dst_found)) < 0)
+        rv = dst_lba;
+    else if (dst_found >= 0)
+        rv = -EEXIST;
+    if (rv < 0) {
+        iunlock(parent_inode);
+        iput(parent_inode);
+        return rv;
     }
-
-    if (src_pathc == 1 && dst_pathc == 1) {
-        src_parent_inum = 2;
-        dst_parent_inum = 2;
+    inum = dirents[src_found].inode;
+    
+    if (dst_lba == src_lba) {
+        memcpy(dirents[src_found].name, dst_name, dst_len);
+        dirents[src_found].name[dst_len] = '\0';
+        if (bcache_write(dirents, src_lba, 1) < 0)
+            rv = -EIO;
     } else {
-        src_parent_inum = find_base_dir(src_pathc, src_pathv);
-        dst_parent_inum = find_base_dir(dst_pathc, dst_pathv);
-        
-        if (src_parent_inum < 0 || dst_parent_inum < 0) {
-            free(src_pathv);
-            free(dst_pathv);
-            free(src_dup_path);
-            free(dst_dup_path);
-            return -ENOENT;
+        // another bucket: add the new name, then drop the old one -
+        // which may have moved, if adding it split a bucket
+        dst_lba = dir_slot(parent_inode, dst_name, dst_len, dst_dirents,
+                           &dst_found);
+        if (dst_lba >= 0) {
+            dst_dirents[dst_found].inode = inum;
+            memcpy(dst_dirents[dst_found].name, dst_name, dst_len);
+            dst_dirents[dst_found].name[dst_len] = '\0';
+            dst_dirents[dst_found].valid = 1;
+            if (bcache_write(dst_dirents, dst_lba, 1) < 0)
+                dst_lba = -EIO;
+            else
+                src_lba = dir_find(parent_inode, src_name, src_len, dirents,
+                                   &src_found);
         }
-        
-        if (src_parent_inum != dst_parent_inum) {
-            free(src_pathv);
-            free(dst_pathv);
-            free(src_dup_path);
-            free(dst_dup_path);
-            return -EINVAL;
+        if (dst_lba < 0 || src_lba < 0) {
+            iunlock(parent_inode);
+            iput(parent_inode);
+            return dst_lba < 0 ? dst_lba : src_lba;
+        }
+        dirents[src_found].valid = 0;
+        if (bcache_write(dirents, src_lba, 1) < 0) {
+            // don't leave two names for one inode behind if we can help it
+            dst_dirents[dst_found].valid = 0;
+            bcache_write(dst_dirents, dst_lba, 1);
+            rv = -EIO;
         }
     }
-    
-    parent_inode = malloc(sizeof(struct fs_inode));
-    block_read(parent_inode, src_parent_inum, 1);
-    
-    // Read directory entries
-    memset(dirents, 0, sizeof(dirents));
-    block_read(dirents, parent_inode->ptrs[0], 1);
-    
-    // Find source entry
-    src_found = find_entry_dirents(dirents, src_pathv[src_pathc - 1]);
-    if (src_found < 0 || src_found == 128) {
-        free(src_pathv);
-        free(dst_pathv);
-        free(src_dup_path);
-        free(dst_dup_path);
-        free(parent_inode);
-        return -ENOENT;
-    }
-    
-    // Check if destination entry already exists
-    dst_found = find_entry_dirents(dirents, dst_pathv[dst_pathc - 1]);
-    if (dst_found >= 0 && dst_found != 128) {
-        free(src_pathv);
-        free(dst_pathv);
-        free(src_dup_path);
-        free(dst_dup_path);
-        free(parent_inode);
-        return -EEXIST;
+    if (rv < 0) {
+        iunlock(parent_inode);
+        iput(parent_inode);
+        return rv;
     }
-    
-    strncpy(dirents[src_found].name, dst_pathv[dst_pathc - 1], MAX_NAME_LEN);
-    dirents[src_found].name[MAX_NAME_LEN] = '\0';
-    
-    block_write(dirents, parent_inode->ptrs[0], 1);
+    dcache_set(parent, src_name, src_len, 0);
+    dcache_set(parent, dst_name, dst_len, inum);
     
     time_t raw_time = time(NULL);
     parent_inode->mtime = (uint32_t) raw_time;
-    block_write(parent_inode, src_parent_inum, 1);
+    idirty(parent_inode);
+    iunlock(parent_inode);
     
-    free(src_pathv);
-    free(dst_pathv);
-    free(src_dup_path);
-    free(dst_dup_path);
-    free(parent_inode);
+    iput(parent_inode);
     
     return 0;
 }
 
+int fs_rename_ino(int parent, const char *name, int newparent,
+                  const char *newname)
+{
+    int len = name_len(name), newlen = name_len(newname);
+
+    if (len < 0 || newlen < 0)
+        return -ENAMETOOLONG;
+    if (parent != newparent)
+        return -EINVAL;
+    return rename_node(parent, name, len, newname, newlen);
+}
+
+int fs_rename(const char *src_path, const char *dst_path)
+{
+    struct walk src, dst;
+    int rv;
+
+    if ((rv = path_walk(src_path, &src)) < 0)
+        return rv;
+    if ((rv = path_walk(dst_path, &dst)) < 0)
+        return rv;
+    if (src.inum < 0)
+        return src.inum;
+    if (src.len == 0 || dst.len == 0 || src.parent != dst.parent)
+        return -EINVAL;
+    return rename_node(src.parent, src.name, src.len, dst.name, dst.len);
+}
+
 /* chmod - change file permissions
  * utime - change access and modification times
  *         (for definition of 'struct utimebuf', see 'man utime')
@@ -873,19 +1652,14 @@ int fs_rename(const char *src_path, const char *dst_path)
  * success - return 0
  * Errors - path resolution, ENOENT.
  */
-int fs_chmod(const char *path, mode_t mode)
+int fs_chmod_ino(int inum, mode_t mode)
 {
-    int inum;
     struct fs_inode *inode;
-    
-    inum = translate(path);
-    
-    if (inum < 0)
-        return inum;
 
-    inode = malloc(sizeof(struct fs_inode));
-    block_read(inode, inum, 1);
+    if ((inode = iget(inum)) == NULL)
+        return -EIO;
     
+    ilock(inode);
     mode_t type_bits = inode->mode & S_IFMT;
     mode_t new_mode = (mode & ~S_IFMT) | type_bits;
     
@@ -893,34 +1667,39 @@ int fs_chmod(const char *path, mode_t mode)
     
     time_t current_time = time(NULL);
     inode->mtime = (uint32_t)current_time;
+    idirty(inode);
+    iunlock(inode);
     
-    block_write(inode, inum, 1);
-    
-    free(inode);
-    
-    return 0;
+    return iput(inode);
 }
 
-int fs_utime(const char *path, struct utimbuf *ut)
+int fs_chmod(const char *path, mode_t mode)
+{
+    int inum = translate(path);
+
+    return inum < 0 ? inum : fs_chmod_ino(inum, mode);
+}
+
+int fs_utime_ino(int inum, time_t mtime)
 {
-    int inum;
     struct fs_inode *inode;
 
-    inum = translate(path);
-    
-    if (inum < 0)
-        return inum;
-    
-    inode = malloc(sizeof(struct fs_inode));
-    block_read(inode, inum, 1);
+    if ((inode = iget(inum)) == NULL)
+        return -EIO;
     
-    inode->mtime = (uint32_t)ut->modtime;
+    ilock(inode);
+    inode->mtime = (uint32_t)mtime;
+    idirty(inode);
+    iunlock(inode);
     
-    block_write(inode, inum, 1);
-    
-    free(inode);
-    
-    return 0;
+    return iput(inode);
+}
+
+int fs_utime(const char *path, struct utimbuf *ut)
+{
+    int inum = translate(path);
+
+    return inum < 0 ? inum : fs_utime_ino(inum, ut->modtime);
 }
 
 /* truncate - truncate file to exactly 'len' bytes
@@ -928,7 +1707,7 @@ int fs_utime(const char *path, struct utimbuf *ut)
  * Errors - path resolution, ENOENT, EISDIR, EINVAL
  *    return EINVAL if len > 0.
  */
-int fs_truncate(const char *path, off_t len)
+int fs_truncate_ino(int inum, off_t len)
 {
     /* you can cheat by only implementing this for the case of len==0,
      * and an error otherwise.
@@ -936,43 +1715,144 @@ int fs_truncate(const char *path, off_t len)
     if (len != 0)
         return -EINVAL;
 
-    int inum;
     struct fs_inode *inode;
-    
-    inum = translate(path);
 
-    if (inum < 0)
-        return inum;
-    
-    inode = malloc(sizeof(struct fs_inode));
-    block_read(inode, inum, 1);
+    if ((inode = iget(inum)) == NULL)
+        return -EIO;
     
     if (S_ISDIR(inode->mode)) {
-        free(inode);
+        iput(inode);
         return -EISDIR;
     }
     
-    for (int i = 0; i < FS_BLOCK_SIZE/4 - 5; i++) {
-        if (inode->ptrs[i] != 0) {
-            bit_clear(bitmap, inode->ptrs[i]);
-            inode->ptrs[i] = 0;
-        }
-    }
+    // the blocks are freed once the inode no longer points at them
+    uint32_t old_ptrs[FS_BLOCK_SIZE/4 - 5];
+    uint32_t mode = inode->mode;
+    int32_t size = inode->size;
+    
+    ilock(inode);
+    memcpy(old_ptrs, inode->ptrs, sizeof(old_ptrs));
+    memset(inode->ptrs, 0, sizeof(inode->ptrs));
     
     inode->size = 0;
     
     time_t current_time = time(NULL);
     inode->mtime = (uint32_t)current_time;
+    idirty(inode);
+    iunlock(inode);
     
-    block_write(inode, inum, 1);
+    if (iput(inode) < 0)
+        return -EIO;
     
-    block_write(bitmap, 1, 1);
-    
-    free(inode);
+    free_file_blocks(mode, size, old_ptrs);
     
     return 0;
 }
 
+int fs_truncate(const char *path, off_t len)
+{
+    int inum;
+
+    if (len != 0)
+        return -EINVAL;
+    inum = translate(path);
+    return inum < 0 ? inum : fs_truncate_ino(inum, len);
+}
+
+/* readahead - per-file sequential access detection. Each file gets a
+ * window of blocks to prefetch past the end of the current read. The
+ * window starts small when a file is read from the beginning, doubles
+ * (up to fs_opts.readahead blocks) on every read that continues where
+ * the last one stopped, and halves on every read that jumps elsewhere.
+ * The table is direct-mapped by inode number; a collision just
+ * restarts detection for that file.
+ */
+#define RA_SLOTS 64
+#define RA_INIT 4
+
+struct ra_state {
+    int inum;
+    off_t next;                 /* where a sequential read would start */
+    int window;
+    int ra_end;                 /* first block not yet prefetched */
+};
+
+static struct ra_state ra_table[RA_SLOTS];
+static pthread_mutex_t ra_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* update the state for a read of 'len' bytes at 'offset', and return
+ * the number of blocks to prefetch starting at block *start.
+ */
+static int readahead_window(int inum, off_t offset, size_t len, int *start)
+{
+    struct ra_state *ra = &ra_table[inum % RA_SLOTS];
+    int last = (offset + len - 1) / FS_BLOCK_SIZE;
+    int n;
+
+    if (fs_opts.readahead <= 0)
+        return 0;
+
+    pthread_mutex_lock(&ra_lock);
+    if (ra->inum != inum) {
+        memset(ra, 0, sizeof(*ra));
+        ra->inum = inum;
+    }
+    if (offset == ra->next && (offset > 0 || ra->window == 0)) {
+        ra->window = ra->window ? 2 * ra->window : RA_INIT;
+        if (ra->window > fs_opts.readahead)
+            ra->window = fs_opts.readahead;
+    } else {
+        ra->window /= 2;
+        ra->ra_end = 0;
+    }
+    ra->next = offset + len;
+
+    *start = (ra->ra_end > last + 1) ? ra->ra_end : last + 1;
+    n = last + 1 + ra->window - *start;
+    if (n < 0)
+        n = 0;
+    ra->ra_end = *start + n;
+    pthread_mutex_unlock(&ra_lock);
+
+    return n;
+}
+
+/* queue the readahead for a read of 'len' bytes at 'offset' */
+static void readahead(int inum, struct fs_inode *inode, off_t offset,
+                      size_t len)
+{
+    int lbas[BLK_BATCH_MAX];
+    int start, i, lba, n = 0;
+    int count = readahead_window(inum, offset, len, &start);
+    int nblocks = DIV_ROUND_UP(inode->size, FS_BLOCK_SIZE);
+    struct bmap map;
+
+    bmap_init(&map, inode);
+    for (i = start; i < start + count && i < nblocks; i++) {
+        if ((lba = bmap_get(&map, i)) <= 0)
+            break;
+        lbas[n++] = lba;
+        if (n == BLK_BATCH_MAX) {
+            bcache_prefetch(lbas, n);
+            n = 0;
+        }
+    }
+    bcache_prefetch(lbas, n);
+}
+
+/* should a read at time 'now' write the inode's access time? */
+static int atime_due(struct fs_inode *inode, time_t now)
+{
+    switch (fs_opts.atime) {
+    case FS_ATIME_NOATIME:
+        return 0;
+    case FS_ATIME_RELATIME:
+        return now - (time_t) inode->mtime >= fs_opts.atime_secs;
+    default:
+        return 1;
+    }
+}
+
 /* read - read data from an open file.
  * success: should return exactly the number of bytes requested, except:
  *   - if offset >= file len, return 0
@@ -980,35 +1860,37 @@ int fs_truncate(const char *path, off_t len)
  *   - on error, return <0
  * Errors - path resolution, ENOENT, EISDIR
  */
-int fs_read(const char *path, char *buf, size_t len, off_t offset,
-            struct fuse_file_info *fi)
+int fs_read_ino(int inum, char *buf, size_t len, off_t offset)
 {
-    int inum;
     struct fs_inode *inode;
     size_t file_size;
     int block_index;
     int block_offset;
     size_t bytes_to_read;
     size_t bytes_read = 0;
-    char block_buf[FS_BLOCK_SIZE];
-    
-    inum = translate(path);
-    
-    if (inum < 0)
-        return inum;
-    
-    inode = malloc(sizeof(struct fs_inode));
-    block_read(inode, inum, 1);
+    int lbas[BLK_BATCH_MAX];
+    void *bufs[BLK_BATCH_MAX];
+    int n = 0;
+    char bounce[2][FS_BLOCK_SIZE];
+    struct { char *dst, *src; size_t len; } copy[2];
+    int ncopy = 0;
+    struct bmap map;
+    int lba = 0, run = 0;
+    time_t current_time;
+    int rv = 0;
+    
+    if ((inode = iget(inum)) == NULL)
+        return -EIO;
     
     if (S_ISDIR(inode->mode)) {
-        free(inode);
+        iput(inode);
         return -EISDIR;
     }
     
     file_size = inode->size;
     
     if (offset >= file_size) {
-        free(inode);
+        iput(inode);
         return 0;
     }
     
@@ -1017,45 +1899,96 @@ int fs_read(const char *path, char *buf, size_t len, off_t offset,
     else
         bytes_to_read = len;
     
-    // read the data block by block
+    if (file_inline(inode->mode, inode->size)) {
+        memcpy(buf, (char *) inode->ptrs + offset, bytes_to_read);
+        bytes_read = bytes_to_read;
+        goto done;
+    }
+
+    // start the readahead first, so it overlaps with this read
+    readahead(inum, inode, offset, bytes_to_read);
+    bmap_init(&map, inode);
+    
+    // gather the blocks of the request and fetch them through the
+    // cache, so all the misses go out in one batch and each run of
+    // physically contiguous misses is a single vectored read. Whole blocks land
+    // directly in 'buf'; the partial blocks at either end go through a
+    // bounce buffer. With the mmap backend we just copy out of the
+    // mapping instead.
     while (bytes_read < bytes_to_read) {
         // Calculate which block contains the current offset
         block_index = offset / FS_BLOCK_SIZE;
         block_offset = offset % FS_BLOCK_SIZE;
         
-        // Make sure the block index is within range
-        if (block_index >= FS_BLOCK_SIZE/4 - 5) {
-            break;
-        }
-        
-        // Check if this block exists (it should, given the file_size)
-        if (inode->ptrs[block_index] == 0) {
+        // Check if this block exists (it should, given the file_size).
+        // One lookup covers a whole run of contiguous blocks.
+        if (run > 0)
+            lba++;
+        else if ((lba = bmap_map(&map, block_index, &run)) <= 0) {
+            rv |= lba;
             break;
         }
-        
-        memset(block_buf, 0, FS_BLOCK_SIZE);
-        block_read(block_buf, inode->ptrs[block_index], 1);
+        run--;
         
         size_t remaining_in_block = FS_BLOCK_SIZE - block_offset;
         size_t remaining_to_read = bytes_to_read - bytes_read;
         size_t copy_size = (remaining_in_block < remaining_to_read) ? 
                             remaining_in_block : remaining_to_read;
         
-        memcpy(buf + bytes_read, block_buf + block_offset, copy_size);
+        const char *mapped = bcache_map(lba);
+        
+        if (mapped != NULL) {
+            memcpy(buf + bytes_read, mapped + block_offset, copy_size);
+        } else {
+            lbas[n] = lba;
+            if (copy_size == FS_BLOCK_SIZE) {
+                bufs[n] = buf + bytes_read;
+            } else {
+                copy[ncopy].dst = buf + bytes_read;
+                copy[ncopy].src = bounce[ncopy] + block_offset;
+                copy[ncopy].len = copy_size;
+                bufs[n] = bounce[ncopy++];
+            }
+            if (++n == BLK_BATCH_MAX) {
+                rv |= bcache_read_list(lbas, bufs, n);
+                n = 0;
+            }
+        }
         
         bytes_read += copy_size;
         offset += copy_size;
     }
+    rv |= bcache_read_list(lbas, bufs, n);
     
-    time_t current_time = time(NULL);
-    inode->mtime = (uint32_t)current_time; // Ideally we'd update atime, but we only have mtime
-    block_write(inode, inum, 1);
+    if (rv < 0) {
+        iput(inode);
+        return -EIO;
+    }
+    for (int i = 0; i < ncopy; i++)
+        memcpy(copy[i].dst, copy[i].src, copy[i].len);
+    
+done:
+    current_time = time(NULL);
+    if (atime_due(inode, current_time)) {
+        ilock(inode);
+        inode->mtime = (uint32_t)current_time; // Ideally we'd update atime, but we only have mtime
+        idirty(inode);
+        iunlock(inode);
+    }
     
-    free(inode);
+    iput(inode);
     
     return bytes_read;
 }
 
+int fs_read(const char *path, char *buf, size_t len, off_t offset,
+            struct fuse_file_info *fi)
+{
+    int inum = translate(path);
+
+    return inum < 0 ? inum : fs_read_ino(inum, buf, len, offset);
+}
+
 /* write - write data to a file
  * success - return number of bytes written. (this will be the same as
  *           the number requested, or else it's an error)
@@ -1064,10 +1997,8 @@ int fs_read(const char *path, char *buf, size_t len, off_t offset,
  *  (POSIX semantics support the creation of files with "holes" in them, 
  *   but we don't)
  */
-int fs_write(const char *path, const char *buf, size_t len,
-             off_t offset, struct fuse_file_info *fi)
+int fs_write_ino(int inum, const char *buf, size_t len, off_t offset)
 {
-    int inum;
     struct fs_inode *inode;
     size_t file_size;
     int block_index;
@@ -1075,84 +2006,161 @@ int fs_write(const char *path, const char *buf, size_t len,
     size_t bytes_to_write;
     size_t bytes_written = 0;
     char block_buf[FS_BLOCK_SIZE];
+    const char *run_src = NULL;     // pending run of whole blocks
+    int run_lba = 0, run_len = 0;
+    int resv_next = 0, resv_left = 0;   // reserved, not yet used
+    int allocated = 0;
+    struct bmap map;
+    int lba = 0, run = 0;
+    int rv = 0;
     
-    inum = translate(path);
-    
-    // Check if file exists
-    if (inum < 0)
-        return inum;
-    
-    inode = malloc(sizeof(struct fs_inode));
-    block_read(inode, inum, 1);
+    if ((inode = iget(inum)) == NULL)
+        return -EIO;
     
     // Check if it's a directory
     if (S_ISDIR(inode->mode)) {
-        free(inode);
+        iput(inode);
         return -EISDIR;
     }
     
+    ilock(inode);
     file_size = inode->size;
     
     // Check if offset is valid
     if (offset > file_size) {
-        free(inode);
+        iunlock(inode);
+        iput(inode);
         return -EINVAL;
     }
     
     bytes_to_write = len;
+
+    // inline data stays in the inode while it fits; past that it moves
+    // out to the first block, and the write carries on from there
+    if (file_inline(inode->mode, file_size)) {
+        if (offset + len <= (size_t) inline_max) {
+            memcpy((char *) inode->ptrs + offset, buf, len);
+            bytes_written = len;
+            offset += len;
+            goto done;
+        }
+        if ((allocated = inline_to_block(inode, inum)) < 0) {
+            iunlock(inode);
+            iput(inode);
+            return allocated;
+        }
+    }
+    bmap_init(&map, inode);
     
+    // Whole blocks are written straight from 'buf', and consecutive
+    // ones that are also contiguous on disk go out as one multi-block
+    // write. Only a partial block needs the old contents - and not even
+    // then if it was just allocated, since it is all zeros.
     while (bytes_written < bytes_to_write) {
+        int is_new = 0;
+        
         block_index = offset / FS_BLOCK_SIZE;
         block_offset = offset % FS_BLOCK_SIZE;
         
-        if (block_index >= FS_BLOCK_SIZE/4 - 5) {
+        if (block_index >= map.max) {
             break;
         }
         
-        // Check if this block exists, if not, allocate it
-        if (inode->ptrs[block_index] == 0) {
-            int new_block = find_freeblock();
-            if (new_block < 0) {
-                // No free blocks available
-                break;
+        // Check if this block exists, if not, allocate it. Blocks come
+        // from a run reserved for the rest of the write, placed right
+        // after the previous block of the file so that it stays
+        // contiguous on disk.
+        if (run > 0)
+            lba++;
+        else if ((lba = bmap_map(&map, block_index, &run)) < 0) {
+            rv |= lba;
+            break;
+        }
+        if (run > 0)
+            run--;
+        if (lba == 0) {
+            if (resv_left == 0) {
+                int last = (offset + bytes_to_write - bytes_written - 1) /
+                    FS_BLOCK_SIZE;
+                int prev = bmap_get(&map, block_index - 1);
+                int goal = prev > 0 ? prev + 1 : inode_block(inum) + 1;
+                if (last >= map.max)
+                    last = map.max - 1;
+                resv_next = balloc_alloc_run(&blocks, goal,
+                                             last - block_index + 1,
+                                             &resv_left);
+                if (resv_next < 0) {
+                    // No free blocks available
+                    resv_left = 0;
+                    break;
+                }
             }
-            
-            memset(block_buf, 0, FS_BLOCK_SIZE);
-            block_write(block_buf, new_block, 1);
-            
-            bit_set(bitmap, new_block);
-            inode->ptrs[block_index] = new_block;
+
+            if (bmap_set(&map, block_index, resv_next) < 0)
+                break;
+            lba = resv_next++;
+            resv_left--;
+            allocated = is_new = 1;
         }
         
-        memset(block_buf, 0, FS_BLOCK_SIZE);
-        block_read(block_buf, inode->ptrs[block_index], 1);
-        
         size_t remaining_in_block = FS_BLOCK_SIZE - block_offset;
         size_t remaining_to_write = bytes_to_write - bytes_written;
         size_t write_size = (remaining_in_block < remaining_to_write) ? 
                            remaining_in_block : remaining_to_write;
         
-        memcpy(block_buf + block_offset, buf + bytes_written, write_size);
-        
-        block_write(block_buf, inode->ptrs[block_index], 1);
+        if (write_size == FS_BLOCK_SIZE) {
+            if (run_len > 0 && lba == run_lba + run_len) {
+                run_len++;
+            } else {
+                if (run_len > 0)
+                    rv |= bcache_write((void *) run_src, run_lba, run_len);
+                run_src = buf + bytes_written;
+                run_lba = lba;
+                run_len = 1;
+            }
+        } else {
+            if (is_new)
+                memset(block_buf, 0, FS_BLOCK_SIZE);
+            else
+                rv |= bcache_read(block_buf, lba, 1);
+            memcpy(block_buf + block_offset, buf + bytes_written, write_size);
+            rv |= bcache_write(block_buf, lba, 1);
+        }
         
         bytes_written += write_size;
         offset += write_size;
     }
-    
+    if (run_len > 0)
+        rv |= bcache_write((void *) run_src, run_lba, run_len);
+    while (resv_left-- > 0)
+        balloc_free(&blocks, resv_next++);
+    rv |= bmap_flush(&map);
+    allocated |= map.allocated;
+done:
+
     if (offset > file_size) {
         inode->size = offset;
     }
     
     time_t current_time = time(NULL);
     inode->mtime = (uint32_t)current_time;
+    idirty(inode);
+    iunlock(inode);
     
-    block_write(inode, inum, 1);
-    block_write(bitmap, 1, 1);
-    
-    free(inode);
+    // the new blocks have to be marked before the inode points at them
+    if (allocated)
+        rv |= bitmap_sync();
+    rv |= iput(inode);
     
-    return bytes_written;
+    return rv < 0 ? -EIO : bytes_written;
+}
+
+int fs_write(const char *path, const char *buf, size_t len,
+             off_t offset, struct fuse_file_info *fi)
+{
+    int inum = translate(path);
+
+    return inum < 0 ? inum : fs_write_ino(inum, buf, len, offset);
 }
 
 /* statfs - get file system statistics
@@ -1177,23 +2185,58 @@ int fs_statfs(const char *path, struct statvfs *st)
     st->f_bsize = FS_BLOCK_SIZE;
     st->f_frsize = FS_BLOCK_SIZE;
     
-    st->f_blocks = super.disk_size - 2; // 2 blocks for superblock and bitmap
+    st->f_blocks = super.disk_size - 1 - map_len; // superblock and bitmap
+    if (itable)
+        st->f_blocks -= super.imap_len +
+            (super.inode_count + FS_DINODES_PER_BLOCK - 1) / FS_DINODES_PER_BLOCK;
     
-    unsigned long free_blocks = 0;
-    for (unsigned long i = 2; i < super.disk_size; i++) {
-        if (bit_test(bitmap, i) == 0) {
-            free_blocks++;
-        }
-    }
+    pthread_mutex_lock(&late_lock);
+    unsigned long free_blocks = balloc_nfree(&blocks) + late_blocks;
+    unsigned long free_inodes = itable ? balloc_nfree(&inodes) + late_inodes : 0;
+    pthread_mutex_unlock(&late_lock);
     
     st->f_bfree = free_blocks;
     st->f_bavail = free_blocks;
     
+    if (itable) {
+        st->f_files = super.inode_count;
+        st->f_ffree = st->f_favail = free_inodes;
+    }
+    
     st->f_namemax = MAX_NAME_LEN;
     
     return 0;
 }
 
+/* flush - called on every close() of a file. In write-back mode this
+ * pushes dirty inodes and blocks to the image; it doesn't wait for the
+ * disk.
+ */
+int fs_flush(const char *path, struct fuse_file_info *fi)
+{
+    int rv = icache_flush();
+
+    rv |= bitmap_sync();
+    return rv | bcache_flush();
+}
+
+/* fsync - write back dirty blocks and make the image durable.
+ * We don't track which blocks belong to which file, so this syncs the
+ * whole file system.
+ */
+int fs_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+    int rv = icache_flush();
+
+    if (rv == 0)
+        rv = bitmap_sync();
+    if (rv == 0)
+        rv = bcache_flush();
+    if (rv == 0)
+        rv = block_flush();
+    return rv;
+}
+
 /* operations vector. Please don't rename it, or else you'll break things
  */
 struct fuse_operations fs_ops = {
@@ -1212,5 +2255,10 @@ struct fuse_operations fs_ops = {
     .utime = fs_utime,
     .truncate = fs_truncate,
     .write = fs_write,
+
+    .flush = fs_flush,          /* write-back points */
+    .fsync = fs_fsync,
+    .fsyncdir = fs_fsync,
+    .destroy = fs_destroy,
 };
 
@@ -0,0 +1,47 @@
+/*
+ * file:        fs.h
+ * description: the file system by inode number, for front ends that
+ *              keep track of inodes themselves (fuse-ll.c). The path
+ *              operations in fs_ops resolve the path and call these.
+ *
+ * They return 0 (or a count, or an inode number) on success and a
+ * negative errno on failure, like the path operations. Names are one
+ * component, NUL-terminated; too long is ENAMETOOLONG.
+ */
+#ifndef __FS_H__
+#define __FS_H__
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <time.h>
+
+/* same shape as FUSE's fuse_fill_dir_t */
+typedef int (*fs_filler_t)(void *ptr, const char *name,
+                           const struct stat *sb, off_t off);
+
+/* 'name' in directory 'dir': its inode number, with its attributes
+ * in *sb */
+int fs_lookup_ino(int dir, const char *name, struct stat *sb);
+int fs_getattr_ino(int inum, struct stat *sb);
+
+/* every entry of directory 'inum', with attributes. "." and ".." come
+ * first; the caller says what the parent is.
+ */
+int fs_readdir_ino(int inum, int parent, void *ptr, fs_filler_t filler);
+
+/* create 'name' in 'dir' - 'mode' includes S_IFREG or S_IFDIR.
+ * Returns the new inode number.
+ */
+int fs_mknod_ino(int dir, const char *name, mode_t mode, uid_t uid, gid_t gid);
+int fs_unlink_ino(int parent, const char *name);
+int fs_rmdir_ino(int parent, const char *name);
+int fs_rename_ino(int parent, const char *name, int newparent,
+                  const char *newname);
+
+int fs_chmod_ino(int inum, mode_t mode);
+int fs_utime_ino(int inum, time_t mtime);
+int fs_truncate_ino(int inum, off_t len);
+int fs_read_ino(int inum, char *buf, size_t len, off_t offset);
+int fs_write_ino(int inum, const char *buf, size_t len, off_t offset);
+
+#endif
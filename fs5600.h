@@ -16,16 +16,57 @@ struct fs_dirent {
     char name[28];              /* with trailing NUL */
 };
 
+/* With FS_FEAT_DIRINDEX a directory that outgrows its first block is
+ * hashed: block 0 becomes an index, and the entries move to buckets in
+ * blocks 1 and up. The low 'depth' bits of a name's hash pick an index
+ * slot, which gives the bucket's block within the directory and how
+ * many of those bits all its entries share. A full bucket splits in
+ * two, doubling the index if needed (extendible hashing), so a lookup
+ * is always the index block plus one bucket.
+ */
+#define FS_DIR_INDEX_MAGIC 0x58444948   /* "HIDX": not a possible dirent */
+#define FS_DIR_INDEX_BITS 10            /* max depth */
+
+struct fs_dir_index {
+    uint32_t magic;
+    uint32_t depth;
+    uint16_t bucket[1 << FS_DIR_INDEX_BITS];
+    uint8_t ldepth[1 << FS_DIR_INDEX_BITS];
+    char pad[FS_BLOCK_SIZE - 8 - 3 * (1 << FS_DIR_INDEX_BITS)];
+};
+
 /* Superblock - holds file system parameters. 
  */
 struct fs_super {
     uint32_t magic;
     uint32_t disk_size;         /* in blocks */
+    uint32_t state;             /* FS_STATE_CLEAN once cleanly unmounted */
+    uint32_t free_blocks;       /* only valid if FS_STATE_CLEAN */
+    uint32_t bitmap_start;      /* first block of the block bitmap, */
+    uint32_t bitmap_len;        /* length in blocks (0 = 1 at block 1) */
+    uint32_t features;          /* FS_FEAT_* */
+    uint32_t inode_start;       /* FS_FEAT_ITABLE: first inode table block, */
+    uint32_t inode_count;       /* number of inodes, */
+    uint32_t imap_start;        /* and the inode bitmap */
+    uint32_t imap_len;
+    uint32_t free_inodes;       /* only valid if FS_STATE_CLEAN */
     
     /* pad out to an entire block */
-    char pad[FS_BLOCK_SIZE - 2 * sizeof(uint32_t)]; 
+    char pad[FS_BLOCK_SIZE - 12 * sizeof(uint32_t)]; 
 };
 
+/* super.features */
+#define FS_FEAT_ITABLE 1        /* packed inode table */
+#define FS_FEAT_INDIRECT 2      /* last two ptrs: single, double indirect */
+#define FS_FEAT_EXTENTS 4       /* regular files map extents, see below */
+#define FS_FEAT_INLINE 8        /* small files' data is in ptrs[] */
+#define FS_FEAT_DIRINDEX 16     /* hashed directories, see below */
+
+/* super.state. Anything else (including 0 from older images) means the
+ * free count has to be recomputed from the bitmap at mount.
+ */
+#define FS_STATE_CLEAN 0x4e454c43       /* "CLEN" */
+
 struct fs_inode {
     uint16_t uid;
     uint16_t gid;
@@ -36,4 +77,59 @@ struct fs_inode {
     uint32_t ptrs[FS_BLOCK_SIZE/4 - 5]; /* inode = 4096 bytes */
 };
 
+/* With FS_FEAT_ITABLE an inode is numbered by its slot in the inode
+ * table, not by block, and only its first FS_DINODE_SIZE bytes are
+ * stored - FS_DINODE_PTRS block pointers. The rest reads as zero.
+ */
+#define FS_DINODE_SIZE 256
+#define FS_DINODES_PER_BLOCK (FS_BLOCK_SIZE / FS_DINODE_SIZE)
+#define FS_DINODE_PTRS ((FS_DINODE_SIZE - 20) / 4)
+
+/* With FS_FEAT_EXTENTS a regular file's ptrs[] hold a header and a
+ * sorted array of extents - runs of logical blocks that are also
+ * contiguous on disk. At depth 1 the entries in the inode are an index
+ * instead: 'start' is an extent block, itself a header and extents,
+ * holding the extents from 'lblk' on. Zeroed ptrs are an empty tree.
+ * Directories keep direct block pointers.
+ */
+struct fs_extent_header {
+    uint16_t magic;             /* FS_EXTENT_MAGIC */
+    uint16_t entries;           /* in use */
+    uint16_t depth;             /* 0 = extents, 1 = index */
+    uint16_t pad;
+};
+
+struct fs_extent {
+    uint32_t lblk;              /* first logical block */
+    uint32_t start;             /* first disk block (index: extent block) */
+    uint32_t len;               /* in blocks (index: unused) */
+};
+
+#define FS_EXTENT_MAGIC 0xf30a
+#define FS_EXTENTS_PER_BLOCK \
+    ((FS_BLOCK_SIZE - sizeof(struct fs_extent_header)) / sizeof(struct fs_extent))
+
+/* mount options. fuse.c fills these in before fuse_main, and fs_init
+ * applies them.
+ */
+struct fs_options {
+    size_t cache_size;          /* block cache budget in bytes, 0 = off */
+    int writeback;              /* write-back instead of write-through */
+    int flush_secs;             /* write-back timer, 0 = no timer */
+    int dirty_pct;              /* flush early above this much dirty */
+    int readahead;              /* max readahead window in blocks, 0 = off */
+    int atime;                  /* FS_ATIME_* - what a read does to the inode */
+    int atime_secs;             /* FS_ATIME_RELATIME update interval */
+    int inode_cache;            /* unreferenced inodes kept in memory */
+    int dentry_cache;           /* directory entries kept, 0 = off */
+};
+
+/* the inode has no separate atime, so reads update mtime. STRICT
+ * writes the inode on every read, NOATIME never does, and RELATIME
+ * only if the stored time is at least atime_secs old.
+ */
+enum { FS_ATIME_STRICT = 0, FS_ATIME_NOATIME, FS_ATIME_RELATIME };
+
+extern struct fs_options fs_opts;
+
 #endif
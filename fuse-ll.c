@@ -0,0 +1,448 @@
+/*
+ * file:        fuse-ll.c
+ * description: main() for FUSE mode on the low-level API. The kernel
+ *              names files by inode number here, so requests go
+ *              straight to the fs_*_ino operations (fs.h) with no path
+ *              to resolve; only lookup searches a directory.
+ */
+#define FUSE_USE_VERSION 27
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <fuse.h>
+#include <fuse_lowlevel.h>
+
+#include "fs5600.h"
+#include "fs.h"
+#include "options.h"
+
+/* init, destroy, statfs and the flushes don't take a path anyway */
+extern struct fuse_operations fs_ops;
+
+/* how long the kernel may keep names and attributes. Nothing else
+ * changes the image while it is mounted.
+ */
+#define TIMEOUT 1.0
+
+/* FUSE calls the root FUSE_ROOT_ID (1); ours is inode 2, and inode 1
+ * is never used
+ */
+static int inum_of(fuse_ino_t ino)
+{
+    return ino == FUSE_ROOT_ID ? 2 : (int) ino;
+}
+
+static fuse_ino_t ino_of(int inum)
+{
+    return inum == 2 ? FUSE_ROOT_ID : (fuse_ino_t) inum;
+}
+
+/* What we know about each inode number, indexed by it and grown as
+ * needed.
+ *
+ * The parent of a directory, for "..": directories can't be linked
+ * twice, so it is whichever directory we last found it in.
+ *
+ * A generation number. A deleted file's inode number goes back to the
+ * allocator and can be handed to the next file created, while the
+ * kernel may still hold the old node id; every create bumps the
+ * generation, so the pair (node id, generation) is never reused. They
+ * only have to be unique for one mount, so they aren't stored.
+ */
+struct node {
+    int parent;
+    unsigned long gen;
+};
+
+static pthread_mutex_t node_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct node *nodes;
+static int nnodes;
+
+/* the entry for 'inum', or NULL if there's no memory. Called with
+ * node_lock held.
+ */
+static struct node *node_of(int inum)
+{
+    struct node *p;
+    int n;
+
+    if (inum >= nnodes) {
+        n = nnodes ? nnodes : 1024;
+        while (n <= inum)
+            n *= 2;
+        if ((p = realloc(nodes, n * sizeof(*p))) == NULL)
+            return NULL;
+        memset(p + nnodes, 0, (n - nnodes) * sizeof(*p));
+        nodes = p;
+        nnodes = n;
+    }
+    return &nodes[inum];
+}
+
+static void set_parent(int inum, int parent)
+{
+    struct node *n;
+
+    pthread_mutex_lock(&node_lock);
+    if ((n = node_of(inum)) != NULL)
+        n->parent = parent;
+    pthread_mutex_unlock(&node_lock);
+}
+
+static int get_parent(int inum)
+{
+    int parent = 0;
+
+    pthread_mutex_lock(&node_lock);
+    if (inum < nnodes)
+        parent = nodes[inum].parent;
+    pthread_mutex_unlock(&node_lock);
+    return parent ? parent : 2;         // the root is its own parent
+}
+
+/* 'inum' was just created: a new generation, and no parent yet */
+static void new_node(int inum)
+{
+    static unsigned long next_gen;
+    struct node *n;
+
+    pthread_mutex_lock(&node_lock);
+    if ((n = node_of(inum)) != NULL) {
+        n->parent = 0;
+        n->gen = ++next_gen;
+    }
+    pthread_mutex_unlock(&node_lock);
+}
+
+static unsigned long generation(int inum)
+{
+    unsigned long gen = 0;
+
+    pthread_mutex_lock(&node_lock);
+    if (inum < nnodes)
+        gen = nodes[inum].gen;
+    pthread_mutex_unlock(&node_lock);
+    return gen;
+}
+
+/* reply with the entry for inode 'inum' (or the error in it) */
+static void reply_entry(fuse_req_t req, int parent, int inum,
+                        struct fuse_file_info *fi)
+{
+    struct fuse_entry_param e;
+    int rv;
+
+    memset(&e, 0, sizeof(e));
+    if (inum >= 0 && (rv = fs_getattr_ino(inum, &e.attr)) < 0)
+        inum = rv;
+    if (inum < 0) {
+        fuse_reply_err(req, -inum);
+        return;
+    }
+    if (S_ISDIR(e.attr.st_mode))
+        set_parent(inum, parent);
+    e.ino = e.attr.st_ino = ino_of(inum);
+    e.generation = generation(inum);
+    e.attr_timeout = TIMEOUT;
+    e.entry_timeout = TIMEOUT;
+    if (fi != NULL)
+        fuse_reply_create(req, &e, fi);
+    else
+        fuse_reply_entry(req, &e);
+}
+
+static void reply_attr(fuse_req_t req, int inum)
+{
+    struct stat sb;
+    int rv;
+
+    memset(&sb, 0, sizeof(sb));
+    if ((rv = fs_getattr_ino(inum, &sb)) < 0) {
+        fuse_reply_err(req, -rv);
+        return;
+    }
+    sb.st_ino = ino_of(inum);
+    fuse_reply_attr(req, &sb, TIMEOUT);
+}
+
+static void ll_init(void *userdata, struct fuse_conn_info *conn)
+{
+    fs_ops.init(conn);
+}
+
+static void ll_destroy(void *userdata)
+{
+    fs_ops.destroy(NULL);
+    free(nodes);
+}
+
+static void ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    struct stat sb;
+    int dir = inum_of(parent);
+
+    reply_entry(req, dir, fs_lookup_ino(dir, name, &sb), NULL);
+}
+
+/* inodes aren't held between requests, so there is nothing to drop;
+ * a reused inode number is told apart by its generation (see above)
+ */
+static void ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
+{
+    fuse_reply_none(req);
+}
+
+static void ll_getattr(fuse_req_t req, fuse_ino_t ino,
+                       struct fuse_file_info *fi)
+{
+    reply_attr(req, inum_of(ino));
+}
+
+/* chmod, truncate and utime; there is no chown */
+static void ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+                       int to_set, struct fuse_file_info *fi)
+{
+    int inum = inum_of(ino);
+    int rv = 0;
+
+    if (to_set & (FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID))
+        rv = -ENOSYS;
+    if (rv == 0 && (to_set & FUSE_SET_ATTR_MODE))
+        rv = fs_chmod_ino(inum, attr->st_mode);
+    if (rv == 0 && (to_set & FUSE_SET_ATTR_SIZE))
+        rv = fs_truncate_ino(inum, attr->st_size);
+    if (rv == 0 && (to_set & FUSE_SET_ATTR_MTIME_NOW))
+        rv = fs_utime_ino(inum, time(NULL));
+    else if (rv == 0 && (to_set & FUSE_SET_ATTR_MTIME))
+        rv = fs_utime_ino(inum, attr->st_mtime);
+    if (rv < 0)
+        fuse_reply_err(req, -rv);
+    else
+        reply_attr(req, inum);
+}
+
+static void ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
+                     mode_t mode)
+{
+    const struct fuse_ctx *ctx = fuse_req_ctx(req);
+    int dir = inum_of(parent);
+    int inum = fs_mknod_ino(dir, name, mode | S_IFDIR, ctx->uid, ctx->gid);
+
+    if (inum >= 0)
+        new_node(inum);
+    reply_entry(req, dir, inum, NULL);
+}
+
+static void ll_create(fuse_req_t req, fuse_ino_t parent, const char *name,
+                      mode_t mode, struct fuse_file_info *fi)
+{
+    const struct fuse_ctx *ctx = fuse_req_ctx(req);
+    int dir = inum_of(parent);
+    int inum = fs_mknod_ino(dir, name, mode, ctx->uid, ctx->gid);
+
+    if (inum >= 0)
+        new_node(inum);
+    reply_entry(req, dir, inum, fi);
+}
+
+static void ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    fuse_reply_err(req, -fs_unlink_ino(inum_of(parent), name));
+}
+
+static void ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    fuse_reply_err(req, -fs_rmdir_ino(inum_of(parent), name));
+}
+
+static void ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+                      fuse_ino_t newparent, const char *newname)
+{
+    fuse_reply_err(req, -fs_rename_ino(inum_of(parent), name,
+                                       inum_of(newparent), newname));
+}
+
+static void ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    fuse_reply_open(req, fi);
+}
+
+static void ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                    struct fuse_file_info *fi)
+{
+    char *buf = malloc(size);
+    int n;
+
+    if (buf == NULL) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+    if ((n = fs_read_ino(inum_of(ino), buf, size, off)) < 0)
+        fuse_reply_err(req, -n);
+    else
+        fuse_reply_buf(req, buf, n);
+    free(buf);
+}
+
+static void ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf,
+                     size_t size, off_t off, struct fuse_file_info *fi)
+{
+    int n = fs_write_ino(inum_of(ino), buf, size, off);
+
+    if (n < 0)
+        fuse_reply_err(req, -n);
+    else
+        fuse_reply_write(req, n);
+}
+
+static void ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    fuse_reply_err(req, -fs_ops.flush(NULL, fi));
+}
+
+static void ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+                     struct fuse_file_info *fi)
+{
+    fuse_reply_err(req, -fs_ops.fsync(NULL, datasync, fi));
+}
+
+/* A directory is listed once, at opendir, into a buffer of FUSE
+ * dirents that readdir then hands out by offset.
+ */
+struct dirbuf {
+    fuse_req_t req;
+    char *p;
+    size_t size;
+};
+
+static int dirbuf_add(void *ptr, const char *name, const struct stat *sb,
+                      off_t off)
+{
+    struct dirbuf *b = ptr;
+    struct stat st = *sb;
+    size_t len = fuse_add_direntry(b->req, NULL, 0, name, NULL, 0);
+    char *p;
+
+    if ((p = realloc(b->p, b->size + len)) == NULL)
+        return 1;
+    b->p = p;
+    st.st_ino = ino_of(sb->st_ino);
+    fuse_add_direntry(b->req, b->p + b->size, len, name, &st, b->size + len);
+    b->size += len;
+    return 0;
+}
+
+static void ll_opendir(fuse_req_t req, fuse_ino_t ino,
+                       struct fuse_file_info *fi)
+{
+    struct dirbuf *b = calloc(1, sizeof(*b));
+    int inum = inum_of(ino);
+    int rv;
+
+    if (b == NULL) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+    b->req = req;
+    if ((rv = fs_readdir_ino(inum, get_parent(inum), b, dirbuf_add)) < 0) {
+        free(b->p);
+        free(b);
+        fuse_reply_err(req, -rv);
+        return;
+    }
+    fi->fh = (uintptr_t) b;
+    fuse_reply_open(req, fi);
+}
+
+static void ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+                       off_t off, struct fuse_file_info *fi)
+{
+    struct dirbuf *b = (struct dirbuf *) (uintptr_t) fi->fh;
+
+    if (off >= b->size)
+        fuse_reply_buf(req, NULL, 0);
+    else
+        fuse_reply_buf(req, b->p + off,
+                       b->size - off < size ? b->size - off : size);
+}
+
+static void ll_releasedir(fuse_req_t req, fuse_ino_t ino,
+                          struct fuse_file_info *fi)
+{
+    struct dirbuf *b = (struct dirbuf *) (uintptr_t) fi->fh;
+
+    free(b->p);
+    free(b);
+    fuse_reply_err(req, 0);
+}
+
+static void ll_statfs(fuse_req_t req, fuse_ino_t ino)
+{
+    struct statvfs st;
+
+    fs_ops.statfs("/", &st);
+    fuse_reply_statfs(req, &st);
+}
+
+static struct fuse_lowlevel_ops ll_ops = {
+    .init = ll_init,
+    .destroy = ll_destroy,
+    .lookup = ll_lookup,
+    .forget = ll_forget,
+    .getattr = ll_getattr,
+    .setattr = ll_setattr,
+    .mkdir = ll_mkdir,
+    .create = ll_create,
+    .unlink = ll_unlink,
+    .rmdir = ll_rmdir,
+    .rename = ll_rename,
+    .open = ll_open,
+    .read = ll_read,
+    .write = ll_write,
+    .flush = ll_flush,
+    .fsync = ll_fsync,
+    .opendir = ll_opendir,
+    .readdir = ll_readdir,
+    .releasedir = ll_releasedir,
+    .fsyncdir = ll_fsync,
+    .statfs = ll_statfs,
+};
+
+int main(int argc, char **argv)
+{
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    struct fuse_session *se;
+    struct fuse_chan *ch;
+    char *mountpoint;
+    int multithreaded, foreground;
+    int err = -1;
+
+    parse_options(&args);
+    if (fuse_parse_cmdline(&args, &mountpoint, &multithreaded,
+                           &foreground) == -1)
+        exit(1);
+    if ((ch = fuse_mount(mountpoint, &args)) == NULL)
+        exit(1);
+
+    se = fuse_lowlevel_new(&args, &ll_ops, sizeof(ll_ops), NULL);
+    if (se != NULL) {
+        if (fuse_set_signal_handlers(se) != -1) {
+            fuse_session_add_chan(se, ch);
+            fuse_daemonize(foreground);
+            err = multithreaded ? fuse_session_loop_mt(se)
+                                : fuse_session_loop(se);
+            fuse_remove_signal_handlers(se);
+            fuse_session_remove_chan(ch);
+        }
+        fuse_session_destroy(se);
+    }
+    fuse_unmount(mountpoint, ch);
+    fuse_opt_free_args(&args);
+
+    return err ? 1 : 0;
+}
@@ -7,6 +7,7 @@
 import sys
 import diskfmt as fs
 import random as rnd
+from ctypes import memmove
 
 quiet = False
 if sys.argv[1] == '-q':
@@ -27,11 +28,38 @@ class file(object):
         i.uid, i.gid, i.mode = self.uid, self.gid, self.mode
         i.ctime, i.mtime, i.size = self.ctime, self.mtime, self.size
 
+        if self.inline():
+            data = self.block(0)[:self.size]
+            memmove(i.ptrs, bytes(data), len(data))
+            return bytearray(i)
+
+        if extents:
+            ext = self.extents()
+            i.ptrs[0] = fs.EXTENT_MAGIC | (len(ext) << 16)
+            for j in range(len(ext)):
+                k = fs.EXTENT_HDR + j * fs.EXTENT_LEN
+                i.ptrs[k:k+fs.EXTENT_LEN] = ext[j]
+            return bytearray(i)
 
         for j in range(len(self.blocks)):
             i.ptrs[j] = self.blocks[j]
         return bytearray(i)
 
+    # FEAT_INLINE: the data goes in ptrs, and the blocks aren't used
+    def inline(self):
+        return inline and self.size <= nptrs * 4
+
+    # runs of blocks that are contiguous on disk, as [lblk, start, len]
+    def extents(self):
+        ext = []
+        for j in range(len(self.blocks)):
+            b = self.blocks[j]
+            if ext and ext[-1][1] + ext[-1][2] == b:
+                ext[-1][2] += 1
+            else:
+                ext.append([j, b, 1])
+        return ext
+
     def block(self,offset):
         if not quiet:
             print("block", self.name, offset)
@@ -86,6 +114,11 @@ syms = dict()
 files = []
 dirs = []
 nblocks = 0
+ninodes = 0                               # 'inodes N': packed inode table
+indirect = False                          # 'indirect': FEAT_INDIRECT
+extents = False                           # 'extents': FEAT_EXTENTS
+inline = False                            # 'inline': FEAT_INLINE
+dirindex = False                          # 'dirindex': FEAT_DIRINDEX
 magic = 0x30303635
 
 for line in open(sys.argv[1],'r'):
@@ -101,6 +134,26 @@ for line in open(sys.argv[1],'r'):
     if fields[0] == 'size':
         nblocks = int(fields[1])
         continue
+
+    if fields[0] == 'inodes':
+        ninodes = int(fields[1])
+        continue
+
+    if fields[0] == 'indirect':
+        indirect = True
+        continue
+
+    if fields[0] == 'extents':
+        extents = True
+        continue
+
+    if fields[0] == 'inline':
+        inline = True
+        continue
+
+    if fields[0] == 'dirindex':
+        dirindex = True
+        continue
     
     for i in range(len(fields)):
         if fields[i][0] == '$':
@@ -110,15 +163,57 @@ for line in open(sys.argv[1],'r'):
     if fields[0] == 'dir':
         dirs.append(dir(fields[1:]))
 
-blockmap = fs.bitmap()
+# The bitmap goes in block 1 if it fits in one block, as it always
+# used to; otherwise at the end of the image, so the block numbers in
+# the input file (root directory in inode 2, etc.) stay valid.
+map_len = (nblocks + fs.BITS_PER_BLOCK - 1) // fs.BITS_PER_BLOCK
+map_start = 1 if map_len == 1 else nblocks - map_len
+
+blockmap = fs.blockmap(map_len)
 blockmap.set(0,True)                      # superblock
-blockmap.set(1,True)                      # bitmap
+for i in range(map_start, map_start + map_len):
+    blockmap.set(i,True)                  # bitmap
+
+# A packed inode table and its bitmap go at the end too, in front of
+# the block bitmap if that is there. Inode numbers are then table slots
+# rather than blocks; 0 and 1 are never used, as before.
+if ninodes:
+    itab_len = (ninodes + fs.DINODES_PER_BLOCK - 1) // fs.DINODES_PER_BLOCK
+    imap_len = (ninodes + fs.BITS_PER_BLOCK - 1) // fs.BITS_PER_BLOCK
+    end = nblocks if map_start == 1 else map_start
+    imap_start = end - imap_len
+    itab_start = imap_start - itab_len
+    for i in range(itab_start, end):
+        blockmap.set(i,True)
+    inodemap = fs.blockmap(imap_len)
+    inodemap.set(0,True)
+    inodemap.set(1,True)
+    itab = bytearray(itab_len * 4096)
+
+blocks = [None] * nblocks
 
-blocks = [None] * 400
+# files are only given direct blocks, or extents in the inode
+nptrs = fs.DINODE_PTRS if ninodes else 1019
+ndirect = nptrs - 2 if indirect else nptrs
+ext_root = (nptrs - fs.EXTENT_HDR) // fs.EXTENT_LEN
 
 for f in files + dirs:
-    blocks[f.inum] = [f]
-    blockmap.set(f.inum, True)
+    if f in files and f.inline():
+        f.blocks = []
+    elif extents and f in files:
+        if len(f.extents()) > ext_root:
+            print('ERROR: too many extents for the inode', f.name)
+    elif len(f.blocks) > ndirect:
+        print('ERROR: too many blocks for the inode', f.name)
+    elif dirindex and f in dirs and len(f.blocks) > 1:
+        print('ERROR: directories start out as one block', f.name)
+    if ninodes:
+        inodemap.set(f.inum, True)
+        j = f.inum * fs.DINODE_SIZE
+        itab[j:j+fs.DINODE_SIZE] = f.inode()[:fs.DINODE_SIZE]
+    else:
+        blocks[f.inum] = [f]
+        blockmap.set(f.inum, True)
     i = 0
     for b in f.blocks:
         if blockmap.get(b):
@@ -129,14 +224,35 @@ for f in files + dirs:
 
 sb = fs.super()
 sb.magic, sb.disk_sz = magic, nblocks
-zeros = bytearray(4096)
+sb.bitmap_start, sb.bitmap_len = map_start, map_len
+if indirect:
+    sb.features |= fs.FEAT_INDIRECT
+if extents:
+    sb.features |= fs.FEAT_EXTENTS
+if inline:
+    sb.features |= fs.FEAT_INLINE
+if dirindex:
+    sb.features |= fs.FEAT_DIRINDEX
+if ninodes:
+    sb.features |= fs.FEAT_ITABLE
+    sb.inode_start, sb.inode_count = itab_start, ninodes
+    sb.imap_start, sb.imap_len = imap_start, imap_len
 
 fp = open(sys.argv[2], 'wb')
 fp.write(bytearray(sb))
-fp.write(bytearray(blockmap))
-for i in range(2,nblocks):
-    if not blocks[i]:
-        fp.write(zeros)
+for i in range(1,nblocks):
+    fp.seek(i * 4096)                     # unused blocks are left sparse
+    if map_start <= i < map_start + map_len:
+        j = (i - map_start) * 4096
+        fp.write(blockmap.data[j:j+4096])
+    elif ninodes and itab_start <= i < imap_start:
+        j = (i - itab_start) * 4096
+        fp.write(itab[j:j+4096])
+    elif ninodes and imap_start <= i < imap_start + imap_len:
+        j = (i - imap_start) * 4096
+        fp.write(inodemap.data[j:j+4096])
+    elif not blocks[i]:
+        continue
     elif len(blocks[i]) == 1:
         filedir = blocks[i][0]
         fp.write(filedir.inode())
@@ -145,6 +261,7 @@ for i in range(2,nblocks):
         if not quiet:
             print('item ', item.name, ' offset', offset)
         fp.write(item.block(offset))
+fp.truncate(nblocks * 4096)
 fp.close()
 
 
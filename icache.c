@@ -0,0 +1,386 @@
+/*
+ * file:        icache.c
+ * description: inode cache. Decoded inodes stay resident while they
+ *              are referenced, and up to a configured number of
+ *              unreferenced ones are kept on an LRU list. Changes are
+ *              marked with idirty and written to the block cache when
+ *              the reference is dropped, so each inode is read once per
+ *              cache lifetime instead of once per access.
+ *
+ *              Locking: ic_lock protects the hash table, the LRU list
+ *              and the reference counts. Each entry also has its own
+ *              mutex, which is held while it is being read in and by
+ *              callers modifying it. ic_lock is always taken first,
+ *              so nothing may call into the cache while holding ilock.
+ *
+ *              With a packed inode table several inodes share a block,
+ *              so writing one is a read-modify-write of its table
+ *              block, serialised by it_lock.
+ */
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "fs5600.h"
+#include "bcache.h"
+#include "icache.h"
+
+#define IC_BUCKETS 1024         /* power of 2 */
+
+struct ic_entry {
+    int inum;
+    int refs;
+    int dirty;
+    int loaded;                 /* read in successfully */
+    int dead;                   /* freed or failed to load - not hashed */
+    pthread_mutex_t lock;
+    struct ic_entry *hnext;             /* hash chain */
+    struct ic_entry *prev, *next;       /* LRU list, only while refs == 0 */
+    struct fs_inode inode;
+};
+
+static pthread_mutex_t ic_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct ic_entry *ic_hash[IC_BUCKETS];
+static struct ic_entry *lru_head, *lru_tail;
+static int ic_unused, ic_max = 1024;
+static struct icache_stats ic_stats;
+static int it_start;            /* inode table, 0 = an inode per block */
+static pthread_mutex_t it_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct ic_entry *entry_of(struct fs_inode *ip)
+{
+    return (struct ic_entry *) ((char *) ip - offsetof(struct ic_entry, inode));
+}
+
+static struct ic_entry **bucket(int inum)
+{
+    return &ic_hash[inum & (IC_BUCKETS - 1)];
+}
+
+static struct ic_entry *lookup(int inum)
+{
+    struct ic_entry *e;
+
+    for (e = *bucket(inum); e != NULL; e = e->hnext)
+        if (e->inum == inum)
+            return e;
+    return NULL;
+}
+
+static void unhash(struct ic_entry *e)
+{
+    struct ic_entry **pp;
+
+    for (pp = bucket(e->inum); *pp != NULL; pp = &(*pp)->hnext)
+        if (*pp == e) {
+            *pp = e->hnext;
+            ic_stats.inodes--;
+            return;
+        }
+}
+
+static void lru_remove(struct ic_entry *e)
+{
+    if (e->prev)
+        e->prev->next = e->next;
+    else
+        lru_head = e->next;
+    if (e->next)
+        e->next->prev = e->prev;
+    else
+        lru_tail = e->prev;
+    e->prev = e->next = NULL;
+    ic_unused--;
+}
+
+static void lru_push(struct ic_entry *e)
+{
+    e->prev = NULL;
+    e->next = lru_head;
+    if (lru_head)
+        lru_head->prev = e;
+    lru_head = e;
+    if (lru_tail == NULL)
+        lru_tail = e;
+    ic_unused++;
+}
+
+static void entry_free(struct ic_entry *e)
+{
+    pthread_mutex_destroy(&e->lock);
+    free(e);
+}
+
+/* unreferenced entries are clean (iput wrote them), so eviction is
+ * just dropping them
+ */
+static void trim(void)
+{
+    struct ic_entry *e;
+
+    while (ic_unused > ic_max && (e = lru_tail) != NULL) {
+        lru_remove(e);
+        unhash(e);
+        entry_free(e);
+        ic_stats.evictions++;
+    }
+}
+
+/* take an entry out of the cache for good. If it is still referenced
+ * it is freed by the last iput, without being written.
+ */
+static void drop_entry(struct ic_entry *e)
+{
+    unhash(e);
+    if (e->refs == 0) {
+        lru_remove(e);
+        entry_free(e);
+    } else {
+        pthread_mutex_lock(&e->lock);
+        e->dead = 1;
+        e->dirty = 0;
+        pthread_mutex_unlock(&e->lock);
+    }
+}
+
+static struct ic_entry *entry_new(int inum)
+{
+    struct ic_entry *e = calloc(1, sizeof(*e));
+
+    if (e == NULL)
+        return NULL;
+    e->inum = inum;
+    e->refs = 1;
+    pthread_mutex_init(&e->lock, NULL);
+    e->hnext = *bucket(inum);
+    *bucket(inum) = e;
+    ic_stats.inodes++;
+    return e;
+}
+
+/* read/write the on-disk copy of entry 'e' */
+static int inode_read(struct ic_entry *e)
+{
+    char buf[FS_BLOCK_SIZE];
+
+    if (it_start == 0)
+        return bcache_read(&e->inode, e->inum, 1);
+    if (bcache_read(buf, it_start + e->inum / FS_DINODES_PER_BLOCK, 1) < 0)
+        return -EIO;
+    memset(&e->inode, 0, sizeof(e->inode));
+    memcpy(&e->inode, buf + (e->inum % FS_DINODES_PER_BLOCK) * FS_DINODE_SIZE,
+           FS_DINODE_SIZE);
+    return 0;
+}
+
+static int inode_write(struct ic_entry *e)
+{
+    char buf[FS_BLOCK_SIZE];
+    int lba = it_start + e->inum / FS_DINODES_PER_BLOCK, rv;
+
+    if (it_start == 0)
+        return bcache_write(&e->inode, e->inum, 1);
+    pthread_mutex_lock(&it_lock);
+    if ((rv = bcache_read(buf, lba, 1)) == 0) {
+        memcpy(buf + (e->inum % FS_DINODES_PER_BLOCK) * FS_DINODE_SIZE,
+               &e->inode, FS_DINODE_SIZE);
+        rv = bcache_write(buf, lba, 1);
+    }
+    pthread_mutex_unlock(&it_lock);
+    return rv;
+}
+
+int icache_init(int max, int itable)
+{
+    icache_destroy();
+    pthread_mutex_lock(&ic_lock);
+    ic_max = max < 0 ? 0 : max;
+    it_start = itable;
+    memset(&ic_stats, 0, sizeof(ic_stats));
+    pthread_mutex_unlock(&ic_lock);
+    return 0;
+}
+
+void icache_destroy(void)
+{
+    struct ic_entry *e, *next;
+    int i;
+
+    icache_flush();
+    pthread_mutex_lock(&ic_lock);
+    for (i = 0; i < IC_BUCKETS; i++)
+        for (e = ic_hash[i]; e != NULL; e = next) {
+            next = e->hnext;
+            if (e->refs == 0) {
+                lru_remove(e);
+                unhash(e);
+                entry_free(e);
+            }
+        }
+    pthread_mutex_unlock(&ic_lock);
+}
+
+struct fs_inode *iget(int inum)
+{
+    struct ic_entry *e;
+    int ok;
+
+    pthread_mutex_lock(&ic_lock);
+    if ((e = lookup(inum)) != NULL) {
+        if (e->refs++ == 0)
+            lru_remove(e);
+        ic_stats.hits++;
+        pthread_mutex_unlock(&ic_lock);
+
+        /* wait for whoever is reading it in */
+        pthread_mutex_lock(&e->lock);
+        ok = e->loaded;
+        pthread_mutex_unlock(&e->lock);
+        if (!ok) {
+            iput(&e->inode);
+            return NULL;
+        }
+        return &e->inode;
+    }
+
+    if ((e = entry_new(inum)) == NULL) {
+        pthread_mutex_unlock(&ic_lock);
+        return NULL;
+    }
+    ic_stats.misses++;
+    pthread_mutex_lock(&e->lock);
+    pthread_mutex_unlock(&ic_lock);
+
+    ok = inode_read(e) == 0;
+    if (ok)
+        e->loaded = 1;
+    pthread_mutex_unlock(&e->lock);
+    if (!ok) {
+        iforget(inum);
+        iput(&e->inode);
+        return NULL;
+    }
+    return &e->inode;
+}
+
+struct fs_inode *iget_cached(int inum)
+{
+    struct ic_entry *e;
+    int ok;
+
+    pthread_mutex_lock(&ic_lock);
+    if ((e = lookup(inum)) == NULL) {
+        pthread_mutex_unlock(&ic_lock);
+        return NULL;
+    }
+    if (e->refs++ == 0)
+        lru_remove(e);
+    ic_stats.hits++;
+    pthread_mutex_unlock(&ic_lock);
+
+    pthread_mutex_lock(&e->lock);
+    ok = e->loaded;
+    pthread_mutex_unlock(&e->lock);
+    if (!ok) {
+        iput(&e->inode);
+        return NULL;
+    }
+    return &e->inode;
+}
+
+struct fs_inode *iget_new(int inum)
+{
+    struct ic_entry *e;
+
+    pthread_mutex_lock(&ic_lock);
+    if ((e = lookup(inum)) != NULL)     /* stale copy - shouldn't happen */
+        drop_entry(e);
+    if ((e = entry_new(inum)) != NULL)
+        e->loaded = e->dirty = 1;
+    pthread_mutex_unlock(&ic_lock);
+    return e ? &e->inode : NULL;
+}
+
+int iput(struct fs_inode *ip)
+{
+    struct ic_entry *e = entry_of(ip);
+    int rv = 0;
+
+    pthread_mutex_lock(&e->lock);
+    if (e->dirty && !e->dead) {
+        if ((rv = inode_write(e)) == 0)
+            e->dirty = 0;
+    }
+    pthread_mutex_unlock(&e->lock);
+
+    pthread_mutex_lock(&ic_lock);
+    if (--e->refs == 0) {
+        if (e->dead)
+            entry_free(e);
+        else {
+            lru_push(e);
+            trim();
+        }
+    }
+    pthread_mutex_unlock(&ic_lock);
+    return rv;
+}
+
+void ilock(struct fs_inode *ip)
+{
+    pthread_mutex_lock(&entry_of(ip)->lock);
+}
+
+void iunlock(struct fs_inode *ip)
+{
+    pthread_mutex_unlock(&entry_of(ip)->lock);
+}
+
+void idirty(struct fs_inode *ip)
+{
+    entry_of(ip)->dirty = 1;
+}
+
+void iforget(int inum)
+{
+    struct ic_entry *e;
+
+    pthread_mutex_lock(&ic_lock);
+    if ((e = lookup(inum)) != NULL)
+        drop_entry(e);
+    pthread_mutex_unlock(&ic_lock);
+}
+
+int icache_flush(void)
+{
+    struct ic_entry *e;
+    int i, rv = 0;
+
+    pthread_mutex_lock(&ic_lock);
+    for (i = 0; i < IC_BUCKETS; i++)
+        for (e = ic_hash[i]; e != NULL; e = e->hnext) {
+            pthread_mutex_lock(&e->lock);
+            if (e->dirty) {
+                if (inode_write(e) == 0)
+                    e->dirty = 0;
+                else
+                    rv = -EIO;
+            }
+            pthread_mutex_unlock(&e->lock);
+        }
+    pthread_mutex_unlock(&ic_lock);
+    return rv;
+}
+
+void icache_get_stats(struct icache_stats *st)
+{
+    pthread_mutex_lock(&ic_lock);
+    *st = ic_stats;
+    pthread_mutex_unlock(&ic_lock);
+}
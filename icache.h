@@ -0,0 +1,62 @@
+/*
+ * file:        icache.h
+ * description: reference-counted cache of decoded inodes, keyed by
+ *              inode number
+ */
+#ifndef __ICACHE_H__
+#define __ICACHE_H__
+
+#include "fs5600.h"
+
+struct icache_stats {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+    unsigned long inodes;       /* currently resident */
+};
+
+/* keep up to 'max' unreferenced inodes around (0 = none). 'itable' is
+ * the first block of a packed inode table (FS_FEAT_ITABLE), or 0 if
+ * each inode has a block of its own.
+ */
+int icache_init(int max, int itable);
+
+/* writes back anything still dirty and empties the cache */
+void icache_destroy(void);
+
+/* Return a referenced pointer to inode 'inum', reading it in on a miss,
+ * or NULL on an I/O error. The pointer stays valid until the matching
+ * iput. Callers that change the inode must hold ilock and call idirty.
+ */
+struct fs_inode *iget(int inum);
+
+/* like iget, but only if inode 'inum' is already in memory: NULL
+ * otherwise, and nothing is read
+ */
+struct fs_inode *iget_cached(int inum);
+
+/* like iget, but for a newly allocated inode: nothing is read, and the
+ * inode starts out zeroed and dirty
+ */
+struct fs_inode *iget_new(int inum);
+
+/* drop a reference. A dirty inode is written to the block cache first.
+ * Returns 0 or -EIO.
+ */
+int iput(struct fs_inode *ip);
+
+void ilock(struct fs_inode *ip);
+void iunlock(struct fs_inode *ip);
+
+/* mark the inode modified (caller holds ilock) */
+void idirty(struct fs_inode *ip);
+
+/* the inode was freed: its cached copy must never be written again */
+void iforget(int inum);
+
+/* write every dirty inode to the block cache */
+int icache_flush(void);
+
+void icache_get_stats(struct icache_stats *st);
+
+#endif
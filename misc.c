@@ -1,4 +1,4 @@
-#define _XOPEN_SOURCE 500
+#define _GNU_SOURCE
 #define _FILE_OFFSET_BITS 64
 
 #include <stdio.h>
@@ -9,57 +9,417 @@
 #include <stdint.h>
 #include <fcntl.h>
 #include <assert.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 
 #include "fs5600.h"		/* only for FS_BLOCK_SIZE */
+#include "blkdev.h"
 
-/*********** DO NOT MODIFY THIS FILE *************/
-
-/* All disk I/O is accessed through these functions
+/* All disk I/O is accessed through these functions, which dispatch
+ * to the backend chosen in block_init.
  */
-static int disk_fd;
+static struct blk_ops *ops;
+static struct blk_stats stats;
 
-/* read blocks from disk image. Returns -EIO if error, 0 otherwise
+static void count(int write, int nblks)
+{
+    if (write) {
+        __atomic_add_fetch(&stats.writes, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&stats.blocks_written, nblks, __ATOMIC_RELAXED);
+    } else {
+        __atomic_add_fetch(&stats.reads, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&stats.blocks_read, nblks, __ATOMIC_RELAXED);
+    }
+}
+
+static off_t blk_offset(int lba)
+{
+    return (off_t) lba * FS_BLOCK_SIZE;
+}
+
+/* positional I/O backend - one pread/pwrite per request, no shared
+ * file offset, so it is safe for concurrent callers.
  */
-int block_read(char *buf, int lba, int nblks)
+static int pio_fd = -1;
+
+static int pio_open(int fd, int nblks)
 {
-    int len = nblks * FS_BLOCK_SIZE, start = lba * FS_BLOCK_SIZE;
+    (void) nblks;
+    pio_fd = fd;
+    return 0;
+}
 
-    if (lseek(disk_fd, start, SEEK_SET) < 0)
+static int pio_read(void *buf, int lba, int nblks)
+{
+    ssize_t len = (ssize_t) nblks * FS_BLOCK_SIZE;
+
+    if (pread(pio_fd, buf, len, blk_offset(lba)) != len)
         return -EIO;
-    if (read(disk_fd, buf, len) != len)
+    return 0;
+}
+
+static int pio_write(const void *buf, int lba, int nblks)
+{
+    ssize_t len = (ssize_t) nblks * FS_BLOCK_SIZE;
+
+    if (pwrite(pio_fd, buf, len, blk_offset(lba)) != len)
         return -EIO;
     return 0;
 }
 
-/* write blocks from disk image. Returns -EIO if error, 0 otherwise
+static int pio_readv(const struct iovec *iov, int iovcnt, int lba, int nblks)
+{
+    ssize_t len = (ssize_t) nblks * FS_BLOCK_SIZE;
+
+    if (preadv(pio_fd, iov, iovcnt, blk_offset(lba)) != len)
+        return -EIO;
+    return 0;
+}
+
+static int pio_writev(const struct iovec *iov, int iovcnt, int lba, int nblks)
+{
+    ssize_t len = (ssize_t) nblks * FS_BLOCK_SIZE;
+
+    if (pwritev(pio_fd, iov, iovcnt, blk_offset(lba)) != len)
+        return -EIO;
+    return 0;
+}
+
+static int pio_flush(void)
+{
+    return fdatasync(pio_fd) < 0 ? -EIO : 0;
+}
+
+static void pio_close(void)
+{
+    close(pio_fd);
+    pio_fd = -1;
+}
+
+static struct blk_ops pio_ops = {
+    .name = "pread",
+    .open = pio_open,
+    .read = pio_read,
+    .write = pio_write,
+    .readv = pio_readv,
+    .writev = pio_writev,
+    .flush = pio_flush,
+    .close = pio_close,
+};
+
+/* mmap backend - the whole image is mapped shared, so reads and
+ * writes are memcpys against the page cache and callers that only
+ * look at a block can use block_map to skip the copy. The image can't
+ * grow, and writes are only durable after block_flush (msync).
  */
-int block_write(char *buf, int lba, int nblks)
+static char *mm_base;
+static int mm_fd = -1, mm_nblks;
+
+static int mm_open(int fd, int nblks)
 {
-    int len = nblks * FS_BLOCK_SIZE, start = lba * FS_BLOCK_SIZE;
+    if (nblks == 0)
+        return -1;
+    mm_base = mmap(NULL, (size_t) nblks * FS_BLOCK_SIZE,
+                   PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mm_base == MAP_FAILED) {
+        mm_base = NULL;
+        return -1;
+    }
+    mm_fd = fd;
+    mm_nblks = nblks;
+    return 0;
+}
 
-    assert(lba > 0);		/* write to 0 is *always* an error */
-    
-    /* Seek to the *end* of the region being written, to make sure it
-     * all fits on the disk image. Then seek to write location.
-     */
-    if (lseek(disk_fd, start + len, SEEK_SET) < 0)
+static void *mm_map(int lba, int nblks)
+{
+    if (lba < 0 || nblks < 0 || lba + nblks > mm_nblks)
+        return NULL;
+    return mm_base + (size_t) lba * FS_BLOCK_SIZE;
+}
+
+static int mm_read(void *buf, int lba, int nblks)
+{
+    char *p = mm_map(lba, nblks);
+
+    if (p == NULL)
         return -EIO;
-    if (lseek(disk_fd, start, SEEK_SET) < 0)
+    memcpy(buf, p, (size_t) nblks * FS_BLOCK_SIZE);
+    return 0;
+}
+
+static int mm_write(const void *buf, int lba, int nblks)
+{
+    char *p = mm_map(lba, nblks);
+
+    if (p == NULL)
         return -EIO;
-    if (write(disk_fd, buf, len) != len)
+    memcpy(p, buf, (size_t) nblks * FS_BLOCK_SIZE);
+    return 0;
+}
+
+static int mm_readv(const struct iovec *iov, int iovcnt, int lba, int nblks)
+{
+    char *p = mm_map(lba, nblks);
+    size_t left = (size_t) nblks * FS_BLOCK_SIZE;
+    int i;
+
+    if (p == NULL)
+        return -EIO;
+    for (i = 0; i < iovcnt && left > 0; i++) {
+        size_t n = iov[i].iov_len < left ? iov[i].iov_len : left;
+        memcpy(iov[i].iov_base, p, n);
+        p += n;
+        left -= n;
+    }
+    return left == 0 ? 0 : -EIO;
+}
+
+static int mm_writev(const struct iovec *iov, int iovcnt, int lba, int nblks)
+{
+    char *p = mm_map(lba, nblks);
+    size_t left = (size_t) nblks * FS_BLOCK_SIZE;
+    int i;
+
+    if (p == NULL)
+        return -EIO;
+    for (i = 0; i < iovcnt && left > 0; i++) {
+        size_t n = iov[i].iov_len < left ? iov[i].iov_len : left;
+        memcpy(p, iov[i].iov_base, n);
+        p += n;
+        left -= n;
+    }
+    return left == 0 ? 0 : -EIO;
+}
+
+static int mm_flush(void)
+{
+    if (msync(mm_base, (size_t) mm_nblks * FS_BLOCK_SIZE, MS_SYNC) < 0)
         return -EIO;
     return 0;
 }
 
-void block_init(char *file)
+static void mm_close(void)
 {
+    msync(mm_base, (size_t) mm_nblks * FS_BLOCK_SIZE, MS_SYNC);
+    munmap(mm_base, (size_t) mm_nblks * FS_BLOCK_SIZE);
+    close(mm_fd);
+    mm_base = NULL;
+    mm_fd = -1;
+    mm_nblks = 0;
+}
+
+static struct blk_ops mm_ops = {
+    .name = "mmap",
+    .open = mm_open,
+    .read = mm_read,
+    .write = mm_write,
+    .readv = mm_readv,
+    .writev = mm_writev,
+    .map = mm_map,
+    .flush = mm_flush,
+    .close = mm_close,
+};
+
+/* available backends; the first one is the default
+ */
+static struct blk_ops *backends[] = {
+    &pio_ops,
+    &uring_ops,
+    &mm_ops,
+    NULL
+};
+
+/* read blocks from disk image. Returns -EIO if error, 0 otherwise
+ */
+int block_read(void *buf, int lba, int nblks)
+{
+    count(0, nblks);
+    return ops->read(buf, lba, nblks);
+}
+
+/* write blocks from disk image. Returns -EIO if error, 0 otherwise
+ */
+int block_write(void *buf, int lba, int nblks)
+{
+    assert(lba > 0);		/* write to 0 is *always* an error */
+    count(1, nblks);
+    return ops->write(buf, lba, nblks);
+}
+
+int block_write_super(void *buf)
+{
+    count(1, 1);
+    return ops->write(buf, 0, 1);
+}
+
+/* vectored versions: 'nblks' contiguous blocks starting at 'lba',
+ * scattered over 'iov'.
+ */
+int block_readv(const struct iovec *iov, int iovcnt, int lba, int nblks)
+{
+    count(0, nblks);
+    return ops->readv(iov, iovcnt, lba, nblks);
+}
+
+int block_writev(const struct iovec *iov, int iovcnt, int lba, int nblks)
+{
+    assert(lba > 0);
+    count(1, nblks);
+    return ops->writev(iov, iovcnt, lba, nblks);
+}
+
+void block_batch_init(struct blk_batch *b)
+{
+    b->n = 0;
+}
+
+static int batch_add(struct blk_batch *b, int write, void *buf,
+                     const struct iovec *iov, int iovcnt, int lba, int nblks)
+{
+    struct blk_req *r;
+    int rv = 0;
+
+    assert(!write || lba > 0);
+    if (b->n == BLK_BATCH_MAX)
+        rv = block_batch_submit(b);
+
+    r = &b->req[b->n++];
+    r->write = write;
+    r->buf = buf;
+    r->iov = iov;
+    r->iovcnt = iovcnt;
+    r->lba = lba;
+    r->nblks = nblks;
+    return rv;
+}
+
+int block_batch_read(struct blk_batch *b, void *buf, int lba, int nblks)
+{
+    return batch_add(b, 0, buf, NULL, 0, lba, nblks);
+}
+
+int block_batch_write(struct blk_batch *b, void *buf, int lba, int nblks)
+{
+    return batch_add(b, 1, buf, NULL, 0, lba, nblks);
+}
+
+int block_batch_readv(struct blk_batch *b, const struct iovec *iov,
+                      int iovcnt, int lba, int nblks)
+{
+    return batch_add(b, 0, NULL, iov, iovcnt, lba, nblks);
+}
+
+int block_batch_writev(struct blk_batch *b, const struct iovec *iov,
+                       int iovcnt, int lba, int nblks)
+{
+    return batch_add(b, 1, NULL, iov, iovcnt, lba, nblks);
+}
+
+/* backends without native async support run the batch in order
+ */
+static int submit_sync(struct blk_req *req, int n)
+{
+    struct blk_req *r;
+    int i, rv = 0;
+
+    for (i = 0; i < n && rv == 0; i++) {
+        r = &req[i];
+        if (r->iov != NULL)
+            rv = r->write ? ops->writev(r->iov, r->iovcnt, r->lba, r->nblks)
+                          : ops->readv(r->iov, r->iovcnt, r->lba, r->nblks);
+        else
+            rv = r->write ? ops->write(r->buf, r->lba, r->nblks)
+                          : ops->read(r->buf, r->lba, r->nblks);
+    }
+    return rv;
+}
+
+int block_batch_submit(struct blk_batch *b)
+{
+    int i, rv;
+
+    if (b->n == 0)
+        return 0;
+    for (i = 0; i < b->n; i++)
+        count(b->req[i].write, b->req[i].nblks);
+    rv = ops->submit ? ops->submit(b->req, b->n) : submit_sync(b->req, b->n);
+    b->n = 0;
+    return rv;
+}
+
+/* direct pointer to 'nblks' blocks at 'lba', or NULL if the backend
+ * can't hand one out. The memory is only valid until block_close, and
+ * must not be written through - use block_write.
+ */
+const void *block_map(int lba, int nblks)
+{
+    return ops->map ? ops->map(lba, nblks) : NULL;
+}
+
+void block_get_stats(struct blk_stats *st)
+{
+    st->reads = __atomic_load_n(&stats.reads, __ATOMIC_RELAXED);
+    st->writes = __atomic_load_n(&stats.writes, __ATOMIC_RELAXED);
+    st->blocks_read = __atomic_load_n(&stats.blocks_read, __ATOMIC_RELAXED);
+    st->blocks_written = __atomic_load_n(&stats.blocks_written,
+                                         __ATOMIC_RELAXED);
+}
+
+int block_flush(void)
+{
+    return ops->flush();
+}
+
+const char *block_backend_name(void)
+{
+    return ops->name;
+}
+
+int block_init_backend(char *file, const char *backend)
+{
+    struct blk_ops **b;
+    struct stat sb;
+    int fd;
+
+    for (b = backends; *b != NULL; b++)
+        if (backend == NULL || strcmp((*b)->name, backend) == 0)
+            break;
+    if (*b == NULL)
+        return -EINVAL;
+
     if (strlen(file) < 4 || strcmp(file+strlen(file)-4, ".img") != 0) {
         printf("bad image file (must end in .img): %s\n", file);
         exit(1);
     }
-    if ((disk_fd = open(file, O_RDWR)) < 0) {
+    if ((fd = open(file, O_RDWR)) < 0) {
         printf("cannot open image file '%s': %s\n", file, strerror(errno));
         exit(1);
     }
+    if (fstat(fd, &sb) < 0) {
+        printf("cannot stat image file '%s': %s\n", file, strerror(errno));
+        exit(1);
+    }
+    if ((*b)->open(fd, sb.st_size / FS_BLOCK_SIZE) < 0) {
+        close(fd);
+        return -ENODEV;
+    }
+    ops = *b;
+    memset(&stats, 0, sizeof(stats));
+    return 0;
 }
 
+void block_init(char *file)
+{
+    if (block_init_backend(file, NULL) < 0) {
+        printf("cannot open image file '%s'\n", file);
+        exit(1);
+    }
+}
+
+void block_close(void)
+{
+    if (ops != NULL)
+        ops->close();
+    ops = NULL;
+}
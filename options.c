@@ -0,0 +1,118 @@
+/*
+ * file:        options.c
+ * description: command line options, shared by both FUSE front ends
+ */
+#define FUSE_USE_VERSION 27
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <fuse_opt.h>
+
+#include "fs5600.h"
+#include "blkdev.h"
+#include "bcache.h"
+#include "options.h"
+
+static struct data {
+    char *image_name;
+    char *backend;
+    int   cache_mb;
+    int   writeback;
+    int   flush_secs;
+    int   dirty_pct;
+    int   readahead;
+    int   atime;
+    int   atime_secs;
+    int   inode_cache;
+    int   dentry_cache;
+    int   part;
+    int   cmd_mode;
+} _data;
+
+/**************/
+
+/*
+ * See comments in /usr/include/fuse/fuse_opts.h for details of 
+ * FUSE argument processing.
+ * 
+ *  usage: ./fuse (or ./fuse-ll) -image disk.img [options] directory
+ *              disk.img  - name of the image file to mount
+ *              directory - directory to mount it on
+ *  options:
+ *     -backend name - block I/O backend: pread (default), uring, mmap
+ *     -cache_mb N   - block cache size in MB (default 16, 0 = off)
+ *     -writeback    - cache writes and flush them later (default is
+ *                     write-through)
+ *     -flush_secs N - write-back interval in seconds (default 5)
+ *     -dirty_pct N  - flush early once N% of the cache is dirty (50)
+ *     -readahead N  - max sequential readahead in blocks (32, 0 = off)
+ *     -inode_cache N - unused inodes kept in memory (default 1024)
+ *     -dentry_cache N - directory entries kept in memory, including
+ *                     negative ones (default 4096, 0 = off)
+ *     -noatime      - reads never write the inode
+ *     -relatime     - reads write the inode at most once per interval
+ *     -atime_secs N - the -relatime interval in seconds (default 86400)
+ */
+static struct fuse_opt opts[] = {
+    {"-image %s", offsetof(struct data, image_name), 0},
+    {"-backend %s", offsetof(struct data, backend), 0},
+    {"-cache_mb %d", offsetof(struct data, cache_mb), 0},
+    {"-writeback", offsetof(struct data, writeback), 1},
+    {"-flush_secs %d", offsetof(struct data, flush_secs), 0},
+    {"-dirty_pct %d", offsetof(struct data, dirty_pct), 0},
+    {"-readahead %d", offsetof(struct data, readahead), 0},
+    {"-inode_cache %d", offsetof(struct data, inode_cache), 0},
+    {"-dentry_cache %d", offsetof(struct data, dentry_cache), 0},
+    {"-noatime", offsetof(struct data, atime), FS_ATIME_NOATIME},
+    {"-relatime", offsetof(struct data, atime), FS_ATIME_RELATIME},
+    {"-atime_secs %d", offsetof(struct data, atime_secs), 0},
+    FUSE_OPT_END
+};
+
+void parse_options(struct fuse_args *args)
+{
+    _data.cache_mb = _data.flush_secs = _data.dirty_pct = -1;
+    _data.readahead = _data.atime_secs = _data.inode_cache = -1;
+    _data.dentry_cache = -1;
+    if (fuse_opt_parse(args, &_data, opts, NULL) == -1)
+	exit(1);
+    if (_data.cache_mb >= 0)
+        fs_opts.cache_size = (size_t) _data.cache_mb << 20;
+    fs_opts.writeback = _data.writeback;
+    if (_data.flush_secs >= 0)
+        fs_opts.flush_secs = _data.flush_secs;
+    if (_data.dirty_pct >= 0)
+        fs_opts.dirty_pct = _data.dirty_pct;
+    if (_data.readahead >= 0)
+        fs_opts.readahead = _data.readahead;
+    if (_data.inode_cache >= 0)
+        fs_opts.inode_cache = _data.inode_cache;
+    if (_data.dentry_cache >= 0)
+        fs_opts.dentry_cache = _data.dentry_cache;
+    if (fs_opts.writeback && fs_opts.cache_size == 0) {
+        fprintf(stderr, "-writeback needs the block cache (-cache_mb > 0)\n");
+        exit(1);
+    }
+    // fs_init turns write-back on once the file system is already
+    // mounted, too late to refuse - so try it out here first
+    if (fs_opts.writeback) {
+        if (bcache_init(fs_opts.cache_size) < 0 ||
+            bcache_set_writeback(1, fs_opts.flush_secs,
+                                 fs_opts.dirty_pct) < 0) {
+            fprintf(stderr, "can't turn on write-back caching\n");
+            exit(1);
+        }
+        bcache_destroy();
+    }
+    fs_opts.atime = _data.atime;
+    if (_data.atime_secs >= 0)
+        fs_opts.atime_secs = _data.atime_secs;
+
+    if (block_init_backend(_data.image_name, _data.backend) < 0) {
+        fprintf(stderr, "backend not available: %s\n", _data.backend);
+        exit(1);
+    }
+}
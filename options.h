@@ -0,0 +1,15 @@
+/*
+ * file:        options.h
+ * description: command line options, shared by both FUSE front ends
+ */
+#ifndef __OPTIONS_H__
+#define __OPTIONS_H__
+
+#include <fuse_opt.h>
+
+/* take our options (see options.c) out of 'args', fill in fs_opts and
+ * open the image. Exits on an error.
+ */
+void parse_options(struct fuse_args *args);
+
+#endif
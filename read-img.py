@@ -1,6 +1,7 @@
 #!/usr/bin/python
 import sys
 import os
+import struct
 import diskfmt as fs
 
 fd = os.open(sys.argv[1], os.O_RDONLY)
@@ -16,11 +17,72 @@ print ('superblock: magic:  %08X%s' %
            (sb.magic, ' *BAD*' if sb.magic != fs.MAGIC else ''))
 print ('            blocks: %d%s' %
            (sb.disk_sz, (' *BAD* %d' % nblks) if sb.disk_sz != nblks else ''))
+if sb.state == fs.STATE_CLEAN:
+    print ('            clean, %d free' % sb.free)
+else:
+    print ('            not cleanly unmounted')
 print
 
-blkmap = fs.bitmap.from_buffer_copy(blks[1])
+map_start = sb.bitmap_start if sb.bitmap_len else 1
+map_len = sb.bitmap_len if sb.bitmap_len else 1
+print ('            bitmap: %d block(s) at %d' % (map_len, map_start))
+blkmap = fs.blockmap(map_len, b''.join(blks[map_start:map_start+map_len]))
+inomap = blkmap
+if sb.features & fs.FEAT_ITABLE:
+    print ('            %d inodes at %d, inode bitmap at %d' %
+           (sb.inode_count, sb.inode_start, sb.imap_start))
+    inomap = fs.blockmap(sb.imap_len,
+                         b''.join(blks[sb.imap_start:sb.imap_start+sb.imap_len]))
 inodes = dict()
 
+def read_inode(inum):
+    if not (sb.features & fs.FEAT_ITABLE):
+        return fs.inode.from_buffer_copy(blks[inum])
+    blk = blks[sb.inode_start + inum // fs.DINODES_PER_BLOCK]
+    j = (inum % fs.DINODES_PER_BLOCK) * fs.DINODE_SIZE
+    return fs.inode.from_buffer_copy(blk[j:j+fs.DINODE_SIZE].ljust(4096, b'\0'))
+
+# the blocks of a regular file, in order. 'raw' is an extent node: the
+# inode's ptrs, or an extent block.
+def extent_blocks(raw):
+    magic, count, depth = struct.unpack_from('<HHH', raw)
+    if magic != fs.EXTENT_MAGIC:
+        return []
+    out = []
+    for j in range(count):
+        lblk, start, n = struct.unpack_from('<III', raw, 8 + 12*j)
+        out += extent_blocks(blks[start]) if depth else range(start, start + n)
+    return out
+
+nptrs = fs.DINODE_PTRS if sb.features & fs.FEAT_ITABLE else 1019
+ndirect = nptrs - 2 if sb.features & fs.FEAT_INDIRECT else nptrs
+
+def is_inline(_in):
+    return sb.features & fs.FEAT_INLINE and _in.size <= nptrs * 4
+
+# the blocks under pointer block 'b', 'depth' levels above the data
+def indirect_blocks(b, depth):
+    if b == 0:
+        return []
+    ptrs = struct.unpack_from('<1024I', blks[b])
+    if depth == 1:
+        return list(ptrs)
+    return [x for p in ptrs for x in indirect_blocks(p, depth - 1)]
+
+# logical blocks 0..xblks-1 of a block-mapped inode, as bmap sees them
+def ptr_blocks(_in, xblks):
+    out = list(_in.ptrs[:min(xblks, ndirect)])
+    if sb.features & fs.FEAT_INDIRECT and xblks > ndirect:
+        out += indirect_blocks(_in.ptrs[ndirect], 1)
+        if xblks > ndirect + 1024:
+            out += indirect_blocks(_in.ptrs[ndirect + 1], 2)
+    return out[:xblks]
+
+def file_blocks(_in, xblks):
+    if sb.features & fs.FEAT_EXTENTS:
+        return extent_blocks(bytes(_in.ptrs))[:xblks]
+    return ptr_blocks(_in, xblks)
+
 print("blocks used:"),
 n = 0
 e = ''
@@ -40,8 +102,8 @@ def iter(name, inum, v):
     assert inum < nblks
     children = []
     inodes[inum] = 1
-    _in = fs.inode.from_buffer_copy(blks[inum])
-    alloc = '' if blkmap.get(inum) else 'NOT MARKED IN BITMAP '
+    _in = read_inode(inum)
+    alloc = '' if inomap.get(inum) else 'NOT MARKED IN BITMAP '
     s = '/' if name == '' else name
 
     if v:
@@ -50,20 +112,31 @@ def iter(name, inum, v):
                                                  _in.size, alloc))
     
     xblks = (_in.size + 4095) // 4096
-    if fs.S_ISREG(_in.mode):
+    if fs.S_ISREG(_in.mode) and is_inline(_in):
+        if v:
+            print ('  inline: %r' % bytes(_in.ptrs)[:_in.size])
+    elif fs.S_ISREG(_in.mode):
         if v:
             print ('  blocks: ', end='')
-        for i in range(xblks):
-            alloc = '' if blkmap.get(_in.ptrs[i]) else '(NOT ALLOCATED)'
+        for b in file_blocks(_in, xblks):
+            alloc = '' if blkmap.get(b) else '(NOT ALLOCATED)'
             if v:
-                print (str(_in.ptrs[i]) + alloc, end=' '),
+                print (str(b) + alloc, end=' '),
         print("\n")
         if v:
             print
     elif fs.S_ISDIR(_in.mode):
-        for i in range(xblks):
-            dblk = _in.ptrs[i]
-            alloc = '' if blkmap.get(_in.ptrs[i]) else '(NOT ALLOCATED)'
+        # a hashed directory's first block is its index
+        dblks = ptr_blocks(_in, xblks)
+        first = 0
+        if (sb.features & fs.FEAT_DIRINDEX and xblks > 1 and
+                struct.unpack_from('<I', blks[dblks[0]])[0] == fs.DIR_INDEX_MAGIC):
+            first = 1
+            if v:
+                print ('  index', dblks[0])
+        for i in range(first, xblks):
+            dblk = dblks[i]
+            alloc = '' if blkmap.get(dblk) else '(NOT ALLOCATED)'
             if v:
                 print ('  block', dblk, alloc)
             _blk = blks[dblk]
@@ -14,7 +14,12 @@
 #include <fuse.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <pthread.h>
 
+#include "bcache.h"
+#include "icache.h"
+#include "dcache.h"
+#include "dirscan.h"
 
 /* change test name and make it do something useful */
 START_TEST(a_test)
@@ -206,6 +211,180 @@ START_TEST(fs_readdir_tests)
 }
 END_TEST
 
+/* a repeated lookup of the same path should be served from the block
+ * cache without going to disk
+ */
+START_TEST(fs_cache_tests)
+{
+    struct bcache_stats before, after;
+    struct stat sb;
+
+    ck_assert_int_eq(fs_ops.getattr("/dir3/subdir/file.12k", &sb), 0);
+    bcache_get_stats(&before);
+    ck_assert_int_eq(fs_ops.getattr("/dir3/subdir/file.12k", &sb), 0);
+    bcache_get_stats(&after);
+
+    ck_assert_int_eq(after.misses, before.misses);
+    ck_assert_int_eq(sb.st_size, 12288);
+}
+END_TEST
+
+/* rewrites block 3, with the contents in 'arg', until told to stop */
+static volatile int writer_stop;
+
+static void *block_writer(void *arg)
+{
+    while (!writer_stop)
+        bcache_write(arg, 3, 1);
+    return NULL;
+}
+
+/* writes to one block don't keep reads of other blocks out of the
+ * cache
+ */
+START_TEST(fs_cache_fill_tests)
+{
+    static char data[256][FS_BLOCK_SIZE], block3[FS_BLOCK_SIZE];
+    struct bcache_stats before, after;
+    int lbas[256];
+    void *bufs[256];
+    pthread_t t;
+    int i, round;
+
+    for (i = 0; i < 256; i++) {
+        lbas[i] = 10 + i;
+        bufs[i] = data[i];
+    }
+    ck_assert_int_eq(bcache_read(block3, 3, 1), 0);
+    writer_stop = 0;
+    ck_assert_int_eq(pthread_create(&t, NULL, block_writer, block3), 0);
+    for (round = 0; round < 200; round++) {
+        bcache_invalidate(10, 256);
+        ck_assert_int_eq(bcache_read_list(lbas, bufs, 256), 0);
+        bcache_get_stats(&before);
+        ck_assert_int_eq(bcache_read_list(lbas, bufs, 256), 0);
+        bcache_get_stats(&after);
+        ck_assert_int_eq(after.misses, before.misses);
+    }
+    writer_stop = 1;
+    pthread_join(t, NULL);
+}
+END_TEST
+
+/* the inode is decoded once and then stays resident (the directories
+ * on the path are skipped entirely, thanks to the dentry cache)
+ */
+START_TEST(fs_icache_tests)
+{
+    struct icache_stats before, after;
+    struct stat sb;
+
+    ck_assert_int_eq(fs_ops.getattr("/dir3/subdir/file.4k-", &sb), 0);
+    icache_get_stats(&before);
+    ck_assert_int_eq(fs_ops.getattr("/dir3/subdir/file.4k-", &sb), 0);
+    icache_get_stats(&after);
+
+    ck_assert_int_eq(after.misses, before.misses);
+    ck_assert_int_eq(after.hits, before.hits + 1);
+    ck_assert_int_eq(sb.st_size, 4095);
+}
+END_TEST
+
+/* lookups are answered by the dentry cache, and so are repeated
+ * lookups of names that don't exist
+ */
+START_TEST(fs_dcache_tests)
+{
+    struct dcache_stats dbefore, dafter;
+    struct bcache_stats before, after;
+    struct stat sb;
+
+    ck_assert_int_eq(fs_ops.getattr("/dir2/twenty-seven-byte-file-name", &sb), 0);
+    ck_assert_int_eq(fs_ops.getattr("/dir2/no-such-file", &sb), -ENOENT);
+    dcache_get_stats(&dbefore);
+    bcache_get_stats(&before);
+    ck_assert_int_eq(fs_ops.getattr("/dir2/twenty-seven-byte-file-name", &sb), 0);
+    ck_assert_int_eq(fs_ops.getattr("/dir2/no-such-file", &sb), -ENOENT);
+    ck_assert_int_eq(fs_ops.getattr("/dir2/no-such-file", &sb), -ENOENT);
+    bcache_get_stats(&after);
+    dcache_get_stats(&dafter);
+
+    ck_assert_int_eq(after.misses, before.misses);
+    ck_assert_int_eq(after.hits, before.hits);
+    ck_assert_int_eq(dafter.misses, dbefore.misses);
+    ck_assert_int_eq(dafter.hits, dbefore.hits + 4);
+    ck_assert_int_eq(dafter.neg_hits, dbefore.neg_hits + 2);
+}
+END_TEST
+
+/* path walk corner cases: repeated and trailing slashes, and errors
+ * for missing or non-directory components
+ */
+START_TEST(fs_path_tests)
+{
+    struct stat sb;
+
+    ck_assert_int_eq(fs_ops.getattr("//dir3///subdir/file.4k-", &sb), 0);
+    ck_assert_int_eq(sb.st_size, 4095);
+    ck_assert_int_eq(fs_ops.getattr("/dir3/subdir/", &sb), 0);
+    ck_assert_int_eq(S_ISDIR(sb.st_mode), 1);
+    ck_assert_int_eq(fs_ops.getattr("/", &sb), 0);
+    ck_assert_int_eq(fs_ops.getattr("/file.1k/x", &sb), -ENOTDIR);
+    ck_assert_int_eq(fs_ops.getattr("/not-a-dir/x", &sb), -ENOENT);
+}
+END_TEST
+
+/* every dirent search implementation the CPU has gives the same
+ * answers: names compare up to their NUL only, deleted entries never
+ * match, and the free entry is found in either half of the block
+ */
+START_TEST(fs_dirscan_tests)
+{
+    static const char *names[] = { "avx2", "sse2", "scalar" };
+    static struct fs_dirent de[DIRSCAN_ENTRIES];
+    const char *dflt = dirscan_impl();
+    const char *long_name = "twenty-seven-byte-file-name";
+    int i, free, ran = 0;
+
+    memset(de, 0, sizeof(de));
+    for (i = 0; i < DIRSCAN_ENTRIES; i++) {
+        de[i].valid = 1;
+        de[i].inode = i + 10;
+        sprintf(de[i].name, "entry-%d", i);
+    }
+    de[1].valid = 0;
+    strcpy(de[1].name, "target");
+    strcpy(de[2].name, "targetX");
+    strcpy(de[3].name, "targ");
+    memset(de[4].name, 'z', sizeof(de[4].name));
+    strcpy(de[4].name, "target");       // garbage after the NUL
+    strcpy(de[5].name, long_name);
+
+    for (i = 0; i < 3; i++) {
+        if (dirscan_use(names[i]) < 0)
+            continue;
+        ran++;
+        ck_assert_int_eq(dirscan(de, "target", 6, &free), 4);
+        ck_assert_int_eq(free, 1);
+        ck_assert_int_eq(dirscan(de, "targ", 4, NULL), 3);
+        ck_assert_int_eq(dirscan(de, "targe", 5, NULL), -1);
+        ck_assert_int_eq(dirscan(de, long_name, 27, NULL), 5);
+        ck_assert_int_eq(dirscan(de, "entry-127", 9, NULL), 127);
+        de[1].valid = 1;
+        de[100].valid = 0;
+        ck_assert_int_eq(dirscan(de, "entry-100", 9, &free), -1);
+        ck_assert_int_eq(free, 100);
+        ck_assert_int_eq(dirscan_free(de), 100);
+        de[100].valid = 1;
+        ck_assert_int_eq(dirscan(de, "nope", 4, &free), -1);
+        ck_assert_int_eq(free, -1);
+        de[1].valid = 0;
+    }
+    ck_assert_int_ge(ran, 1);
+    dirscan_use(dflt);
+}
+END_TEST
+
 int main(int argc, char **argv)
 {
     block_init("test.img");
@@ -219,6 +398,12 @@ int main(int argc, char **argv)
 
     tcase_add_test(tc, fs_getattr_tests);
     tcase_add_test(tc, fs_readdir_tests);
+    tcase_add_test(tc, fs_cache_tests);
+    tcase_add_test(tc, fs_cache_fill_tests);
+    tcase_add_test(tc, fs_icache_tests);
+    tcase_add_test(tc, fs_dcache_tests);
+    tcase_add_test(tc, fs_path_tests);
+    tcase_add_test(tc, fs_dirscan_tests);
 
     suite_add_tcase(s, tc);
     SRunner *sr = srunner_create(s);
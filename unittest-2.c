@@ -14,6 +14,13 @@
 #include <fuse.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <ctype.h>
+
+#include "fs5600.h"
+#include "blkdev.h"
+#include "bcache.h"
+#include "dcache.h"
+#include "fs.h"
 
 /* mockup for fuse_get_context. you can change ctx.uid, ctx.gid in 
  * tests if you want to test setting UIDs in mknod/mkdir
@@ -24,8 +31,6 @@ struct fuse_context *fuse_get_context(void)
     return &ctx;
 }
 
-#define FS_BLOCK_SIZE 4096
-
 /* this is an example of a callback function for readdir
  */
 int empty_filler(void *ptr, const char *name, const struct stat *stbuf,
@@ -701,6 +706,1014 @@ START_TEST(fs_write_test)
 }
 END_TEST
 
+/* fs.c never looks at the FUSE file info, so the tests below share one */
+static struct fuse_file_info test_fi;
+
+/* readahead to go back to after mount_cold, 0 if it isn't off */
+static int cold_readahead;
+
+/* unmount the current image and mount 'img' in its place */
+static void mount_image(char *img)
+{
+    if (cold_readahead) {
+        fs_opts.readahead = cold_readahead;
+        cold_readahead = 0;
+    }
+    fs_ops.destroy(NULL);
+    block_close();
+    block_init(img);
+    fs_ops.init(NULL);
+}
+
+/* Mount 'img' with nothing cached, to count the blocks a read takes.
+ * Readahead is off until the next mount_image: the prefetch thread
+ * reads ahead of the reader, and when the reader gets to a block
+ * before its prefetch has been cached both of them read it, so the
+ * count would depend on timing.
+ */
+static void mount_cold(char *img)
+{
+    mount_image(img);
+    cold_readahead = fs_opts.readahead;
+    fs_opts.readahead = 0;
+}
+
+/* Create regular file 'name' and write 'len' bytes of 'buf' to it,
+ * with the statfs from before in *st if 'st' isn't NULL. Returns what
+ * the write did: a short write is left to the caller.
+ */
+static int make_file(const char *name, const void *buf, size_t len,
+                     struct statvfs *st)
+{
+    if (st != NULL)
+        ck_assert_int_eq(fs_ops.statfs("/", st), 0);
+    ck_assert_int_eq(fs_ops.create(name, S_IFREG | 0644, &test_fi), 0);
+    return len ? fs_ops.write(name, buf, len, 0, &test_fi) : 0;
+}
+
+START_TEST(fs_writeback_test)
+{
+    const char *filename = "/writeback_test.txt";
+    size_t len = FS_BLOCK_SIZE * 2 + 100;
+    char *write_buf = malloc(len);
+    char *read_buf = malloc(len);
+    struct bcache_stats st;
+    int r;
+
+    for (size_t i = 0; i < len; i++)
+        write_buf[i] = 'a' + (i % 23);
+
+    // no timer - only explicit flushes
+    r = bcache_set_writeback(1, 0, 100);
+    ck_assert_int_eq(r, 0);
+
+    r = make_file(filename, write_buf, len, NULL);
+    ck_assert_int_eq(r, len);
+
+    // data is only in the cache so far, but reads must see it
+    bcache_get_stats(&st);
+    ck_assert_int_gt(st.dirty, 0);
+    memset(read_buf, 0, len);
+    r = fs_ops.read(filename, read_buf, len, 0, &test_fi);
+    ck_assert_int_eq(r, len);
+    ck_assert_int_eq(memcmp(write_buf, read_buf, len), 0);
+
+    r = fs_ops.fsync(filename, 0, &test_fi);
+    ck_assert_int_eq(r, 0);
+    bcache_get_stats(&st);
+    ck_assert_int_eq(st.dirty, 0);
+
+    // throw the cache away - everything has to come back from disk
+    r = bcache_set_writeback(0, 0, 0);
+    ck_assert_int_eq(r, 0);
+    bcache_init(16 << 20);
+    memset(read_buf, 0, len);
+    r = fs_ops.read(filename, read_buf, len, 0, &test_fi);
+    ck_assert_int_eq(r, len);
+    ck_assert_int_eq(memcmp(write_buf, read_buf, len), 0);
+
+    r = fs_ops.unlink(filename);
+    ck_assert_int_eq(r, 0);
+
+    free(write_buf);
+    free(read_buf);
+}
+END_TEST
+
+/* blocks set in the bitmap on disk (test2.img: one bitmap block) */
+static int disk_bits_used(void)
+{
+    unsigned char map[FS_BLOCK_SIZE];
+    int i, n = 0;
+
+    block_read(map, 1, 1);
+    for (i = 0; i < FS_BLOCK_SIZE; i++)
+        n += __builtin_popcount(map[i]);
+    return n;
+}
+
+/* in write-back mode an unlink's frees must not reach the bitmap on
+ * disk in the same flush as the dirent that unlinks them
+ */
+START_TEST(fs_writeback_free_test)
+{
+    const char *filename = "/writeback_free.txt";
+    char buf[FS_BLOCK_SIZE * 3];
+    struct statvfs before, after;
+    int used, r;
+
+    memset(buf, 'f', sizeof(buf));
+    ck_assert_int_eq(bcache_set_writeback(1, 0, 100), 0);
+    r = make_file(filename, buf, sizeof(buf), &before);
+    ck_assert_int_eq(r, sizeof(buf));
+    ck_assert_int_eq(fs_ops.fsync(filename, 0, &test_fi), 0);
+    used = disk_bits_used();
+
+    // free as far as statfs goes, but still in use on disk
+    ck_assert_int_eq(fs_ops.unlink(filename), 0);
+    ck_assert_int_eq(fs_ops.statfs("/", &after), 0);
+    ck_assert_int_eq(after.f_bfree, before.f_bfree);
+    ck_assert_int_eq(fs_ops.flush("/", &test_fi), 0);
+    ck_assert_int_eq(disk_bits_used(), used);
+
+    // the dirent is on disk now, so the next flush can free them
+    ck_assert_int_eq(fs_ops.flush("/", &test_fi), 0);
+    ck_assert_int_eq(disk_bits_used(), used - 4);
+    ck_assert_int_eq(fs_ops.statfs("/", &after), 0);
+    ck_assert_int_eq(after.f_bfree, before.f_bfree);
+
+    ck_assert_int_eq(bcache_set_writeback(0, 0, 0), 0);
+}
+END_TEST
+
+START_TEST(fs_readahead_test)
+{
+    const char *filename = "/readahead_test.bin";
+    size_t len = FS_BLOCK_SIZE * 16;
+    char *write_buf = malloc(len);
+    char *read_buf = malloc(FS_BLOCK_SIZE);
+    struct bcache_stats before, after;
+    int r;
+
+    for (size_t i = 0; i < len; i++)
+        write_buf[i] = 'A' + (i / FS_BLOCK_SIZE);
+
+    r = make_file(filename, write_buf, len, NULL);
+    ck_assert_int_eq(r, len);
+
+    // start with a cold cache, and stream the file from the start
+    bcache_init(16 << 20);
+    for (int i = 0; i < 2; i++) {
+        r = fs_ops.read(filename, read_buf, FS_BLOCK_SIZE, i * FS_BLOCK_SIZE,
+                        &test_fi);
+        ck_assert_int_eq(r, FS_BLOCK_SIZE);
+        ck_assert_int_eq(memcmp(write_buf + i * FS_BLOCK_SIZE, read_buf,
+                                FS_BLOCK_SIZE), 0);
+    }
+    bcache_prefetch_wait();
+
+    // the next block was prefetched, so reading it doesn't miss
+    bcache_get_stats(&before);
+    ck_assert_int_gt(before.prefetched, 0);
+    r = fs_ops.read(filename, read_buf, FS_BLOCK_SIZE, 2 * FS_BLOCK_SIZE,
+                    &test_fi);
+    ck_assert_int_eq(r, FS_BLOCK_SIZE);
+    ck_assert_int_eq(memcmp(write_buf + 2 * FS_BLOCK_SIZE, read_buf,
+                            FS_BLOCK_SIZE), 0);
+    bcache_get_stats(&after);
+    ck_assert_int_eq(after.misses, before.misses);
+
+    r = fs_ops.unlink(filename);
+    ck_assert_int_eq(r, 0);
+
+    free(write_buf);
+    free(read_buf);
+}
+END_TEST
+
+/* a large read of a freshly written (so mostly contiguous) file
+ * should turn into a few multi-block requests, not one per block
+ */
+START_TEST(fs_coalesced_read_test)
+{
+    const char *filename = "/coalesce_test.bin";
+    size_t len = FS_BLOCK_SIZE * 32;
+    char *write_buf = malloc(len);
+    char *read_buf = malloc(len);
+    struct blk_stats before, after;
+    struct stat sb;
+    int r;
+
+    for (size_t i = 0; i < len; i++)
+        write_buf[i] = 'a' + (i / FS_BLOCK_SIZE) % 26;
+
+    r = make_file(filename, write_buf, len, NULL);
+    ck_assert_int_eq(r, len);
+
+    // cold cache, but with the path and inode already cached
+    bcache_init(16 << 20);
+    r = fs_ops.getattr(filename, &sb);
+    ck_assert_int_eq(r, 0);
+
+    block_get_stats(&before);
+    r = fs_ops.read(filename, read_buf, len, 0, &test_fi);
+    ck_assert_int_eq(r, len);
+    ck_assert_int_eq(memcmp(write_buf, read_buf, len), 0);
+    block_get_stats(&after);
+    ck_assert_int_eq(after.blocks_read - before.blocks_read, 32);
+    ck_assert_int_le(after.reads - before.reads, 4);
+
+    r = fs_ops.unlink(filename);
+    ck_assert_int_eq(r, 0);
+
+    free(write_buf);
+    free(read_buf);
+}
+END_TEST
+
+/* a file written a few blocks at a time still ends up contiguous, as
+ * each allocation starts right after the file's previous block
+ */
+START_TEST(fs_contig_append_test)
+{
+    const char *filename = "/contig_test.bin";
+    size_t chunk = FS_BLOCK_SIZE * 4, len = chunk * 8;
+    char *write_buf = malloc(len);
+    char *read_buf = malloc(len);
+    struct blk_stats before, after;
+    struct stat sb;
+    int r;
+
+    for (size_t i = 0; i < len; i++)
+        write_buf[i] = 'A' + (i / 1000) % 26;
+
+    make_file(filename, NULL, 0, NULL);
+    for (size_t off = 0; off < len; off += chunk) {
+        r = fs_ops.write(filename, write_buf + off, chunk, off, &test_fi);
+        ck_assert_int_eq(r, chunk);
+    }
+
+    bcache_init(16 << 20);
+    r = fs_ops.getattr(filename, &sb);
+    ck_assert_int_eq(r, 0);
+
+    block_get_stats(&before);
+    r = fs_ops.read(filename, read_buf, len, 0, &test_fi);
+    ck_assert_int_eq(r, len);
+    ck_assert_int_eq(memcmp(write_buf, read_buf, len), 0);
+    block_get_stats(&after);
+    ck_assert_int_eq(after.blocks_read - before.blocks_read, 32);
+    ck_assert_int_eq(after.reads - before.reads, 1);
+
+    r = fs_ops.unlink(filename);
+    ck_assert_int_eq(r, 0);
+
+    free(write_buf);
+    free(read_buf);
+}
+END_TEST
+
+/* whole-block writes shouldn't read anything back or pre-zero the
+ * blocks they allocate: just the data, the inode and the bitmap
+ */
+START_TEST(fs_write_no_rmw_test)
+{
+    const char *filename = "/no_rmw_test.bin";
+    size_t len = FS_BLOCK_SIZE * 8;
+    char *write_buf = malloc(len);
+    char *read_buf = malloc(len);
+    struct blk_stats before, after;
+    int r;
+
+    for (size_t i = 0; i < len; i++)
+        write_buf[i] = 'A' + (i / FS_BLOCK_SIZE) + (i % 7);
+
+    make_file(filename, NULL, 0, NULL);
+
+    block_get_stats(&before);
+    r = fs_ops.write(filename, write_buf, len, 0, &test_fi);
+    ck_assert_int_eq(r, len);
+    block_get_stats(&after);
+    ck_assert_int_eq(after.blocks_read - before.blocks_read, 0);
+    ck_assert_int_eq(after.blocks_written - before.blocks_written, 8 + 2);
+    ck_assert_int_lt(after.writes - before.writes, 8);
+
+    // partial append into a new block
+    r = fs_ops.write(filename, write_buf + len - FS_BLOCK_SIZE, 100,
+                     len, &test_fi);
+    ck_assert_int_eq(r, 100);
+    r = fs_ops.read(filename, read_buf, len, 0, &test_fi);
+    ck_assert_int_eq(r, len);
+    ck_assert_int_eq(memcmp(write_buf, read_buf, len - 100), 0);
+    r = fs_ops.read(filename, read_buf, FS_BLOCK_SIZE, len, &test_fi);
+    ck_assert_int_eq(r, 100);
+    ck_assert_int_eq(memcmp(write_buf + len - FS_BLOCK_SIZE, read_buf, 100), 0);
+
+    // an append that allocates nothing leaves the bitmap alone: just
+    // the data block and the inode
+    block_get_stats(&before);
+    r = fs_ops.write(filename, write_buf, 100, len + 100, &test_fi);
+    ck_assert_int_eq(r, 100);
+    block_get_stats(&after);
+    ck_assert_int_eq(after.blocks_written - before.blocks_written, 2);
+
+    // and so does unlink, until the next flush: just the directory
+    block_get_stats(&before);
+    r = fs_ops.unlink(filename);
+    ck_assert_int_eq(r, 0);
+    block_get_stats(&after);
+    ck_assert_int_eq(after.blocks_written - before.blocks_written, 1);
+    ck_assert_int_eq(fs_ops.flush("/", &test_fi), 0);
+    block_get_stats(&before);
+    ck_assert_int_eq(before.blocks_written - after.blocks_written, 1);
+
+    free(write_buf);
+    free(read_buf);
+}
+END_TEST
+
+/* with noatime a read is read-only; with relatime it writes the
+ * inode only when the stored time is older than the interval
+ */
+START_TEST(fs_atime_test)
+{
+    const char *filename = "/atime_test.bin";
+    char buf[100];
+    struct utimbuf ut = {.actime = 1000, .modtime = 1000};
+    struct blk_stats before, after;
+    struct stat sb;
+    int r;
+
+    memset(buf, 'x', sizeof(buf));
+    r = make_file(filename, buf, sizeof(buf), NULL);
+    ck_assert_int_eq(r, sizeof(buf));
+    r = fs_ops.utime(filename, &ut);
+    ck_assert_int_eq(r, 0);
+
+    fs_opts.atime = FS_ATIME_NOATIME;
+    block_get_stats(&before);
+    r = fs_ops.read(filename, buf, sizeof(buf), 0, &test_fi);
+    ck_assert_int_eq(r, sizeof(buf));
+    block_get_stats(&after);
+    ck_assert_int_eq(after.writes, before.writes);
+    fs_ops.getattr(filename, &sb);
+    ck_assert_int_eq(sb.st_mtime, 1000);
+
+    // first read after a long time updates it, the next one doesn't
+    fs_opts.atime = FS_ATIME_RELATIME;
+    r = fs_ops.read(filename, buf, sizeof(buf), 0, &test_fi);
+    ck_assert_int_eq(r, sizeof(buf));
+    fs_ops.getattr(filename, &sb);
+    ck_assert_int_gt(sb.st_mtime, 1000);
+    block_get_stats(&before);
+    r = fs_ops.read(filename, buf, sizeof(buf), 0, &test_fi);
+    ck_assert_int_eq(r, sizeof(buf));
+    block_get_stats(&after);
+    ck_assert_int_eq(after.writes, before.writes);
+
+    fs_opts.atime = FS_ATIME_STRICT;
+    r = fs_ops.unlink(filename);
+    ck_assert_int_eq(r, 0);
+}
+END_TEST
+
+/* every directory change has to be reflected in the dentry cache,
+ * including names that were cached as missing
+ */
+START_TEST(fs_dcache_invalidate_test)
+{
+    struct dcache_stats st;
+    struct stat sb;
+    int r;
+
+    // cache negative entries, then create the names
+    ck_assert_int_eq(fs_ops.getattr("/dc_file", &sb), -ENOENT);
+    ck_assert_int_eq(fs_ops.getattr("/dc_dir", &sb), -ENOENT);
+    ck_assert_int_eq(fs_ops.getattr("/dc_file", &sb), -ENOENT);
+    dcache_get_stats(&st);
+    ck_assert_int_gt(st.neg_hits, 0);
+
+    r = fs_ops.create("/dc_file", S_IFREG | 0644, &test_fi);
+    ck_assert_int_eq(r, 0);
+    r = fs_ops.mkdir("/dc_dir", 0755);
+    ck_assert_int_eq(r, 0);
+    ck_assert_int_eq(fs_ops.getattr("/dc_file", &sb), 0);
+    ck_assert_int_eq(fs_ops.getattr("/dc_dir", &sb), 0);
+    ck_assert_int_eq(fs_ops.getattr("/dc_dir/inner", &sb), -ENOENT);
+
+    // rename: old name gone, new name found
+    r = fs_ops.rename("/dc_file", "/dc_file2");
+    ck_assert_int_eq(r, 0);
+    ck_assert_int_eq(fs_ops.getattr("/dc_file", &sb), -ENOENT);
+    ck_assert_int_eq(fs_ops.getattr("/dc_file2", &sb), 0);
+
+    // unlink and rmdir leave negative entries behind
+    r = fs_ops.unlink("/dc_file2");
+    ck_assert_int_eq(r, 0);
+    ck_assert_int_eq(fs_ops.getattr("/dc_file2", &sb), -ENOENT);
+    r = fs_ops.rmdir("/dc_dir");
+    ck_assert_int_eq(r, 0);
+    ck_assert_int_eq(fs_ops.getattr("/dc_dir", &sb), -ENOENT);
+    ck_assert_int_eq(fs_ops.getattr("/dc_dir/inner", &sb), -ENOENT);
+
+    // a new directory in its place starts out empty
+    r = fs_ops.mkdir("/dc_dir", 0755);
+    ck_assert_int_eq(r, 0);
+    r = fs_ops.create("/dc_dir/inner", S_IFREG | 0644, &test_fi);
+    ck_assert_int_eq(r, 0);
+    ck_assert_int_eq(fs_ops.getattr("/dc_dir/inner", &sb), 0);
+    r = fs_ops.unlink("/dc_dir/inner");
+    ck_assert_int_eq(r, 0);
+    r = fs_ops.rmdir("/dc_dir");
+    ck_assert_int_eq(r, 0);
+
+}
+END_TEST
+
+/* allocation stops at the end of the image (not at 8x its size), and
+ * everything comes back when the file is removed
+ */
+START_TEST(fs_alloc_full_test)
+{
+    const char *filename = "/fill_test.bin";
+    size_t len = FS_BLOCK_SIZE * 500;
+    char *buf = calloc(1, len);
+    struct statvfs before, after;
+    int r;
+
+    r = make_file(filename, buf, len, &before);
+    ck_assert_int_eq(r, (before.f_bfree - 1) * FS_BLOCK_SIZE);
+    ck_assert_int_eq(fs_ops.statfs("/", &after), 0);
+    ck_assert_int_eq(after.f_bfree, 0);
+
+    r = fs_ops.unlink(filename);
+    ck_assert_int_eq(r, 0);
+    ck_assert_int_eq(fs_ops.statfs("/", &after), 0);
+    ck_assert_int_eq(after.f_bfree, before.f_bfree);
+
+    free(buf);
+}
+END_TEST
+
+/* the free count survives an unmount/mount through the superblock,
+ * and the superblock says the image was unmounted cleanly
+ */
+START_TEST(fs_statfs_remount_test)
+{
+    const char *filename = "/remount_test.bin";
+    char buf[FS_BLOCK_SIZE * 3] = {0};
+    struct statvfs before, after;
+    struct fs_super sb;
+    int r;
+
+    r = make_file(filename, buf, sizeof(buf), &before);
+    ck_assert_int_eq(r, sizeof(buf));
+    ck_assert_int_eq(fs_ops.statfs("/", &after), 0);
+    ck_assert_int_eq(after.f_bfree, before.f_bfree - 4);
+
+    fs_ops.destroy(NULL);
+    ck_assert_int_eq(block_read(&sb, 0, 1), 0);
+    ck_assert_int_eq(sb.state, FS_STATE_CLEAN);
+    ck_assert_int_eq(sb.free_blocks, after.f_bfree);
+
+    // mounted again, the image is no longer clean until unmounted
+    fs_ops.init(NULL);
+    ck_assert_int_eq(block_read(&sb, 0, 1), 0);
+    ck_assert_int_ne(sb.state, FS_STATE_CLEAN);
+    ck_assert_int_eq(fs_ops.statfs("/", &after), 0);
+    ck_assert_int_eq(after.f_bfree, before.f_bfree - 4);
+
+    r = fs_ops.unlink(filename);
+    ck_assert_int_eq(r, 0);
+    ck_assert_int_eq(fs_ops.statfs("/", &after), 0);
+    ck_assert_int_eq(after.f_bfree, before.f_bfree);
+
+}
+END_TEST
+
+/* test3.img has 100000 blocks, so a 4-block bitmap at the end of the
+ * image. Mounted in place of test2.img for the duration of the test.
+ */
+START_TEST(fs_big_volume_test)
+{
+    const char *filename = "/big_volume_test.bin";
+    char buf[FS_BLOCK_SIZE * 4];
+    char read_buf[sizeof(buf)];
+    struct statvfs st;
+    struct fs_super sb;
+    int r;
+
+    mount_image("test3.img");
+
+    ck_assert_int_eq(fs_ops.statfs("/", &st), 0);
+    ck_assert_int_eq(st.f_blocks, 100000 - 1 - 4);
+    ck_assert_int_eq(st.f_bfree, st.f_blocks - 2);   // root inode + dir
+
+    memset(buf, 'b', sizeof(buf));
+    r = make_file(filename, buf, sizeof(buf), NULL);
+    ck_assert_int_eq(r, sizeof(buf));
+
+    fs_ops.destroy(NULL);
+    ck_assert_int_eq(block_read(&sb, 0, 1), 0);
+    ck_assert_int_eq(sb.bitmap_start, 100000 - 4);
+    ck_assert_int_eq(sb.bitmap_len, 4);
+    ck_assert_int_eq(sb.free_blocks, st.f_bfree - 5);
+
+    fs_ops.init(NULL);
+    r = fs_ops.read(filename, read_buf, sizeof(read_buf), 0, &test_fi);
+    ck_assert_int_eq(r, sizeof(read_buf));
+    ck_assert_int_eq(memcmp(buf, read_buf, sizeof(buf)), 0);
+    r = fs_ops.unlink(filename);
+    ck_assert_int_eq(r, 0);
+    ck_assert_int_eq(fs_ops.statfs("/", &st), 0);
+    ck_assert_int_eq(st.f_bfree, st.f_blocks - 2);
+
+    mount_image("test2.img");
+}
+END_TEST
+
+/* test4.img has a packed inode table: creating files uses inodes but no
+ * blocks, and a few table blocks cover a directory's worth of getattrs.
+ * Only FS_DINODE_PTRS - 2 pointers are direct.
+ */
+START_TEST(fs_itable_test)
+{
+    char *buf = calloc(1, FS_BLOCK_SIZE * (FS_DINODE_PTRS + 4));
+    struct statvfs st0, st;
+    struct blk_stats before, after;
+    struct stat sb;
+    char name[32];
+    int i, r;
+
+    mount_image("test4.img");
+
+    ck_assert_int_eq(fs_ops.statfs("/", &st0), 0);
+    ck_assert_int_eq(st0.f_blocks, 2000 - 1 - 1 - 64 - 1);
+    ck_assert_int_eq(st0.f_bfree, st0.f_blocks - 3);
+    ck_assert_int_eq(st0.f_files, 1024);
+    ck_assert_int_eq(st0.f_ffree, 1024 - 4);
+
+    ck_assert_int_eq(fs_ops.getattr("/file.8k", &sb), 0);
+    ck_assert_int_eq(sb.st_size, 8000);
+
+    for (i = 0; i < 20; i++) {
+        sprintf(name, "/f%d", i);
+        r = fs_ops.create(name, S_IFREG | 0644, &test_fi);
+        ck_assert_int_eq(r, 0);
+    }
+    ck_assert_int_eq(fs_ops.statfs("/", &st), 0);
+    ck_assert_int_eq(st.f_bfree, st0.f_bfree);
+    ck_assert_int_eq(st.f_ffree, st0.f_ffree - 20);
+
+    // cold: the root directory block plus two inode table blocks
+    mount_image("test4.img");
+    block_get_stats(&before);
+    for (i = 0; i < 20; i++) {
+        sprintf(name, "/f%d", i);
+        ck_assert_int_eq(fs_ops.getattr(name, &sb), 0);
+        ck_assert_int_eq(sb.st_mode, S_IFREG | 0644);
+    }
+    block_get_stats(&after);
+    ck_assert_int_le(after.blocks_read - before.blocks_read, 3);
+
+    r = fs_ops.write("/f0", buf, FS_BLOCK_SIZE * (FS_DINODE_PTRS + 4), 0,
+                     &test_fi);
+    ck_assert_int_eq(r, FS_BLOCK_SIZE * (FS_DINODE_PTRS + 4));
+    ck_assert_int_eq(fs_ops.statfs("/", &st), 0);
+    ck_assert_int_eq(st.f_bfree, st0.f_bfree - (FS_DINODE_PTRS + 4) - 1);
+
+    for (i = 0; i < 20; i++) {
+        sprintf(name, "/f%d", i);
+        ck_assert_int_eq(fs_ops.unlink(name), 0);
+    }
+    ck_assert_int_eq(fs_ops.statfs("/", &st), 0);
+    ck_assert_int_eq(st.f_bfree, st0.f_bfree);
+    ck_assert_int_eq(st.f_ffree, st0.f_ffree);
+
+    mount_image("test2.img");
+    free(buf);
+}
+END_TEST
+
+/* a file big enough to need the single and the double indirect block,
+ * on test3.img. Read back cold, each pointer block is read once.
+ */
+START_TEST(fs_indirect_test)
+{
+    const char *filename = "/indirect_test.bin";
+    int nblocks = 1017 + 1024 + 100;    // direct + single + some double
+    size_t len = (size_t) nblocks * FS_BLOCK_SIZE, chunk = 32 * FS_BLOCK_SIZE;
+    size_t off, n;
+    char *write_buf = malloc(len);
+    char *read_buf = malloc(len);
+    struct blk_stats before, after;
+    struct statvfs st0, st;
+    int r;
+
+    for (size_t i = 0; i < len; i += 8)
+        *(uint64_t *) (write_buf + i) = i;
+
+    mount_image("test3.img");
+    make_file(filename, NULL, 0, &st0);
+    for (off = 0; off < len; off += n) {
+        n = len - off < chunk ? len - off : chunk;
+        r = fs_ops.write(filename, write_buf + off, n, off, &test_fi);
+        ck_assert_int_eq(r, n);
+    }
+    // the data, the inode and 3 pointer blocks: single, double, 1 leaf
+    ck_assert_int_eq(fs_ops.statfs("/", &st), 0);
+    ck_assert_int_eq(st.f_bfree, st0.f_bfree - nblocks - 1 - 3);
+
+    mount_cold("test3.img");
+    block_get_stats(&before);
+    for (off = 0; off < len; off += n) {
+        n = len - off < chunk ? len - off : chunk;
+        r = fs_ops.read(filename, read_buf + off, n, off, &test_fi);
+        ck_assert_int_eq(r, n);
+    }
+    block_get_stats(&after);
+    ck_assert_int_eq(memcmp(write_buf, read_buf, len), 0);
+    ck_assert_int_le(after.blocks_read - before.blocks_read,
+                     nblocks + 3 + 4);  // + root inode/dir, inode, bitmap
+
+    r = fs_ops.unlink(filename);
+    ck_assert_int_eq(r, 0);
+    ck_assert_int_eq(fs_ops.statfs("/", &st), 0);
+    ck_assert_int_eq(st.f_bfree, st0.f_bfree);
+
+    mount_image("test2.img");
+    free(write_buf);
+    free(read_buf);
+}
+END_TEST
+
+/* test5.img maps regular files with extents, in inodes with room for
+ * only a few of them. /file.frag is blocks 3-5 and 9-10.
+ */
+START_TEST(fs_extent_test)
+{
+    int nblocks = 1000, nfrag = 40;
+    size_t len = (size_t) nblocks * FS_BLOCK_SIZE;
+    char *write_buf = malloc(len);
+    char *read_buf = malloc(len);
+    char blk[FS_BLOCK_SIZE];
+    struct blk_stats before, after;
+    struct statvfs st0, st;
+    int i, r;
+
+    for (size_t j = 0; j < len; j += 8)
+        *(uint64_t *) (write_buf + j) = j;
+
+    mount_image("test5.img");
+    ck_assert_int_eq(fs_ops.statfs("/", &st0), 0);
+    ck_assert_int_eq(st0.f_blocks, 2000 - 1 - 1 - 16 - 1);
+    ck_assert_int_eq(st0.f_bfree, st0.f_blocks - 6);
+
+    r = fs_ops.read("/file.frag", read_buf, 20000, 0, &test_fi);
+    ck_assert_int_eq(r, 20000);
+    ck_assert_int_eq(block_read(blk, 9, 1), 0);
+    ck_assert_int_eq(memcmp(read_buf + 3 * FS_BLOCK_SIZE, blk, FS_BLOCK_SIZE), 0);
+
+    // one extent, in the inode: no blocks besides the data
+    r = make_file("/big", write_buf, len, NULL);
+    ck_assert_int_eq(r, len);
+    ck_assert_int_eq(fs_ops.statfs("/", &st), 0);
+    ck_assert_int_eq(st.f_bfree, st0.f_bfree - nblocks);
+
+    // two files appended to in turn get an extent per block, more than
+    // fit in the inode, so each moves them out to an extent block
+    ck_assert_int_eq(fs_ops.create("/a", S_IFREG | 0644, &test_fi), 0);
+    ck_assert_int_eq(fs_ops.create("/b", S_IFREG | 0644, &test_fi), 0);
+    for (i = 0; i < nfrag; i++) {
+        r = fs_ops.write("/a", write_buf + i * FS_BLOCK_SIZE, FS_BLOCK_SIZE,
+                         i * FS_BLOCK_SIZE, &test_fi);
+        ck_assert_int_eq(r, FS_BLOCK_SIZE);
+        r = fs_ops.write("/b", write_buf + (nfrag + i) * FS_BLOCK_SIZE,
+                         FS_BLOCK_SIZE, i * FS_BLOCK_SIZE, &test_fi);
+        ck_assert_int_eq(r, FS_BLOCK_SIZE);
+    }
+    ck_assert_int_eq(fs_ops.statfs("/", &st), 0);
+    ck_assert_int_eq(st.f_bfree, st0.f_bfree - nblocks - 2 * nfrag - 2);
+
+    mount_cold("test5.img");
+    block_get_stats(&before);
+    r = fs_ops.read("/big", read_buf, len, 0, &test_fi);
+    ck_assert_int_eq(r, len);
+    block_get_stats(&after);
+    ck_assert_int_eq(memcmp(write_buf, read_buf, len), 0);
+    // the root directory, an inode table block and the data
+    ck_assert_int_le(after.blocks_read - before.blocks_read, nblocks + 2);
+
+    r = fs_ops.read("/a", read_buf, nfrag * FS_BLOCK_SIZE, 0, &test_fi);
+    ck_assert_int_eq(r, nfrag * FS_BLOCK_SIZE);
+    r = fs_ops.read("/b", read_buf + r, nfrag * FS_BLOCK_SIZE, 0,
+                    &test_fi);
+    ck_assert_int_eq(r, nfrag * FS_BLOCK_SIZE);
+    ck_assert_int_eq(memcmp(write_buf, read_buf, 2 * nfrag * FS_BLOCK_SIZE), 0);
+
+    // truncate and unlink free whole extents, and the extent blocks
+    ck_assert_int_eq(fs_ops.truncate("/a", 0), 0);
+    ck_assert_int_eq(fs_ops.statfs("/", &st), 0);
+    ck_assert_int_eq(st.f_bfree, st0.f_bfree - nblocks - nfrag - 1);
+    ck_assert_int_eq(fs_ops.unlink("/a"), 0);
+    ck_assert_int_eq(fs_ops.unlink("/b"), 0);
+    ck_assert_int_eq(fs_ops.unlink("/big"), 0);
+    ck_assert_int_eq(fs_ops.statfs("/", &st), 0);
+    ck_assert_int_eq(st.f_bfree, st0.f_bfree);
+
+    mount_image("test2.img");
+    free(write_buf);
+    free(read_buf);
+}
+END_TEST
+
+/* test5.img also keeps files of up to FS_DINODE_PTRS * 4 bytes inline,
+ * in the inode. /file.10 is one.
+ */
+START_TEST(fs_inline_test)
+{
+    int max = FS_DINODE_PTRS * 4;
+    char buf[3 * FS_BLOCK_SIZE], read_buf[sizeof(buf)];
+    struct blk_stats before, after;
+    struct statvfs st0, st;
+    int i, r;
+
+    for (i = 0; i < sizeof(buf); i++)
+        buf[i] = 'a' + i % 26;
+
+    // cold: an inode table block and the root directory, no data block
+    mount_image("test5.img");
+    block_get_stats(&before);
+    r = fs_ops.read("/file.10", read_buf, sizeof(read_buf), 0, &test_fi);
+    ck_assert_int_eq(r, 10);
+    block_get_stats(&after);
+    ck_assert_int_le(after.blocks_read - before.blocks_read, 2);
+    for (i = 0; i < 10; i++)
+        ck_assert(isalpha(read_buf[i]));
+    ck_assert_int_eq(fs_ops.statfs("/", &st0), 0);
+
+    // grows in place while it fits
+    r = make_file("/small", buf, 100, NULL);
+    ck_assert_int_eq(r, 100);
+    r = fs_ops.write("/small", buf + 100, max - 100, 100, &test_fi);
+    ck_assert_int_eq(r, max - 100);
+    ck_assert_int_eq(fs_ops.statfs("/", &st), 0);
+    ck_assert_int_eq(st.f_bfree, st0.f_bfree);
+
+    // then moves to a block
+    r = fs_ops.write("/small", buf + max, 1, max, &test_fi);
+    ck_assert_int_eq(r, 1);
+    ck_assert_int_eq(fs_ops.statfs("/", &st), 0);
+    ck_assert_int_eq(st.f_bfree, st0.f_bfree - 1);
+
+    // straight past the limit from empty
+    r = make_file("/big", buf, 5000, NULL);
+    ck_assert_int_eq(r, 5000);
+
+    mount_image("test5.img");
+    r = fs_ops.read("/small", read_buf, sizeof(read_buf), 0, &test_fi);
+    ck_assert_int_eq(r, max + 1);
+    ck_assert_int_eq(memcmp(buf, read_buf, max + 1), 0);
+    r = fs_ops.read("/big", read_buf, sizeof(read_buf), 0, &test_fi);
+    ck_assert_int_eq(r, 5000);
+    ck_assert_int_eq(memcmp(buf, read_buf, 5000), 0);
+    ck_assert_int_eq(fs_ops.statfs("/", &st), 0);
+    ck_assert_int_eq(st.f_bfree, st0.f_bfree - 1 - 2);
+
+    // truncating frees the block, and the file is inline again
+    ck_assert_int_eq(fs_ops.truncate("/small", 0), 0);
+    r = fs_ops.write("/small", buf, 50, 0, &test_fi);
+    ck_assert_int_eq(r, 50);
+    r = fs_ops.read("/small", read_buf, sizeof(read_buf), 0, &test_fi);
+    ck_assert_int_eq(r, 50);
+    ck_assert_int_eq(memcmp(buf, read_buf, 50), 0);
+    ck_assert_int_eq(fs_ops.statfs("/", &st), 0);
+    ck_assert_int_eq(st.f_bfree, st0.f_bfree - 2);
+
+    ck_assert_int_eq(fs_ops.unlink("/small"), 0);
+    ck_assert_int_eq(fs_ops.unlink("/big"), 0);
+    ck_assert_int_eq(fs_ops.statfs("/", &st), 0);
+    ck_assert_int_eq(st.f_bfree, st0.f_bfree);
+
+    mount_image("test2.img");
+}
+END_TEST
+
+static int count_filler(void *ptr, const char *name, const struct stat *stbuf,
+                        off_t off)
+{
+    (*(int *) ptr)++;
+    return 0;
+}
+
+/* test3.img has hashed directories: a directory of thousands of
+ * entries, where looking one up reads the index and one bucket.
+ */
+START_TEST(fs_dirindex_test)
+{
+    int nfiles = 3000;
+    struct blk_stats before, after;
+    struct statvfs st0, st;
+    struct stat sb;
+    char name[64];
+    int i, n, r;
+
+    mount_image("test3.img");
+    ck_assert_int_eq(fs_ops.statfs("/", &st0), 0);
+    ck_assert_int_eq(fs_ops.mkdir("/big", 0755), 0);
+    for (i = 0; i < nfiles; i++) {
+        sprintf(name, "/big/file-%d", i);
+        r = fs_ops.create(name, S_IFREG | 0644, &test_fi);
+        ck_assert_int_eq(r, 0);
+    }
+    ck_assert_int_eq(fs_ops.create("/big/file-7", S_IFREG | 0644,
+                                   &test_fi), -EEXIST);
+
+    // cold: root inode and block, /big's inode, index and bucket, and
+    // the file's inode
+    mount_image("test3.img");
+    for (i = 0; i < nfiles; i += 599) {
+        sprintf(name, "/big/file-%d", i);
+        block_get_stats(&before);
+        ck_assert_int_eq(fs_ops.getattr(name, &sb), 0);
+        block_get_stats(&after);
+        ck_assert_int_le(after.blocks_read - before.blocks_read, 6);
+    }
+    n = 0;
+    ck_assert_int_eq(fs_ops.readdir("/big", &n, count_filler, 0, NULL), 0);
+    ck_assert_int_eq(n, nfiles + 2);
+
+    ck_assert_int_eq(fs_ops.rename("/big/file-1", "/big/renamed"), 0);
+    ck_assert_int_eq(fs_ops.getattr("/big/file-1", &sb), -ENOENT);
+    ck_assert_int_eq(fs_ops.getattr("/big/renamed", &sb), 0);
+    ck_assert_int_eq(fs_ops.rename("/big/renamed", "/big/file-2"), -EEXIST);
+    ck_assert_int_eq(fs_ops.rename("/big/renamed", "/big/file-1"), 0);
+
+    ck_assert_int_eq(fs_ops.rmdir("/big"), -ENOTEMPTY);
+    for (i = 0; i < nfiles; i++) {
+        sprintf(name, "/big/file-%d", i);
+        ck_assert_int_eq(fs_ops.unlink(name), 0);
+    }
+    ck_assert_int_eq(fs_ops.rmdir("/big"), 0);
+    ck_assert_int_eq(fs_ops.statfs("/", &st), 0);
+    ck_assert_int_eq(st.f_bfree, st0.f_bfree);
+
+    mount_image("test2.img");
+}
+END_TEST
+
+/* checks each entry's attributes against the mode its name says it
+ * should have: "." 0700, ".." 0750, and "f-<i>" 0600 + i % 8
+ */
+static int mode_filler(void *ptr, const char *name, const struct stat *stbuf,
+                       off_t off)
+{
+    int *n = ptr;
+    mode_t mode;
+
+    if (strcmp(name, ".") == 0)
+        mode = S_IFDIR | 0700;
+    else if (strcmp(name, "..") == 0)
+        mode = S_IFDIR | 0750;
+    else
+        mode = S_IFREG | (0600 + atoi(name + 2) % 8);
+    if (stbuf != NULL && stbuf->st_mode == mode)
+        (*n)++;
+    return 0;
+}
+
+/* readdir stats entries by the inode number in the dirent: a cold
+ * listing reads the path once and each inode table block once, and
+ * ".." has the parent's attributes.
+ */
+START_TEST(fs_readdir_stat_test)
+{
+    struct blk_stats before, after;
+    struct stat sb;
+    int nfiles = 100;
+    char name[64];
+    int i, n;
+
+    mount_image("test4.img");
+    ck_assert_int_eq(fs_ops.mkdir("/a", 0750), 0);
+    ck_assert_int_eq(fs_ops.mkdir("/a/b", 0700), 0);
+    for (i = 0; i < nfiles; i++) {
+        sprintf(name, "/a/b/f-%d", i);
+        ck_assert_int_eq(fs_ops.create(name, S_IFREG | (0600 + i % 8),
+                                       &test_fi), 0);
+    }
+
+    // root, /a and /a/b: inode and block each, then the inodes of the
+    // entries, 16 to a block
+    mount_image("test4.img");
+    n = 0;
+    block_get_stats(&before);
+    ck_assert_int_eq(fs_ops.readdir("/a/b", &n, mode_filler, 0, NULL), 0);
+    block_get_stats(&after);
+    ck_assert_int_eq(n, nfiles + 2);
+    ck_assert_int_le(after.blocks_read - before.blocks_read,
+                     3 + DIV_ROUND_UP(nfiles + 4, FS_DINODES_PER_BLOCK));
+
+    // the inode blocks are one batch even with no block cache to hold
+    // them (the path's inodes and names are still cached)
+    fs_opts.cache_size = 0;
+    mount_image("test4.img");
+    ck_assert_int_eq(fs_ops.getattr("/a/b", &sb), 0);
+    n = 0;
+    block_get_stats(&before);
+    ck_assert_int_eq(fs_ops.readdir("/a/b", &n, mode_filler, 0, NULL), 0);
+    block_get_stats(&after);
+    ck_assert_int_eq(n, nfiles + 2);
+    ck_assert_int_le(after.blocks_read - before.blocks_read,
+                     3 + DIV_ROUND_UP(nfiles + 4, FS_DINODES_PER_BLOCK));
+    fs_opts.cache_size = 16 << 20;
+    mount_image("test4.img");
+
+    ck_assert_int_eq(fs_ops.readdir("/a/b/f-1", &n, mode_filler, 0, NULL),
+                     -ENOTDIR);
+    ck_assert_int_eq(fs_ops.readdir("/a/c", &n, mode_filler, 0, NULL),
+                     -ENOENT);
+
+    for (i = 0; i < nfiles; i++) {
+        sprintf(name, "/a/b/f-%d", i);
+        ck_assert_int_eq(fs_ops.unlink(name), 0);
+    }
+    ck_assert_int_eq(fs_ops.rmdir("/a/b"), 0);
+    ck_assert_int_eq(fs_ops.rmdir("/a"), 0);
+
+    mount_image("test2.img");
+}
+END_TEST
+
+/* the inode-number operations fuse-ll uses agree with the path ones
+ */
+START_TEST(fs_ino_test)
+{
+    char buf[6000], read_buf[6000];
+    struct statvfs st0, st;
+    struct stat sb, sb2;
+    int dir, file, i, n;
+
+    for (i = 0; i < sizeof(buf); i++)
+        buf[i] = 'a' + i % 26;
+    ck_assert_int_eq(fs_ops.statfs("/", &st0), 0);
+
+    dir = fs_mknod_ino(2, "ll", S_IFDIR | 0755, 500, 500);
+    ck_assert_int_gt(dir, 2);
+    file = fs_mknod_ino(dir, "f", S_IFREG | 0644, 500, 500);
+    ck_assert_int_gt(file, 2);
+    ck_assert_int_eq(fs_mknod_ino(dir, "f", S_IFREG | 0644, 500, 500),
+                     -EEXIST);
+    ck_assert_int_eq(fs_mknod_ino(file, "g", S_IFREG | 0644, 500, 500),
+                     -ENOTDIR);
+    ck_assert_int_eq(fs_mknod_ino(dir, "a-name-too-long-for-a-dirent",
+                                  S_IFREG | 0644, 500, 500), -ENAMETOOLONG);
+
+    ck_assert_int_eq(fs_write_ino(file, buf, sizeof(buf), 0), sizeof(buf));
+    ck_assert_int_eq(fs_write_ino(dir, buf, 10, 0), -EISDIR);
+    ck_assert_int_eq(fs_lookup_ino(2, "ll", &sb), dir);
+    memset(&sb, 0, sizeof(sb));
+    memset(&sb2, 0, sizeof(sb2));
+    ck_assert_int_eq(fs_lookup_ino(dir, "f", &sb), file);
+    ck_assert_int_eq(sb.st_ino, file);
+    ck_assert_int_eq(sb.st_size, sizeof(buf));
+    ck_assert_int_eq(fs_ops.getattr("/ll/f", &sb2), 0);
+    ck_assert_int_eq(memcmp(&sb, &sb2, sizeof(sb)), 0);
+    ck_assert_int_eq(fs_lookup_ino(dir, "g", &sb), -ENOENT);
+
+    n = fs_read_ino(file, read_buf, sizeof(read_buf), 0);
+    ck_assert_int_eq(n, sizeof(buf));
+    ck_assert_int_eq(memcmp(buf, read_buf, n), 0);
+    ck_assert_int_eq(fs_read_ino(file, read_buf, 100, 5990), 10);
+
+    ck_assert_int_eq(fs_chmod_ino(file, 0600), 0);
+    ck_assert_int_eq(fs_utime_ino(file, 1000), 0);
+    ck_assert_int_eq(fs_ops.getattr("/ll/f", &sb), 0);
+    ck_assert_int_eq(sb.st_mode, S_IFREG | 0600);
+    ck_assert_int_eq(sb.st_mtime, 1000);
+
+    n = 0;
+    ck_assert_int_eq(fs_readdir_ino(dir, 2, &n, count_filler), 0);
+    ck_assert_int_eq(n, 3);
+    ck_assert_int_eq(fs_readdir_ino(file, dir, &n, count_filler), -ENOTDIR);
+
+    ck_assert_int_eq(fs_rename_ino(dir, "f", 2, "f"), -EINVAL);
+    ck_assert_int_eq(fs_rename_ino(dir, "f", dir, "g"), 0);
+    ck_assert_int_eq(fs_ops.getattr("/ll/g", &sb), 0);
+    ck_assert_int_eq(fs_ops.getattr("/ll/f", &sb), -ENOENT);
+
+    ck_assert_int_eq(fs_truncate_ino(file, 0), 0);
+    ck_assert_int_eq(fs_read_ino(file, read_buf, 100, 0), 0);
+    ck_assert_int_eq(fs_rmdir_ino(2, "ll"), -ENOTEMPTY);
+    ck_assert_int_eq(fs_unlink_ino(dir, "ll"), -ENOENT);
+    ck_assert_int_eq(fs_unlink_ino(dir, "g"), 0);
+    ck_assert_int_eq(fs_unlink_ino(2, "ll"), -EISDIR);
+    ck_assert_int_eq(fs_rmdir_ino(2, "ll"), 0);
+    ck_assert_int_eq(fs_ops.statfs("/", &st), 0);
+    ck_assert_int_eq(st.f_bfree, st0.f_bfree);
+}
+END_TEST
+
 int main(int argc, char **argv)
 {
     block_init("test2.img");
@@ -720,6 +1733,24 @@ int main(int argc, char **argv)
     tcase_add_test(tc, fs_truncate_test);
     tcase_add_test(tc, fs_read_test);
     tcase_add_test(tc, fs_write_test);
+    tcase_add_test(tc, fs_writeback_test);
+    tcase_add_test(tc, fs_writeback_free_test);
+    tcase_add_test(tc, fs_readahead_test);
+    tcase_add_test(tc, fs_coalesced_read_test);
+    tcase_add_test(tc, fs_write_no_rmw_test);
+    tcase_add_test(tc, fs_contig_append_test);
+    tcase_add_test(tc, fs_atime_test);
+    tcase_add_test(tc, fs_dcache_invalidate_test);
+    tcase_add_test(tc, fs_alloc_full_test);
+    tcase_add_test(tc, fs_statfs_remount_test);
+    tcase_add_test(tc, fs_big_volume_test);
+    tcase_add_test(tc, fs_itable_test);
+    tcase_add_test(tc, fs_indirect_test);
+    tcase_add_test(tc, fs_extent_test);
+    tcase_add_test(tc, fs_inline_test);
+    tcase_add_test(tc, fs_dirindex_test);
+    tcase_add_test(tc, fs_readdir_stat_test);
+    tcase_add_test(tc, fs_ino_test);
 
     suite_add_tcase(s, tc);
     SRunner *sr = srunner_create(s);
@@ -0,0 +1,316 @@
+/*
+ * file:        uring.c
+ * description: io_uring block backend. Talks to the kernel directly
+ *              through io_uring_setup/io_uring_enter, so there is no
+ *              liburing dependency.
+ */
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#include "fs5600.h"
+#include "blkdev.h"
+
+/* one ring per thread, so submitters never contend on a lock. Every
+ * submit waits for all of its completions, so the ring never holds
+ * more than BLK_BATCH_MAX requests.
+ */
+#define URING_ENTRIES BLK_BATCH_MAX
+
+struct uring {
+    int fd;
+    void *sq_ptr, *cq_ptr;
+    size_t sq_sz, cq_sz;
+    struct io_uring_sqe *sqes;
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    int broken;                 /* unsubmitted requests left in the SQ */
+};
+
+static int uring_fd = -1;
+static pthread_key_t uring_key;
+static pthread_once_t uring_once = PTHREAD_ONCE_INIT;
+static __thread struct uring *tls_ring;
+
+static int sys_setup(unsigned entries, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter(int fd, unsigned submit, unsigned wait, unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, fd, submit, wait, flags, NULL, 0);
+}
+
+static void ring_free(void *arg)
+{
+    struct uring *r = arg;
+
+    if (r->sqes != NULL)
+        munmap(r->sqes, URING_ENTRIES * sizeof(struct io_uring_sqe));
+    if (r->cq_ptr != NULL && r->cq_ptr != r->sq_ptr)
+        munmap(r->cq_ptr, r->cq_sz);
+    if (r->sq_ptr != NULL)
+        munmap(r->sq_ptr, r->sq_sz);
+    close(r->fd);
+    free(r);
+}
+
+static struct uring *ring_new(void)
+{
+    struct io_uring_params p;
+    struct uring *r;
+
+    memset(&p, 0, sizeof(p));
+    if ((r = calloc(1, sizeof(*r))) == NULL)
+        return NULL;
+    if ((r->fd = sys_setup(URING_ENTRIES, &p)) < 0) {
+        free(r);
+        return NULL;
+    }
+
+    r->sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_sz > r->sq_sz)
+            r->sq_sz = r->cq_sz;
+        r->cq_sz = r->sq_sz;
+    }
+
+    r->sq_ptr = mmap(NULL, r->sq_sz, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_ptr == MAP_FAILED) {
+        r->sq_ptr = NULL;
+        goto fail;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        r->cq_ptr = r->sq_ptr;
+    else {
+        r->cq_ptr = mmap(NULL, r->cq_sz, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        if (r->cq_ptr == MAP_FAILED) {
+            r->cq_ptr = NULL;
+            goto fail;
+        }
+    }
+    r->sqes = mmap(NULL, URING_ENTRIES * sizeof(struct io_uring_sqe),
+                   PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        r->sqes = NULL;
+        goto fail;
+    }
+
+    r->sq_tail = (unsigned *) ((char *) r->sq_ptr + p.sq_off.tail);
+    r->sq_mask = (unsigned *) ((char *) r->sq_ptr + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *) ((char *) r->sq_ptr + p.sq_off.array);
+    r->cq_head = (unsigned *) ((char *) r->cq_ptr + p.cq_off.head);
+    r->cq_tail = (unsigned *) ((char *) r->cq_ptr + p.cq_off.tail);
+    r->cq_mask = (unsigned *) ((char *) r->cq_ptr + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *) ((char *) r->cq_ptr + p.cq_off.cqes);
+    return r;
+
+fail:
+    ring_free(r);
+    return NULL;
+}
+
+static void key_init(void)
+{
+    pthread_key_create(&uring_key, ring_free);
+}
+
+static struct uring *ring_get(void)
+{
+    if (tls_ring == NULL) {
+        if ((tls_ring = ring_new()) == NULL)
+            return NULL;
+        pthread_setspecific(uring_key, tls_ring);
+    }
+    return tls_ring;
+}
+
+static void prep(struct io_uring_sqe *sqe, struct blk_req *req, int i)
+{
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->fd = uring_fd;
+    sqe->off = (uint64_t) req->lba * FS_BLOCK_SIZE;
+    sqe->user_data = i;
+    if (req->iov != NULL) {
+        sqe->opcode = req->write ? IORING_OP_WRITEV : IORING_OP_READV;
+        sqe->addr = (uintptr_t) req->iov;
+        sqe->len = req->iovcnt;
+    } else {
+        sqe->opcode = req->write ? IORING_OP_WRITE : IORING_OP_READ;
+        sqe->addr = (uintptr_t) req->buf;
+        sqe->len = req->nblks * FS_BLOCK_SIZE;
+    }
+}
+
+/* the calling thread's ring can't be used again: free it, and the
+ * next request sets up a new one
+ */
+static void ring_drop(struct uring *r)
+{
+    tls_ring = NULL;
+    pthread_setspecific(uring_key, NULL);
+    ring_free(r);
+}
+
+/* wait for the completions of the first 'n' of 'req'. The kernel posts
+ * them whether or not we are waiting, so if io_uring_enter fails this
+ * polls instead: returning early would leave requests in flight on
+ * buffers the caller is about to reuse.
+ */
+static int reap(struct uring *r, struct blk_req *req, int n)
+{
+    unsigned head = *r->cq_head;
+    int done = 0, rv = 0;
+
+    while (done < n) {
+        if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+            if (sys_enter(r->fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 &&
+                errno != EINTR)
+                sched_yield();
+            continue;
+        }
+        struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+        if (cqe->res != req[cqe->user_data].nblks * FS_BLOCK_SIZE)
+            rv = -EIO;
+        head++;
+        done++;
+        __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+    }
+    return rv;
+}
+
+/* queue up to URING_ENTRIES requests, submit them with a single
+ * io_uring_enter, and reap every completion. If submitting fails
+ * partway, the ones that did go out are still waited for, and the
+ * ring is marked broken.
+ */
+static int submit_chunk(struct uring *r, struct blk_req *req, int n)
+{
+    unsigned tail, mask = *r->sq_mask;
+    int i, ret, submitted = 0, rv = 0;
+
+    tail = *r->sq_tail;
+    for (i = 0; i < n; i++, tail++) {
+        prep(&r->sqes[tail & mask], &req[i], i);
+        r->sq_array[tail & mask] = tail & mask;
+    }
+    __atomic_store_n(r->sq_tail, tail, __ATOMIC_RELEASE);
+
+    while (submitted < n) {
+        ret = sys_enter(r->fd, n - submitted, n - submitted,
+                        IORING_ENTER_GETEVENTS);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret < 0) {
+            r->broken = 1;
+            rv = -EIO;
+            break;
+        }
+        submitted += ret;
+    }
+    return reap(r, req, submitted) | rv;
+}
+
+static int uring_submit(struct blk_req *req, int n)
+{
+    struct uring *r = ring_get();
+    int i, c, rv = 0;
+
+    if (r == NULL)
+        return -EIO;
+    for (i = 0; i < n; i += c) {
+        c = (n - i < URING_ENTRIES) ? n - i : URING_ENTRIES;
+        if (submit_chunk(r, req + i, c) < 0)
+            rv = -EIO;
+        if (r->broken) {
+            ring_drop(r);
+            return -EIO;
+        }
+    }
+    return rv;
+}
+
+static int uring_rw(int write, void *buf, const struct iovec *iov,
+                    int iovcnt, int lba, int nblks)
+{
+    struct blk_req req = {.write = write, .buf = buf, .iov = iov,
+                          .iovcnt = iovcnt, .lba = lba, .nblks = nblks};
+    return uring_submit(&req, 1);
+}
+
+static int uring_read(void *buf, int lba, int nblks)
+{
+    return uring_rw(0, buf, NULL, 0, lba, nblks);
+}
+
+static int uring_write(const void *buf, int lba, int nblks)
+{
+    return uring_rw(1, (void *) buf, NULL, 0, lba, nblks);
+}
+
+static int uring_readv(const struct iovec *iov, int iovcnt, int lba, int nblks)
+{
+    return uring_rw(0, NULL, iov, iovcnt, lba, nblks);
+}
+
+static int uring_writev(const struct iovec *iov, int iovcnt, int lba, int nblks)
+{
+    return uring_rw(1, NULL, iov, iovcnt, lba, nblks);
+}
+
+static int uring_open(int fd, int nblks)
+{
+    (void) nblks;
+    pthread_once(&uring_once, key_init);
+    uring_fd = fd;
+    /* set up the caller's ring now, so a kernel without io_uring is
+     * reported at mount time rather than on the first I/O
+     */
+    return ring_get() == NULL ? -1 : 0;
+}
+
+static int uring_flush(void)
+{
+    return fdatasync(uring_fd) < 0 ? -EIO : 0;
+}
+
+static void uring_close(void)
+{
+    if (tls_ring != NULL) {
+        pthread_setspecific(uring_key, NULL);
+        ring_free(tls_ring);
+        tls_ring = NULL;
+    }
+    close(uring_fd);
+    uring_fd = -1;
+}
+
+struct blk_ops uring_ops = {
+    .name = "uring",
+    .open = uring_open,
+    .read = uring_read,
+    .write = uring_write,
+    .readv = uring_readv,
+    .writev = uring_writev,
+    .submit = uring_submit,
+    .flush = uring_flush,
+    .close = uring_close,
+};